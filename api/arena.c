@@ -0,0 +1,88 @@
+#include "../include/core.h"
+#include "../include/debug.h"
+#include "../include/arena.h"
+
+#define CHUNK_DATA(chunk)   ((uint8_t *)(chunk) + CACHE_LINE_SIZE)
+
+static struct arena_chunk *new_chunk(size_t slot_size, size_t nb_slot) {
+    struct arena_chunk *chunk;
+
+    chunk = (struct arena_chunk *)aligned_alloc(CACHE_LINE_SIZE, CACHE_LINE_SIZE + slot_size * nb_slot);
+    if (chunk == NULL) {
+        debug("failed to allocate arena chunk (%ld slots)\n", nb_slot);
+        return NULL;
+    }
+
+    chunk->next = NULL;
+    chunk->nb_slot = nb_slot;
+
+    return chunk;
+}
+
+int payload_arena_init(struct payload_arena *arena, int nb_bytes, int chunk_slots) {
+    if (nb_bytes <= 0 || chunk_slots <= 0) {
+        debug("invalid arena size (bytes : %d, slots : %d)\n", nb_bytes, chunk_slots);
+        return -1;
+    }
+
+    // round slots up to a multiple of the cache line
+    arena->slot_size = ((size_t)nb_bytes + CACHE_LINE_SIZE - 1) & ~((size_t)CACHE_LINE_SIZE - 1);
+    arena->chunk_slots = chunk_slots;
+    arena->head = NULL;
+    arena->current = NULL;
+    arena->nb_used = 0;
+    arena->nb_bytes = 0;
+
+    return 0;
+}
+
+uint8_t *payload_arena_alloc(struct payload_arena *arena) {
+    struct arena_chunk *chunk;
+
+    if (arena->current != NULL && arena->nb_used < arena->current->nb_slot) {
+        return CHUNK_DATA(arena->current) + arena->slot_size * arena->nb_used++;
+    }
+
+    // reuse chunks kept by payload_arena_reset() before allocating new ones
+    chunk = (arena->current == NULL) ? arena->head : arena->current->next;
+
+    if (chunk == NULL) {
+        chunk = new_chunk(arena->slot_size, arena->chunk_slots);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        arena->nb_bytes += CACHE_LINE_SIZE + arena->slot_size * arena->chunk_slots;
+
+        if (arena->current == NULL) {
+            arena->head = chunk;
+        } else {
+            arena->current->next = chunk;
+        }
+    }
+
+    arena->current = chunk;
+    arena->nb_used = 1;
+
+    return CHUNK_DATA(chunk);
+}
+
+// O(1), chunks are kept for the next flow
+void payload_arena_reset(struct payload_arena *arena) {
+    arena->current = NULL;
+    arena->nb_used = 0;
+}
+
+void payload_arena_release(struct payload_arena *arena) {
+    struct arena_chunk *chunk = arena->head;
+
+    while (chunk != NULL) {
+        struct arena_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+
+    arena->head = NULL;
+    arena->current = NULL;
+    arena->nb_used = 0;
+    arena->nb_bytes = 0;
+}
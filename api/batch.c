@@ -0,0 +1,388 @@
+#include <dirent.h>
+#include <glob.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "../include/core.h"
+#include "../include/debug.h"
+#include "../include/batch.h"
+
+struct file_list {
+    char **list;
+    size_t nb;
+    size_t capacity;
+};
+
+static int add_file(struct file_list *files, const char *path) {
+    if (files->nb == files->capacity) {
+        size_t new_capacity = (files->capacity == 0) ? BATCH_INITIAL_FILES : files->capacity * 2;
+        char **new_list = (char **)realloc(files->list, sizeof(char *) * new_capacity);
+
+        if (new_list == NULL) {
+            debug("failed to grow file list (%ld)\n", new_capacity);
+            return -1;
+        }
+        files->list = new_list;
+        files->capacity = new_capacity;
+    }
+
+    files->list[files->nb] = strdup(path);
+    if (files->list[files->nb] == NULL) {
+        return -1;
+    }
+    files->nb++;
+
+    return 0;
+}
+
+// regular files under dir_path, recursively
+static int add_directory(struct file_list *files, const char *dir_path) {
+    struct dirent *entry;
+    struct stat st;
+    char path[PATH_MAX];
+    DIR *dir;
+    int ret = 0;
+
+    dir = opendir(dir_path);
+    if (dir == NULL) {
+        error("failed to open directory : %s\n", dir_path);
+        return -1;
+    }
+
+    while (ret == 0 && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        if (snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name) >= (int)sizeof(path)) {
+            debug("path is too long : %s/%s\n", dir_path, entry->d_name);
+            continue;
+        }
+
+        if (stat(path, &st)) {
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            ret = add_directory(files, path);
+        } else if (S_ISREG(st.st_mode)) {
+            ret = add_file(files, path);
+        }
+    }
+
+    closedir(dir);
+
+    return ret;
+}
+
+// one path per line
+static int add_list_file(struct file_list *files, const char *list_path) {
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    FILE *fp;
+    int ret = 0;
+
+    fp = fopen(list_path, "r");
+    if (fp == NULL) {
+        error("failed to open file list : %s\n", list_path);
+        return -1;
+    }
+
+    while (ret == 0 && (len = getline(&line, &size, fp)) != -1) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len > 0) {
+            ret = add_file(files, line);
+        }
+    }
+
+    free(line);
+    fclose(fp);
+
+    return ret;
+}
+
+static int compare_path(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// source is a directory (walked recursively), "@<file>" listing one path per line, a glob pattern or a single file
+// directories and patterns are sorted so the corpus order does not depend on the file system
+int corpus_list_files(const char *source, char ***file_list, size_t *nb_file) {
+    struct file_list files = { NULL, 0, 0 };
+    struct stat st;
+    int ret = 0;
+
+    if (source[0] == '@') {
+        ret = add_list_file(&files, source + 1);
+    } else if (stat(source, &st) == 0 && S_ISDIR(st.st_mode)) {
+        ret = add_directory(&files, source);
+        qsort(files.list, files.nb, sizeof(char *), compare_path);
+    } else if (stat(source, &st) == 0) {
+        ret = add_file(&files, source);
+    } else {
+        glob_t glob_result;
+
+        if (glob(source, 0, NULL, &glob_result) == 0) {
+            for (size_t i = 0; ret == 0 && i < glob_result.gl_pathc; i++) {
+                ret = add_file(&files, glob_result.gl_pathv[i]);
+            }
+        }
+        globfree(&glob_result);
+    }
+
+    if (ret == 0 && files.nb == 0) {
+        error("no capture found : %s\n", source);
+        ret = -1;
+    }
+
+    if (ret) {
+        corpus_release(files.list, files.nb);
+        return -1;
+    }
+
+    *file_list = files.list;
+    *nb_file = files.nb;
+
+    return 0;
+}
+
+void corpus_release(char **file_list, size_t nb_file) {
+    for (size_t i = 0; i < nb_file; i++) {
+        free(file_list[i]);
+    }
+    free(file_list);
+}
+
+struct batch_pool {
+    struct batch_deque *deque_list;
+    int nb_worker;
+    batch_task task_func;
+    batch_lookahead lookahead_func;
+    int lookahead;
+    void *arg;
+    int ret;
+};
+
+struct batch_thread {
+    struct batch_pool *pool;
+    int worker;
+    pthread_t thread;
+};
+
+// one worker per online core, no more than tasks
+int batch_nb_worker(size_t nb_task) {
+    long nb_core = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (nb_core < 1) {
+        nb_core = 1;
+    }
+    if ((size_t)nb_core > nb_task) {
+        nb_core = (nb_task > 0) ? (long)nb_task : 1;
+    }
+
+    return (int)nb_core;
+}
+
+// end is the end of the range left to the owner, at the time of the pop
+static int pop_task(struct batch_deque *deque, size_t *index, size_t *end) {
+    int ret = -1;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->begin < deque->end) {
+        *index = deque->begin++;
+        *end = deque->end;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return ret;
+}
+
+// moves the upper half of the first non empty victim into the (empty) deque of worker
+// tasks are never added, so nothing left to steal means the batch is over
+static int steal_tasks(struct batch_pool *pool, int worker) {
+    for (int i = 1; i < pool->nb_worker; i++) {
+        struct batch_deque *victim = &pool->deque_list[(worker + i) % pool->nb_worker];
+        struct batch_deque *own = &pool->deque_list[worker];
+        size_t begin, end;
+
+        pthread_mutex_lock(&victim->lock);
+        end = victim->end;
+        begin = end - (end - victim->begin + 1) / 2;
+        victim->end = begin;
+        pthread_mutex_unlock(&victim->lock);
+
+        if (begin == end) {
+            continue;
+        }
+
+        pthread_mutex_lock(&own->lock);
+        own->begin = begin;
+        own->end = end;
+        pthread_mutex_unlock(&own->lock);
+
+        return 0;
+    }
+
+    return -1;
+}
+
+static void *batch_worker(void *arg) {
+    struct batch_thread *thread = (struct batch_thread *)arg;
+    struct batch_pool *pool = thread->pool;
+    struct batch_deque *own = &pool->deque_list[thread->worker];
+    size_t index, end;
+    size_t ahead = 0;           /* next task to announce to lookahead_func */
+
+    for (;;) {
+        if (pop_task(own, &index, &end)) {
+            if (steal_tasks(pool, thread->worker) || pop_task(own, &index, &end)) {
+                break;
+            }
+            ahead = index;
+        }
+
+        // the next tasks of the own range, in the order they are run unless they are stolen
+        if (pool->lookahead_func != NULL) {
+            if (ahead < index) {
+                ahead = index;
+            }
+            while (ahead < end && ahead < index + pool->lookahead) {
+                pool->lookahead_func(ahead++, thread->worker, pool->arg);
+            }
+        }
+
+        if (pool->task_func(index, thread->worker, pool->arg)) {
+            __atomic_store_n(&pool->ret, -1, __ATOMIC_RELAXED);
+        }
+    }
+
+    return NULL;
+}
+
+// runs task_func on [0, nb_task), each worker starts on a contiguous block and steals when it runs dry
+// when lookahead_func is set, it gets each task before task_func, up to lookahead tasks in advance, on the same worker
+// returns -1 if any task failed
+int batch_run(size_t nb_task, int nb_worker, batch_task task_func, batch_lookahead lookahead_func, int lookahead, void *arg) {
+    struct batch_pool pool;
+    struct batch_thread *thread_list;
+    int nb_started = 0;
+
+    if (nb_worker < 1) {
+        nb_worker = 1;
+    }
+
+    pool.deque_list = (struct batch_deque *)aligned_alloc(CACHE_LINE_SIZE, sizeof(struct batch_deque) * nb_worker);
+    thread_list = (struct batch_thread *)malloc(sizeof(struct batch_thread) * nb_worker);
+    if (pool.deque_list == NULL || thread_list == NULL) {
+        error("Memory allocation failed\n");
+        free(pool.deque_list);
+        free(thread_list);
+        return -1;
+    }
+
+    pool.nb_worker = nb_worker;
+    pool.task_func = task_func;
+    pool.lookahead_func = lookahead_func;
+    pool.lookahead = lookahead;
+    pool.arg = arg;
+    pool.ret = 0;
+
+    for (int i = 0; i < nb_worker; i++) {
+        pthread_mutex_init(&pool.deque_list[i].lock, NULL);
+        pool.deque_list[i].begin = nb_task * i / nb_worker;
+        pool.deque_list[i].end = nb_task * (i + 1) / nb_worker;
+    }
+
+    for (int i = 0; i < nb_worker; i++) {
+        thread_list[i].pool = &pool;
+        thread_list[i].worker = i;
+        if (pthread_create(&thread_list[i].thread, NULL, batch_worker, &thread_list[i])) {
+            debug("failed to start worker %d\n", i);
+            break;
+        }
+        nb_started++;
+    }
+
+    // the tasks of workers that failed to start are stolen by the others
+    if (nb_started == 0) {
+        thread_list[0].pool = &pool;
+        thread_list[0].worker = 0;
+        batch_worker(&thread_list[0]);
+    }
+
+    for (int i = 0; i < nb_started; i++) {
+        pthread_join(thread_list[i].thread, NULL);
+    }
+
+    for (int i = 0; i < nb_worker; i++) {
+        pthread_mutex_destroy(&pool.deque_list[i].lock);
+    }
+
+    free(pool.deque_list);
+    free(thread_list);
+
+    return pool.ret;
+}
+
+int batch_output_init(struct batch_output *output, int mode, size_t nb_line) {
+    memset(output, 0, sizeof(struct batch_output));
+
+    if (mode == BATCH_ORDERED) {
+        output->line_list = (char **)calloc(nb_line, sizeof(char *));
+        if (output->line_list == NULL) {
+            error("Memory allocation failed\n");
+            return -1;
+        }
+    }
+
+    pthread_mutex_init(&output->lock, NULL);
+    output->mode = mode;
+    output->nb_line = nb_line;
+
+    return 0;
+}
+
+static char skipped_line[] = "";
+
+// takes ownership of line, written at once in tagged mode, or once every previous line is written
+// every index must be put once, a NULL line (failed allocation) is skipped
+void batch_output_put(struct batch_output *output, size_t index, char *line) {
+    pthread_mutex_lock(&output->lock);
+
+    if (output->mode == BATCH_TAGGED) {
+        if (line != NULL) {
+            print("%s\n", line);
+            free(line);
+        }
+    } else {
+        output->line_list[index] = (line != NULL) ? line : skipped_line;
+        while (output->next < output->nb_line && output->line_list[output->next] != NULL) {
+            if (output->line_list[output->next] != skipped_line) {
+                print("%s\n", output->line_list[output->next]);
+                free(output->line_list[output->next]);
+            }
+            output->line_list[output->next] = NULL;
+            output->next++;
+        }
+    }
+
+    pthread_mutex_unlock(&output->lock);
+}
+
+void batch_output_release(struct batch_output *output) {
+    if (output->line_list != NULL) {
+        for (size_t i = 0; i < output->nb_line; i++) {
+            if (output->line_list[i] != skipped_line) {
+                free(output->line_list[i]);
+            }
+        }
+        free(output->line_list);
+    }
+
+    pthread_mutex_destroy(&output->lock);
+    memset(output, 0, sizeof(struct batch_output));
+}
@@ -0,0 +1,608 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../include/core.h"
+#include "../include/debug.h"
+#include "../include/trace_parser.h"
+#include "../include/capture.h"
+
+static inline uint16_t read16(const struct capture_reader *reader, const uint8_t *p) {
+    uint16_t value;
+    memcpy(&value, p, sizeof(value));
+    return reader->swapped ? __builtin_bswap16(value) : value;
+}
+
+static inline uint32_t read32(const struct capture_reader *reader, const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return reader->swapped ? __builtin_bswap32(value) : value;
+}
+
+static inline uint64_t read64(const struct capture_reader *reader, const uint8_t *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return reader->swapped ? __builtin_bswap64(value) : value;
+}
+
+static int append_expression(char *expression, size_t size, const char *format, ...) {
+    size_t len = strlen(expression);
+    va_list args;
+    int ret;
+
+    va_start(args, format);
+    ret = vsnprintf(expression + len, size - len, format, args);
+    va_end(args);
+
+    return (ret < 0 || (size_t)ret >= size - len) ? -1 : 0;
+}
+
+// " and (<keyword> a or <keyword> b ...)" for a comma separated list
+static int append_list(char *expression, size_t size, const char *keyword, const char *list) {
+    const char *item = list;
+    int first = 1;
+
+    if (list == NULL || list[0] == '\0') {
+        return 0;
+    }
+
+    if (append_expression(expression, size, " and (")) {
+        return -1;
+    }
+
+    while (*item != '\0') {
+        size_t len = strcspn(item, ",");
+
+        if (len > 0 && append_expression(expression, size, "%s%s %.*s", first ? "" : " or ", keyword, (int)len, item)) {
+            return -1;
+        }
+        if (len > 0) {
+            first = 0;
+        }
+        item += len + (item[len] == ',');
+    }
+
+    return append_expression(expression, size, ")");
+}
+
+static int compile_program(struct bpf_program *program, int linktype, const char *expression) {
+    pcap_t *dead;
+    int ret;
+
+    dead = pcap_open_dead(linktype, CAPTURE_FILTER_SNAPLEN);
+    if (dead == NULL) {
+        error("Memory allocation failed\n");
+        return -1;
+    }
+
+    ret = pcap_compile(dead, program, expression, 1, PCAP_NETMASK_UNKNOWN);
+    if (ret) {
+        error("failed to compile capture filter : %s\n", pcap_geterr(dead));
+    }
+
+    pcap_close(dead);
+
+    return ret;
+}
+
+// packets that can never contribute (not tcp or udp, or without payload) and, when given,
+// packets of other hosts or ports are dropped by the kernel (live) or by libpcap before they reach the link decoder
+// host_list and port_list are comma separated, NULL or empty for none, they match the outer headers of tunneled packets
+// tunnel : gre and ip in ip packets are kept for decapsulation
+int capture_filter_init(struct capture_filter *filter, const char *host_list, const char *port_list, int tunnel) {
+    char vlan_expression[CAPTURE_FILTER_SIZE * 3 + sizeof(CAPTURE_FILTER_VLAN_FORMAT)];
+
+    memset(filter, 0, sizeof(struct capture_filter));
+
+    snprintf(filter->expression, sizeof(filter->expression), "(%s%s)", CAPTURE_FILTER_BASE, tunnel ? CAPTURE_FILTER_TUNNEL : "");
+    if (append_list(filter->expression, sizeof(filter->expression), "host", host_list) ||
+        append_list(filter->expression, sizeof(filter->expression), "port", port_list)) {
+        error("capture filter is too long\n");
+        return -1;
+    }
+    filter->restricted = (host_list != NULL && host_list[0] != '\0') || (port_list != NULL && port_list[0] != '\0');
+
+    debug("capture filter : %s\n", filter->expression);
+
+    // "vlan" does not compile for raw ip
+    snprintf(vlan_expression, sizeof(vlan_expression), CAPTURE_FILTER_VLAN_FORMAT, filter->expression, filter->expression, filter->expression);
+    if (compile_program(&filter->ethernet, DLT_EN10MB, vlan_expression)) {
+        return -1;
+    }
+    filter->has_ethernet = 1;
+
+    if (compile_program(&filter->raw, DLT_RAW, filter->expression)) {
+        capture_filter_release(filter);
+        return -1;
+    }
+    filter->has_raw = 1;
+
+    return 0;
+}
+
+// NULL for link types the filter was not compiled for, their packets are only checked by the link decoder
+const struct bpf_program *capture_filter_program(const struct capture_filter *filter, int linktype) {
+    if (filter == NULL) {
+        return NULL;
+    }
+
+    if (linktype == LINKTYPE_ETHERNET && filter->has_ethernet) {
+        return &filter->ethernet;
+    }
+    if ((linktype == LINKTYPE_RAW || linktype == DLT_RAW) && filter->has_raw) {
+        return &filter->raw;
+    }
+
+    return NULL;
+}
+
+void capture_filter_release(struct capture_filter *filter) {
+    if (filter->has_ethernet) {
+        pcap_freecode(&filter->ethernet);
+    }
+    if (filter->has_raw) {
+        pcap_freecode(&filter->raw);
+    }
+    filter->has_ethernet = filter->has_raw = 0;
+}
+
+static int open_libpcap(struct capture_reader *reader, char *filename, const struct capture_filter *filter) {
+    char error_buf[PCAP_ERRBUF_SIZE];
+    const struct bpf_program *program;
+
+    // same timeline as the native reader, whatever the resolution of the file
+    reader->pcap = pcap_open_offline_with_tstamp_precision(filename, PCAP_TSTAMP_PRECISION_NANO, error_buf);
+    if (reader->pcap == NULL) {
+        debug("failed to open pcap file\n");
+        debug("%s\n", error_buf);
+        return -1;
+    }
+
+    reader->format = CAPTURE_FORMAT_LIBPCAP;
+    reader->linktype = pcap_datalink(reader->pcap);
+    reader->decode = link_decoder(reader->linktype);
+
+    // pcap_setfilter() copies the program, the filter is shared by every reader
+    program = capture_filter_program(filter, reader->linktype);
+    if (program != NULL && pcap_setfilter(reader->pcap, (struct bpf_program *)program)) {
+        debug("failed to set capture filter : %s\n", pcap_geterr(reader->pcap));
+    }
+
+    return 0;
+}
+
+static int map_file(struct capture_reader *reader, char *filename) {
+    struct stat st;
+    void *base;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size < PCAP_FILE_HEADER_SIZE) {
+        close(fd);
+        return -1;
+    }
+
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        debug("failed to map %s\n", filename);
+        return -1;
+    }
+
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+    reader->base = (const uint8_t *)base;
+    reader->size = st.st_size;
+
+    return 0;
+}
+
+static void unmap_file(struct capture_reader *reader) {
+    if (reader->buffer != NULL) {
+        free(reader->buffer);
+        reader->buffer = NULL;
+        reader->base = NULL;
+    } else if (reader->base != NULL) {
+        munmap((void *)reader->base, reader->size);
+        reader->base = NULL;
+    }
+}
+
+static int add_interface(struct capture_reader *reader, int linktype) {
+    if (reader->nb_if == reader->if_capacity) {
+        int new_capacity = (reader->if_capacity == 0) ? 4 : reader->if_capacity * 2;
+        struct capture_interface *new_list;
+
+        new_list = (struct capture_interface *)realloc(reader->if_list, sizeof(struct capture_interface) * new_capacity);
+        if (new_list == NULL) {
+            return -1;
+        }
+        reader->if_list = new_list;
+        reader->if_capacity = new_capacity;
+    }
+
+    reader->if_list[reader->nb_if].linktype = linktype;
+    reader->if_list[reader->nb_if].decode = link_decoder(linktype);
+    reader->if_list[reader->nb_if].ts_units = 1000000;
+    reader->if_list[reader->nb_if].ts_offset = 0;
+
+    if (reader->nb_if == 0) {
+        reader->linktype = linktype;
+        reader->decode = reader->if_list[0].decode;
+    }
+
+    return reader->nb_if++;
+}
+
+static int open_pcap(struct capture_reader *reader) {
+    uint32_t magic;
+
+    memcpy(&magic, reader->base, sizeof(magic));
+
+    switch (magic) {
+    case PCAP_MAGIC_USEC:
+        break;
+    case PCAP_MAGIC_NSEC:
+        reader->nano = 1;
+        break;
+    case PCAP_MAGIC_USEC_SWAPPED:
+        reader->swapped = 1;
+        break;
+    case PCAP_MAGIC_NSEC_SWAPPED:
+        reader->swapped = 1;
+        reader->nano = 1;
+        break;
+    default:
+        return -1;
+    }
+
+    reader->format = CAPTURE_FORMAT_PCAP;
+    reader->offset = PCAP_FILE_HEADER_SIZE;
+
+    // the upper bits of the link type hold the fcs length
+    return (add_interface(reader, read32(reader, reader->base + 20) & 0x03ffffff) < 0) ? -1 : 0;
+}
+
+static int next_pcap(struct capture_reader *reader) {
+    const uint8_t *record = reader->base + reader->offset;
+    struct capture_packet *packet = &reader->packet;
+    uint32_t frac;
+
+    if (reader->size == reader->offset) {
+        return 0;
+    }
+    if (reader->size - reader->offset < PCAP_RECORD_HEADER_SIZE) {
+        debug("truncated pcap record header at %ld\n", reader->offset);
+        return -1;
+    }
+
+    packet->caplen = read32(reader, record + 8);
+    packet->len = read32(reader, record + 12);
+
+    if (packet->caplen > CAPTURE_MAX_CAPLEN || reader->size - reader->offset - PCAP_RECORD_HEADER_SIZE < packet->caplen) {
+        debug("truncated pcap record at %ld\n", reader->offset);
+        return -1;
+    }
+
+    frac = read32(reader, record + 4);
+    packet->timestamp = (int64_t)read32(reader, record) * NSEC_PER_SEC + (reader->nano ? frac : frac * NSEC_PER_USEC);
+    packet->linktype = reader->linktype;
+    packet->decode = reader->decode;
+    packet->data = record + PCAP_RECORD_HEADER_SIZE;
+
+    reader->offset += PCAP_RECORD_HEADER_SIZE + packet->caplen;
+
+    return 1;
+}
+
+// if_tsresol and if_tsoffset, the other options are skipped
+static void parse_idb_options(struct capture_reader *reader, struct capture_interface *interface, const uint8_t *option, const uint8_t *end) {
+    while (end - option >= 4) {
+        uint16_t code = read16(reader, option);
+        uint16_t length = read16(reader, option + 2);
+        const uint8_t *value = option + 4;
+
+        if (code == PCAPNG_OPT_END || end - value < length) {
+            return;
+        }
+
+        if (code == PCAPNG_OPT_IF_TSRESOL && length >= 1) {
+            uint8_t resolution = value[0];
+            uint64_t units = 1;
+
+            // negative power of 2 when the high bit is set, of 10 otherwise
+            if (resolution & 0x80) {
+                units = ((resolution & 0x7f) < 64) ? (1ULL << (resolution & 0x7f)) : 0;
+            } else {
+                for (int i = 0; i < resolution && units != 0; i++) {
+                    units = (units > UINT64_MAX / 10) ? 0 : units * 10;
+                }
+            }
+            if (units != 0) {
+                interface->ts_units = units;
+            }
+        } else if (code == PCAPNG_OPT_IF_TSOFFSET && length >= 8) {
+            interface->ts_offset = (int64_t)read64(reader, value);
+        }
+
+        option = value + ((length + 3) & ~3);
+    }
+}
+
+static void set_pcapng_timestamp(struct capture_packet *packet, struct capture_interface *interface, uint64_t ts) {
+    uint64_t units = interface->ts_units;
+    uint64_t frac = ts % units;
+
+    packet->timestamp = ((int64_t)(ts / units) + interface->ts_offset) * NSEC_PER_SEC;
+    if (units == NSEC_PER_SEC) {
+        packet->timestamp += frac;
+    } else {
+        packet->timestamp += (int64_t)((unsigned __int128)frac * NSEC_PER_SEC / units);
+    }
+}
+
+// a section header sets the byte order of the blocks that follow it
+static int read_section_header(struct capture_reader *reader, const uint8_t *block, size_t remaining) {
+    uint32_t magic;
+
+    if (remaining < 28) {
+        return -1;
+    }
+
+    memcpy(&magic, block + 8, sizeof(magic));
+    if (magic == PCAPNG_BYTE_ORDER_MAGIC) {
+        reader->swapped = 0;
+    } else if (magic == __builtin_bswap32(PCAPNG_BYTE_ORDER_MAGIC)) {
+        reader->swapped = 1;
+    } else {
+        return -1;
+    }
+
+    // interfaces are numbered per section
+    reader->nb_if = 0;
+
+    return 0;
+}
+
+static int open_pcapng(struct capture_reader *reader) {
+    uint32_t type;
+
+    memcpy(&type, reader->base, sizeof(type));
+    if (type != PCAPNG_SHB || read_section_header(reader, reader->base, reader->size)) {
+        return -1;
+    }
+
+    reader->format = CAPTURE_FORMAT_PCAPNG;
+    reader->offset = 0;
+    reader->linktype = -1;
+
+    // link type of the first interface, described before any packet of the section
+    for (size_t offset = 0; reader->size - offset >= 20;) {
+        const uint8_t *block = reader->base + offset;
+        uint32_t length = read32(reader, block + 4);
+
+        if (read32(reader, block) == PCAPNG_IDB) {
+            reader->linktype = read16(reader, block + 8);
+            reader->decode = link_decoder(reader->linktype);
+            break;
+        }
+        if (length < 12 || (length & 3) || length > reader->size - offset) {
+            break;
+        }
+        offset += length;
+    }
+
+    return 0;
+}
+
+// walks the blocks in place until the next packet block
+static int next_pcapng(struct capture_reader *reader) {
+    struct capture_packet *packet = &reader->packet;
+
+    while (reader->size - reader->offset >= 12) {
+        const uint8_t *block = reader->base + reader->offset;
+        size_t remaining = reader->size - reader->offset;
+        uint32_t type, length;
+
+        memcpy(&type, block, sizeof(type));
+        if (type == PCAPNG_SHB && read_section_header(reader, block, remaining)) {
+            debug("invalid pcapng section header at %ld\n", reader->offset);
+            return -1;
+        }
+
+        type = read32(reader, block);
+        length = read32(reader, block + 4);
+        if (length < 12 || (length & 3) || length > remaining) {
+            debug("truncated pcapng block at %ld\n", reader->offset);
+            return -1;
+        }
+        reader->offset += length;
+
+        switch (type) {
+        case PCAPNG_IDB: {
+            int index;
+
+            if (length < 20) {
+                debug("invalid pcapng interface block at %ld\n", reader->offset - length);
+                return -1;
+            }
+            index = add_interface(reader, read16(reader, block + 8));
+            if (index < 0) {
+                error("Memory allocation failed\n");
+                return -1;
+            }
+            parse_idb_options(reader, &reader->if_list[index], block + 16, block + length - 4);
+            break;
+        }
+        case PCAPNG_EPB:
+        case PCAPNG_PB: {
+            uint32_t interface_id;
+            uint64_t ts;
+
+            if (length < 32) {
+                debug("invalid pcapng packet block at %ld\n", reader->offset - length);
+                return -1;
+            }
+
+            interface_id = (type == PCAPNG_EPB) ? read32(reader, block + 8) : read16(reader, block + 8);
+            if (interface_id >= (uint32_t)reader->nb_if) {
+                debug("packet of unknown interface %u\n", interface_id);
+                continue;
+            }
+
+            packet->caplen = read32(reader, block + 20);
+            packet->len = read32(reader, block + 24);
+            if (packet->caplen > length - 32) {
+                debug("invalid pcapng packet length at %ld\n", reader->offset - length);
+                return -1;
+            }
+
+            ts = ((uint64_t)read32(reader, block + 12) << 32) | read32(reader, block + 16);
+            set_pcapng_timestamp(packet, &reader->if_list[interface_id], ts);
+            packet->linktype = reader->if_list[interface_id].linktype;
+            packet->decode = reader->if_list[interface_id].decode;
+            packet->data = block + 28;
+            return 1;
+        }
+        case PCAPNG_SPB:
+            if (length < 16 || reader->nb_if == 0) {
+                continue;
+            }
+
+            // no timestamp, the captured length is bounded by the block
+            packet->len = read32(reader, block + 8);
+            packet->caplen = (packet->len < length - 16) ? packet->len : length - 16;
+            packet->timestamp = 0;
+            packet->linktype = reader->if_list[0].linktype;
+            packet->decode = reader->if_list[0].decode;
+            packet->data = block + 12;
+            return 1;
+        default:
+            break;
+        }
+    }
+
+    if (reader->size != reader->offset) {
+        debug("truncated pcapng block at %ld\n", reader->offset);
+        return -1;
+    }
+
+    return 0;
+}
+
+// classic pcap and pcapng are read in place from a private mapping, anything else goes through libpcap
+// filter (NULL for none) is installed on libpcap handles, the native reader only runs it for host and port restrictions
+int capture_open(struct capture_reader *reader, char *filename, int reader_type, const struct capture_filter *filter) {
+    memset(reader, 0, sizeof(struct capture_reader));
+
+    if (filename == NULL) {
+        debug("ERROR: no pcap input\n");
+        return -1;
+    }
+
+    if (reader_type == CAPTURE_READER_MMAP && map_file(reader, filename) == 0) {
+        if (open_pcap(reader) == 0 || open_pcapng(reader) == 0) {
+            reader->filter = (filter != NULL && filter->restricted) ? filter : NULL;
+            return 0;
+        }
+        debug("unknown capture format, falling back to libpcap\n");
+        unmap_file(reader);
+        free(reader->if_list);
+        memset(reader, 0, sizeof(struct capture_reader));
+    }
+
+    return open_libpcap(reader, filename, filter);
+}
+
+// same as capture_open() on the content of filename already read into buffer, which is freed on close
+// formats the native reader does not handle are read from the file by libpcap
+int capture_open_buffer(struct capture_reader *reader, char *filename, uint8_t *buffer, size_t size, int reader_type, const struct capture_filter *filter) {
+    memset(reader, 0, sizeof(struct capture_reader));
+
+    if (reader_type == CAPTURE_READER_MMAP && size >= PCAP_FILE_HEADER_SIZE) {
+        reader->base = buffer;
+        reader->size = size;
+        reader->buffer = buffer;
+        if (open_pcap(reader) == 0 || open_pcapng(reader) == 0) {
+            reader->filter = (filter != NULL && filter->restricted) ? filter : NULL;
+            return 0;
+        }
+        debug("unknown capture format, falling back to libpcap\n");
+        free(reader->if_list);
+        memset(reader, 0, sizeof(struct capture_reader));
+    }
+
+    free(buffer);
+
+    return open_libpcap(reader, filename, filter);
+}
+
+// the current packet of the native reader against its filter
+static int filter_packet(struct capture_reader *reader) {
+    const struct bpf_program *program = capture_filter_program(reader->filter, reader->packet.linktype);
+    struct pcap_pkthdr header;
+
+    if (program == NULL) {
+        return 1;
+    }
+
+    header.ts.tv_sec = reader->packet.timestamp / NSEC_PER_SEC;
+    header.ts.tv_usec = (reader->packet.timestamp % NSEC_PER_SEC) / NSEC_PER_USEC;
+    header.caplen = reader->packet.caplen;
+    header.len = reader->packet.len;
+
+    return pcap_offline_filter(program, &header, reader->packet.data) != 0;
+}
+
+// 1 with the next packet, 0 at the end of the capture, -1 on failure : a truncated or corrupt capture,
+// the packets returned before are valid
+int capture_next(struct capture_reader *reader, struct capture_packet **packet) {
+    struct pcap_pkthdr *header;
+    const unsigned char *data;
+    int ret;
+
+    *packet = &reader->packet;
+
+    if (reader->format == CAPTURE_FORMAT_PCAP || reader->format == CAPTURE_FORMAT_PCAPNG) {
+        do {
+            ret = (reader->format == CAPTURE_FORMAT_PCAP) ? next_pcap(reader) : next_pcapng(reader);
+        } while (ret > 0 && reader->filter != NULL && !filter_packet(reader));
+
+        return ret;
+    }
+
+    do {
+        ret = pcap_next_ex(reader->pcap, &header, &data);
+    } while (ret == 0);
+
+    if (ret == PCAP_ERROR_BREAK) {
+        return 0;
+    }
+    if (ret < 0) {
+        debug("failed to read capture : %s\n", pcap_geterr(reader->pcap));
+        return -1;
+    }
+
+    // tv_usec holds nanoseconds, the capture was opened with PCAP_TSTAMP_PRECISION_NANO
+    reader->packet.timestamp = (int64_t)header->ts.tv_sec * NSEC_PER_SEC + header->ts.tv_usec;
+    reader->packet.caplen = header->caplen;
+    reader->packet.len = header->len;
+    reader->packet.linktype = reader->linktype;
+    reader->packet.decode = reader->decode;
+    reader->packet.data = data;
+
+    return 1;
+}
+
+void capture_close(struct capture_reader *reader) {
+    if (reader->pcap != NULL) {
+        pcap_close(reader->pcap);
+    }
+    unmap_file(reader);
+    free(reader->if_list);
+    memset(reader, 0, sizeof(struct capture_reader));
+}
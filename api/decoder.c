@@ -0,0 +1,429 @@
+#include "../include/core.h"
+#include "../include/debug.h"
+#include "../include/trace_parser.h"
+#include "../include/decoder.h"
+
+static inline uint16_t read_be16(const unsigned char *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static int decode_tunnel(uint8_t protocol, const unsigned char *header, const unsigned char *end, int depth, struct decoded_packet *decoded);
+static int decode_udp_tunnel(uint16_t port, const unsigned char *header, const unsigned char *end, int depth, struct decoded_packet *decoded);
+
+// tcp or udp header at transport, length : bytes of the datagram from transport on
+// with depth left, a tunnel is decapsulated and the inner packet is decoded in its place
+static inline int decode_transport(const unsigned char *transport, const unsigned char *end, uint8_t protocol, uint64_t length, int depth, struct decoded_packet *decoded) {
+    const struct sniff_tcp *tcp;
+    const struct sniff_udp *udp;
+
+    uint64_t available = end - transport;
+    uint64_t transport_size;
+
+    decoded->protocol = protocol;
+
+    // determine tcp or udp
+    switch (protocol) {
+    case IPPROTO_TCP:
+        if (available < sizeof(struct sniff_tcp)) {
+            return DECODE_SKIP;
+        }
+        tcp = (const struct sniff_tcp *)transport;
+        transport_size = TH_OFF(tcp)*4;
+        decoded->port_src = ntohs(tcp->th_sport);
+        decoded->port_dst = ntohs(tcp->th_dport);
+        decoded->seq = ntohl(tcp->th_seq);
+        break;
+    case IPPROTO_UDP:
+        if (available < sizeof(struct sniff_udp)) {
+            return DECODE_SKIP;
+        }
+        udp = (const struct sniff_udp *)transport;
+        transport_size = 8;
+        decoded->port_src = ntohs(udp->uh_sport);
+        decoded->port_dst = ntohs(udp->uh_dport);
+        if (depth > 0 && (decoded->port_dst == VXLAN_PORT || decoded->port_dst == GTPU_PORT) && length > transport_size) {
+            return decode_udp_tunnel(decoded->port_dst, transport + transport_size, (length < available) ? transport + length : end, depth - 1, decoded);
+        }
+        break;
+    case IPPROTO_GRE:
+    case IPPROTO_IPIP:
+    case IPPROTO_IPV6:
+        if (depth > 0) {
+            return decode_tunnel(protocol, transport, (length < available) ? transport + length : end, depth - 1, decoded);
+        }
+        return DECODE_SKIP;
+    default:
+        // debug("unknown protocol\n");
+        return DECODE_SKIP;
+    }
+
+    if (length <= transport_size) {
+        return DECODE_SKIP;
+    }
+
+    // get payload
+    decoded->payload = (const char *)transport + transport_size;
+    decoded->payload_size = length - transport_size;
+
+    // bytes of the payload actually present in the capture
+    decoded->captured_size = (available > transport_size) ? available - transport_size : 0;
+    if (decoded->captured_size > decoded->payload_size) {
+        decoded->captured_size = decoded->payload_size;
+    }
+
+    return DECODE_APPLICATION;
+}
+
+// the fragment is left to the fragment table, the transport header is only read once the datagram is complete
+static int decode_fragment(const unsigned char *data, const unsigned char *end, uint32_t id, uint32_t offset, int more, uint64_t length, struct decoded_packet *decoded) {
+    uint64_t available = (end > data) ? (uint64_t)(end - data) : 0;
+
+    if (length == 0) {
+        return DECODE_SKIP;
+    }
+
+    decoded->fragment_id = id;
+    decoded->fragment_offset = offset;
+    decoded->fragment_more = more;
+    decoded->payload = (const char *)data;
+    decoded->payload_size = length;
+    decoded->captured_size = (available < length) ? available : length;
+
+    return DECODE_FRAGMENT;
+}
+
+static inline int decode_ipv4(const unsigned char *packet, const unsigned char *end, int depth, struct decoded_packet *decoded) {
+    const struct sniff_ip *ip;
+
+    uint64_t ip_size;
+    uint64_t ip_len;
+
+    if (end - packet < (long)sizeof(struct sniff_ip)) {
+        debug("packet is too short for IP header\n");
+        return DECODE_NO_IP;
+    }
+
+    // get ip
+    ip = (const struct sniff_ip *)packet;
+    ip_address_set_v4(&decoded->ip_src, ip->ip_src.s_addr);
+    ip_address_set_v4(&decoded->ip_dst, ip->ip_dst.s_addr);
+    decoded->protocol = ip->ip_p;
+
+    ip_size = IP_HL(ip)*4;
+    ip_len = ntohs(ip->ip_len);
+
+    if (ip_size < 20 || (ip_size > ip_len && ip_len != 0)) {
+        debug("invalid IP header length\n");
+        return DECODE_SKIP;
+    }
+
+    // segmentation offload captures have no ip length, fall back to the captured length
+    if (ip_len == 0) {
+        ip_len = end - packet;
+    }
+
+    if (ip->ip_off & htons(IP_MF | IP_OFFMASK)) {
+        return decode_fragment(packet + ip_size, end, ntohs(ip->ip_id), (ntohs(ip->ip_off) & IP_OFFMASK) * 8, (ntohs(ip->ip_off) & IP_MF) != 0, ip_len - ip_size, decoded);
+    }
+
+    return decode_transport(packet + ip_size, end, ip->ip_p, ip_len - ip_size, depth, decoded);
+}
+
+// the extension headers are walked up to the transport header, a chain longer than IPV6_EXTENSION_MAX is skipped
+static int decode_ipv6(const unsigned char *packet, const unsigned char *end, int depth, struct decoded_packet *decoded) {
+    const struct sniff_ipv6 *ip6;
+    const struct sniff_ipv6_frag *frag;
+    const unsigned char *header;
+
+    uint64_t remaining;
+    uint64_t header_size;
+    uint8_t next;
+
+    if (end - packet < SIZE_IPV6) {
+        debug("packet is too short for IPv6 header\n");
+        return DECODE_NO_IP;
+    }
+
+    ip6 = (const struct sniff_ipv6 *)packet;
+    ip_address_set_v6(&decoded->ip_src, &ip6->ip6_src);
+    ip_address_set_v6(&decoded->ip_dst, &ip6->ip6_dst);
+
+    // jumbograms and segmentation offload captures have no payload length
+    remaining = ntohs(ip6->ip6_plen);
+    if (remaining == 0) {
+        remaining = (end - packet) - SIZE_IPV6;
+    }
+
+    header = packet + SIZE_IPV6;
+    next = ip6->ip6_nxt;
+
+    for (int i = 0; i <= IPV6_EXTENSION_MAX; i++) {
+        decoded->protocol = next;
+
+        switch (next) {
+        case IPPROTO_TCP:
+        case IPPROTO_UDP:
+        case IPPROTO_GRE:
+        case IPPROTO_IPIP:
+        case IPPROTO_IPV6:
+            return decode_transport(header, end, next, remaining, depth, decoded);
+        case IPPROTO_HOPOPTS:
+        case IPPROTO_ROUTING:
+        case IPPROTO_DSTOPTS:
+        case IPPROTO_MH:
+            if (end - header < 2) {
+                return DECODE_SKIP;
+            }
+            header_size = (header[1] + 1) * 8;
+            break;
+        case IPPROTO_AH:
+            if (end - header < 2) {
+                return DECODE_SKIP;
+            }
+            header_size = (header[1] + 2) * 4;
+            break;
+        case IPPROTO_FRAGMENT:
+            if (end - header < (long)sizeof(struct sniff_ipv6_frag)) {
+                return DECODE_SKIP;
+            }
+            frag = (const struct sniff_ipv6_frag *)header;
+            // an atomic fragment is the whole datagram
+            if (ntohs(frag->ip6f_offlg) & (IP6F_OFF_MASK | IP6F_MORE_FRAG)) {
+                decoded->protocol = frag->ip6f_nxt;
+                return decode_fragment(header + sizeof(struct sniff_ipv6_frag), end, ntohl(frag->ip6f_ident), ntohs(frag->ip6f_offlg) & IP6F_OFF_MASK,
+                                       (ntohs(frag->ip6f_offlg) & IP6F_MORE_FRAG) != 0, (remaining > sizeof(struct sniff_ipv6_frag)) ? remaining - sizeof(struct sniff_ipv6_frag) : 0, decoded);
+            }
+            header_size = sizeof(struct sniff_ipv6_frag);
+            break;
+        default:
+            // esp, no next header, icmpv6 ...
+            return DECODE_SKIP;
+        }
+
+        if (header_size >= remaining) {
+            return DECODE_SKIP;
+        }
+        next = header[0];
+        header += header_size;
+        remaining -= header_size;
+    }
+
+    debug("too many IPv6 extension headers\n");
+    return DECODE_SKIP;
+}
+
+// ip version from the first nibble
+static inline int decode_ip(const unsigned char *packet, const unsigned char *end, int depth, struct decoded_packet *decoded) {
+    if (end - packet >= 1 && (packet[0] >> 4) == 6) {
+        return decode_ipv6(packet, end, depth, decoded);
+    }
+    if (end - packet >= 1 && (packet[0] >> 4) == 4) {
+        return decode_ipv4(packet, end, depth, decoded);
+    }
+
+    return DECODE_NO_IP;
+}
+
+// network header after an ether type
+static inline int decode_ethertype(uint16_t type, const unsigned char *packet, const unsigned char *end, int depth, struct decoded_packet *decoded) {
+    if (type == ETHERTYPE_IPV4) {
+        return decode_ipv4(packet, end, depth, decoded);
+    }
+    if (type == ETHERTYPE_IPV6) {
+        return decode_ipv6(packet, end, depth, decoded);
+    }
+
+    return DECODE_NO_IP;
+}
+
+// plain ipv4 is checked first, the vlan tags (802.1Q, QinQ) only when the ether type is one of them
+static inline int decode_frame(const unsigned char *packet, const unsigned char *end, int depth, struct decoded_packet *decoded) {
+    const unsigned char *header;
+    uint16_t type;
+
+    if (end - packet < SIZE_ETHERNET) {
+        return DECODE_NO_IP;
+    }
+
+    type = read_be16(packet + 12);
+    if (type == ETHERTYPE_IPV4) {
+        return decode_ipv4(packet + SIZE_ETHERNET, end, depth, decoded);
+    }
+
+    header = packet + SIZE_ETHERNET;
+    for (int i = 0; i < VLAN_TAG_MAX && (type == ETHERTYPE_VLAN || type == ETHERTYPE_QINQ || type == ETHERTYPE_QINQ_OLD); i++) {
+        if (end - header < VLAN_TAG_SIZE) {
+            return DECODE_NO_IP;
+        }
+        // tag control information, then the inner ether type
+        type = read_be16(header + 2);
+        header += VLAN_TAG_SIZE;
+    }
+
+    return decode_ethertype(type, header, end, depth, decoded);
+}
+
+// gre (version 0) : ether type after the optional checksum, key and sequence number words
+static int decode_gre(const unsigned char *header, const unsigned char *end, int depth, struct decoded_packet *decoded) {
+    uint16_t flags;
+    uint16_t type;
+    int header_size;
+
+    if (end - header < GRE_HEADER_SIZE) {
+        return DECODE_NO_IP;
+    }
+
+    // version 1 is the enhanced gre of pptp, it carries ppp
+    flags = read_be16(header);
+    if (flags & (GRE_VERSION_MASK | GRE_ROUTING)) {
+        return DECODE_NO_IP;
+    }
+
+    header_size = GRE_HEADER_SIZE + ((flags & GRE_CHECKSUM) ? 4 : 0) + ((flags & GRE_KEY) ? 4 : 0) + ((flags & GRE_SEQUENCE) ? 4 : 0);
+    if (end - header < header_size) {
+        return DECODE_NO_IP;
+    }
+
+    type = read_be16(header + 2);
+    if (type == ETHERTYPE_TEB) {
+        return decode_frame(header + header_size, end, depth, decoded);
+    }
+
+    return decode_ethertype(type, header + header_size, end, depth, decoded);
+}
+
+// gtp-u g-pdu : 8 bytes, 4 more when a sequence number, n-pdu number or extension header is flagged
+static int decode_gtpu(const unsigned char *header, const unsigned char *end, int depth, struct decoded_packet *decoded) {
+    int header_size = GTPU_HEADER_SIZE;
+    uint8_t next;
+
+    if (end - header < GTPU_HEADER_SIZE) {
+        return DECODE_NO_IP;
+    }
+
+    // version 1, gtp (not gtp'), user data : echo and error messages carry no packet
+    if ((header[0] & (GTPU_VERSION_MASK | GTPU_PT)) != (GTPU_VERSION_1 | GTPU_PT) || header[1] != GTPU_GPDU) {
+        return DECODE_NO_IP;
+    }
+
+    if (header[0] & GTPU_OPTIONAL) {
+        header_size += 4;
+        if (end - header < header_size) {
+            return DECODE_NO_IP;
+        }
+
+        // extension headers : length in 4-byte units, next type in the last byte
+        next = (header[0] & GTPU_EXTENSION) ? header[header_size - 1] : 0;
+        for (int i = 0; next != 0; i++) {
+            int extension_size;
+
+            if (i == GTPU_EXTENSION_MAX || end - header < header_size + 1 || header[header_size] == 0) {
+                return DECODE_NO_IP;
+            }
+            extension_size = header[header_size] * 4;
+            if (end - header < header_size + extension_size) {
+                return DECODE_NO_IP;
+            }
+            next = header[header_size + extension_size - 1];
+            header_size += extension_size;
+        }
+    }
+
+    return decode_ip(header + header_size, end, depth, decoded);
+}
+
+// vxlan : 8 bytes with the vni flag set, then an ethernet frame
+static int decode_vxlan(const unsigned char *header, const unsigned char *end, int depth, struct decoded_packet *decoded) {
+    if (end - header < VXLAN_HEADER_SIZE || !(header[0] & VXLAN_FLAG_VNI)) {
+        return DECODE_NO_IP;
+    }
+
+    return decode_frame(header + VXLAN_HEADER_SIZE, end, depth, decoded);
+}
+
+static int decode_udp_tunnel(uint16_t port, const unsigned char *header, const unsigned char *end, int depth, struct decoded_packet *decoded) {
+    if (port == VXLAN_PORT) {
+        return decode_vxlan(header, end, depth, decoded);
+    }
+
+    return decode_gtpu(header, end, depth, decoded);
+}
+
+// ip in ip, ipv6 in ip (either outer version) or gre
+static int decode_tunnel(uint8_t protocol, const unsigned char *header, const unsigned char *end, int depth, struct decoded_packet *decoded) {
+    switch (protocol) {
+    case IPPROTO_IPIP:
+        return decode_ipv4(header, end, depth, decoded);
+    case IPPROTO_IPV6:
+        return decode_ipv6(header, end, depth, decoded);
+    default:
+        return decode_gre(header, end, depth, decoded);
+    }
+}
+
+static int decode_ethernet(const unsigned char *packet, uint32_t caplen, int tunnel_depth, struct decoded_packet *decoded) {
+    return decode_frame(packet, packet + caplen, tunnel_depth, decoded);
+}
+
+static int decode_sll(const unsigned char *packet, uint32_t caplen, int tunnel_depth, struct decoded_packet *decoded) {
+    if (caplen < SIZE_SLL) {
+        return DECODE_NO_IP;
+    }
+
+    return decode_ethertype(read_be16(packet + SLL_PROTOCOL_OFFSET), packet + SIZE_SLL, packet + caplen, tunnel_depth, decoded);
+}
+
+static int decode_sll2(const unsigned char *packet, uint32_t caplen, int tunnel_depth, struct decoded_packet *decoded) {
+    if (caplen < SIZE_SLL2) {
+        return DECODE_NO_IP;
+    }
+
+    return decode_ethertype(read_be16(packet + SLL2_PROTOCOL_OFFSET), packet + SIZE_SLL2, packet + caplen, tunnel_depth, decoded);
+}
+
+static int decode_raw(const unsigned char *packet, uint32_t caplen, int tunnel_depth, struct decoded_packet *decoded) {
+    return decode_ip(packet, packet + caplen, tunnel_depth, decoded);
+}
+
+static int decode_raw_ipv4(const unsigned char *packet, uint32_t caplen, int tunnel_depth, struct decoded_packet *decoded) {
+    return decode_ipv4(packet, packet + caplen, tunnel_depth, decoded);
+}
+
+static int decode_raw_ipv6(const unsigned char *packet, uint32_t caplen, int tunnel_depth, struct decoded_packet *decoded) {
+    return decode_ipv6(packet, packet + caplen, tunnel_depth, decoded);
+}
+
+static int decode_unsupported(const unsigned char *packet, uint32_t caplen, int tunnel_depth, struct decoded_packet *decoded) {
+    return DECODE_NO_IP;
+}
+
+// transport header of a reassembled datagram : data holds its first captured_size bytes, length is its size
+// the addresses of decoded are those of the datagram already
+int decode_datagram(uint8_t protocol, const unsigned char *data, uint64_t captured_size, uint64_t length, int tunnel_depth, struct decoded_packet *decoded) {
+    return decode_transport(data, data + captured_size, protocol, length, tunnel_depth, decoded);
+}
+
+packet_decoder link_decoder(int linktype) {
+    switch (linktype) {
+    case LINKTYPE_ETHERNET:
+        return decode_ethernet;
+    case LINKTYPE_LINUX_SLL:
+        return decode_sll;
+    case LINKTYPE_LINUX_SLL2:
+        return decode_sll2;
+    case LINKTYPE_RAW:
+    case DLT_RAW_LINUX:
+    case DLT_RAW_BSD:
+        return decode_raw;
+    case LINKTYPE_IPV4:
+        return decode_raw_ipv4;
+    case LINKTYPE_IPV6:
+        return decode_raw_ipv6;
+    default:
+        return decode_unsupported;
+    }
+}
+
+int link_supported(int linktype) {
+    return link_decoder(linktype) != decode_unsupported;
+}
@@ -2,122 +2,217 @@
 #include "../include/debug.h"
 #include "../include/trace_parser.h"
 #include "../include/vpn_fingerprint.h"
+#include "../include/simd_kernel.h"
+
+/*
+ * ordinal patterns are looked up from the pairwise comparisons of the window :
+ * bit (j*(j-1)/2 + i) is set when window[j] < window[i] (i < j), so that equal values keep
+ * their order like a stable sort. every order has its own table from those bits to the lehmer code.
+ */
+#define LATER_IS_SMALLER(w, i, j)   ((unsigned)((w)[j] < (w)[i]))
+#define PATTERN_BITS_MAX            10      /* PERMUTATION_ORDER_MAX*(PERMUTATION_ORDER_MAX-1)/2 */
+#define PATTERN_NONE                0xff
+
+static uint8_t pattern_table_3[1 << 3];
+static uint8_t pattern_table_4[1 << 6];
+static uint8_t pattern_table_5[1 << PATTERN_BITS_MAX];
+
+/* x*log(x) for every count a column can reach with the default window */
+#define XLOGX_TABLE_SIZE            (ANALYSIS_WINDOW_SIZE + 1)
+
+static double xlogx_table[XLOGX_TABLE_SIZE];
+static double log_num_patterns[PERMUTATION_ORDER_MAX + 1];
+static double log_256;
+
+static inline unsigned pattern_bits_3(const uint8_t *w) {
+    return LATER_IS_SMALLER(w, 0, 1) | LATER_IS_SMALLER(w, 0, 2) << 1 | LATER_IS_SMALLER(w, 1, 2) << 2;
+}
 
-double calculate_permutation_entropy(uint8_t *sequence, int size, int order) {
-    if (order < 2 || size < order) {
-        fprintf(stderr, "Order must be at least 2 and size must be at least equal to order.\n");
-        return -1.0;
-    }
+static inline unsigned pattern_bits_4(const uint8_t *w) {
+    return pattern_bits_3(w) |
+           LATER_IS_SMALLER(w, 0, 3) << 3 | LATER_IS_SMALLER(w, 1, 3) << 4 | LATER_IS_SMALLER(w, 2, 3) << 5;
+}
 
-    int factorial = 1;
-    for (int i = 2; i <= order; i++) {
-        factorial *= i;
+static inline unsigned pattern_bits_5(const uint8_t *w) {
+    return pattern_bits_4(w) |
+           LATER_IS_SMALLER(w, 0, 4) << 6 | LATER_IS_SMALLER(w, 1, 4) << 7 |
+           LATER_IS_SMALLER(w, 2, 4) << 8 | LATER_IS_SMALLER(w, 3, 4) << 9;
+}
+
+static inline double xlogx(int x) {
+    return (x < XLOGX_TABLE_SIZE) ? xlogx_table[x] : x * log(x);
+}
+
+// lehmer code of the (stable) sorting permutation of window[0..order-1]
+static int ordinal_pattern_generic(const uint8_t *window, int order) {
+    int indexes[PERMUTATION_ORDER_MAX];
+
+    for (int j = 0; j < order; j++) {
+        indexes[j] = j;
     }
-    int num_patterns = factorial;
 
-    int *pattern_counts = (int *)malloc(num_patterns * sizeof(int));
-    if (!pattern_counts) {
-        perror("Failed to allocate memory for pattern_counts");
-        return -1.0;
+    for (int j = 1; j < order; j++) {
+        int key_index = indexes[j];
+        uint8_t key_value = window[key_index];
+        int k = j - 1;
+        while (k >= 0 && window[indexes[k]] > key_value) {
+            indexes[k + 1] = indexes[k];
+            k--;
+        }
+        indexes[k + 1] = key_index;
     }
 
-    for (int i = 0; i < num_patterns; i++) {
-        pattern_counts[i] = 0;
+    int lehmer_code = 0;
+    for (int j = 0; j < order; j++) {
+        int cnt = 0;
+        for (int k = j + 1; k < order; k++) {
+            if (indexes[j] > indexes[k]) {
+                cnt++;
+            }
+        }
+        lehmer_code = lehmer_code * (order - j) + cnt;
     }
 
-    int num_vectors = size - order + 1;
+    return lehmer_code;
+}
 
-    uint8_t *subsequence = (uint8_t *)malloc(order * sizeof(uint8_t));
-    int *indexes = (int *)malloc(order * sizeof(int));
-    if (!subsequence || !indexes) {
-        perror("Failed to allocate memory for temporary arrays");
-        free(pattern_counts);
-        if (subsequence) free(subsequence);
-        if (indexes) free(indexes);
-        return -1.0;
+// every comparison pattern is reached by some permutation of distinct values, ties fall in the same class
+static void fill_pattern_table(uint8_t *table, int order) {
+    uint8_t window[PERMUTATION_ORDER_MAX];
+    int nb_bits = order * (order - 1) / 2;
+    int nb_windows = 1;
+
+    memset(table, PATTERN_NONE, 1 << nb_bits);
+
+    for (int i = 0; i < order; i++) {
+        nb_windows *= order;
     }
 
-    for (int i = 0; i < num_vectors; i++) {
-        for (int j = 0; j < order; j++) {
-            subsequence[j] = sequence[i + j];
-            indexes[j] = j;
+    // every window of values in [0, order), permutations included
+    for (int n = 0; n < nb_windows; n++) {
+        unsigned bits = 0;
+        int value = n;
+
+        for (int i = 0; i < order; i++) {
+            window[i] = value % order;
+            value /= order;
         }
 
         for (int j = 1; j < order; j++) {
-            int key_index = indexes[j];
-            uint8_t key_value = subsequence[key_index];
-            int k = j - 1;
-            while (k >= 0 && subsequence[indexes[k]] > key_value) {
-                indexes[k + 1] = indexes[k];
-                k--;
+            for (int i = 0; i < j; i++) {
+                bits |= LATER_IS_SMALLER(window, i, j) << (j * (j - 1) / 2 + i);
             }
-            indexes[k + 1] = key_index;
         }
+        table[bits] = ordinal_pattern_generic(window, order);
+    }
+}
 
-        int lehmer_code = 0;
-        for (int j = 0; j < order; j++) {
-            int cnt = 0;
-            for (int k = j + 1; k < order; k++) {
-                if (indexes[j] > indexes[k]) {
-                    cnt++;
-                }
-            }
-            lehmer_code = lehmer_code * (order - j) + cnt;
-        }
+__attribute__((constructor)) static void init_entropy_tables() {
+    int factorial = 1;
 
-        if (lehmer_code < 0 || lehmer_code >= num_patterns) {
-            free(pattern_counts);
-            free(subsequence);
-            free(indexes);
-            abort();
-            return -1.0;
-        }
+    fill_pattern_table(pattern_table_3, 3);
+    fill_pattern_table(pattern_table_4, 4);
+    fill_pattern_table(pattern_table_5, 5);
 
-        pattern_counts[lehmer_code]++;
+    xlogx_table[0] = 0.0;
+    for (int i = 1; i < XLOGX_TABLE_SIZE; i++) {
+        xlogx_table[i] = i * log(i);
     }
 
-    double entropy = 0.0;
-    int total_patterns = num_vectors;
-    for (int i = 0; i < num_patterns; i++) {
-        if (pattern_counts[i] > 0) {
-            double p = (double)pattern_counts[i] / total_patterns;
-            entropy -= p * log(p);
-        }
+    for (int i = 2; i <= PERMUTATION_ORDER_MAX; i++) {
+        factorial *= i;
+        log_num_patterns[i] = log(factorial);
     }
+    log_256 = log(256);
+}
 
-    entropy /= log(num_patterns);
+int ordinal_pattern(const uint8_t *window, int order) {
+    switch (order) {
+    case 3:
+        return pattern_table_3[pattern_bits_3(window)];
+    case 4:
+        return pattern_table_4[pattern_bits_4(window)];
+    case 5:
+        return pattern_table_5[pattern_bits_5(window)];
+    default:
+        return ordinal_pattern_generic(window, order);
+    }
+}
 
-    free(pattern_counts);
-    free(subsequence);
-    free(indexes);
+// pattern_counts[0..order!-1] += patterns of every window in sequence
+void count_ordinal_patterns(const uint8_t *sequence, int size, int order, int *pattern_counts) {
+    int num_vectors = size - order + 1;
 
-    return entropy;
+    switch (order) {
+    case 3:
+        for (int i = 0; i < num_vectors; i++) {
+            pattern_counts[pattern_table_3[pattern_bits_3(&sequence[i])]]++;
+        }
+        break;
+    case 4:
+        for (int i = 0; i < num_vectors; i++) {
+            pattern_counts[pattern_table_4[pattern_bits_4(&sequence[i])]]++;
+        }
+        break;
+    case 5:
+        for (int i = 0; i < num_vectors; i++) {
+            pattern_counts[pattern_table_5[pattern_bits_5(&sequence[i])]]++;
+        }
+        break;
+    default:
+        for (int i = 0; i < num_vectors; i++) {
+            pattern_counts[ordinal_pattern_generic(&sequence[i], order)]++;
+        }
+        break;
+    }
 }
 
-double calculate_shannon_entropy(uint8_t *sequence, int size) {
-    if (size <= 0) {
-        abort();
+// H = log(n) - sum(c*log(c))/n, normalized by log(order!)
+double permutation_entropy_from_counts(const int *pattern_counts, int order, int num_vectors) {
+    double sum = 0.0;
+    int num_patterns = 1;
+
+    for (int i = 2; i <= order; i++) {
+        num_patterns *= i;
     }
 
-    int frequencies[256];
+    for (int i = 0; i < num_patterns; i++) {
+        sum += xlogx(pattern_counts[i]);
+    }
+
+    return (xlogx(num_vectors) - sum) / num_vectors / log_num_patterns[order];
+}
+
+double shannon_entropy_from_counts(const int *frequencies, int size) {
+    double sum = 0.0;
+
     for (int i = 0; i < 256; i++) {
-        frequencies[i] = 0;
+        sum += xlogx(frequencies[i]);
     }
 
-    for (int i = 0; i < size; i++) {
-        frequencies[sequence[i]]++;
+    return (xlogx(size) - sum) / size / log_256;
+}
+
+double calculate_permutation_entropy(uint8_t *sequence, int size, int order) {
+    if (order < 2 || order > PERMUTATION_ORDER_MAX || size < order) {
+        fprintf(stderr, "Order must be between 2 and %d and size must be at least equal to order.\n", PERMUTATION_ORDER_MAX);
+        return -1.0;
     }
 
-    double entropy = 0.0;
-    for (int i = 0; i < 256; i++) {
-        if (frequencies[i] > 0) {
-            double p = (double)frequencies[i] / size;
-            entropy -= p * log2(p);
-        }
+    int pattern_counts[PERMUTATION_PATTERN_MAX] = {0};
+
+    count_ordinal_patterns(sequence, size, order, pattern_counts);
+
+    return permutation_entropy_from_counts(pattern_counts, order, size - order + 1);
+}
+
+double calculate_shannon_entropy(uint8_t *sequence, int size) {
+    if (size <= 0) {
+        abort();
     }
 
-    double max_entropy = log2(256);
-    double normalized_entropy = entropy / max_entropy;
+    int frequencies[256];
+    byte_histogram(sequence, size, frequencies);
 
-    return normalized_entropy;
+    return shannon_entropy_from_counts(frequencies, size);
 }
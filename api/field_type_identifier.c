@@ -2,11 +2,18 @@
 #include "../include/debug.h"
 #include "../include/trace_parser.h"
 #include "../include/vpn_fingerprint.h"
+#include "../include/simd_kernel.h"
 
-int stable_ratio = 40;
-int increment_ratio = 60;
-int length_ratio = 50;
-int zero_ratio = 10;
+/* thresholds in percent of nb_packets_needed, per transport protocol */
+struct field_ratio {
+    int stable;
+    int increment;
+    int length;
+    int zero;
+};
+
+static const struct field_ratio tcp_ratio = { 40, 70, 10, 10 };
+static const struct field_ratio udp_ratio = { 50, 70, 70, 50 };
 
 // type_classifier classifier_funcs[] = {
 //     type_stable_classifier,
@@ -17,99 +24,148 @@ int zero_ratio = 10;
 //     NULL,
 // };
 
-static int type_stable_classifier(uint8_t *byte_list, uint64_t nb_packets_needed, double *prob) {
-    uint64_t byte_count[256];
-    uint64_t byte_count_max;
+static int type_stable_classifier(struct column_stats *stats, const struct field_ratio *ratio, int nb_packets_needed, double *prob) {
+    debug("ratio : %d\n", (stats->byte_count_max * 100 / nb_packets_needed));
+    debug("stable : %d\n", ratio->stable);
 
-    for (int i = 0; i < 256; i++) {
-        byte_count[i] = 0;
+    if ((stats->byte_count_max * 100 / nb_packets_needed) > ratio->stable) {
+        *prob = (double)stats->byte_count_max * 100 / nb_packets_needed;
+        debug("return 1\n");
+        return 1;
     }
 
-    for (int i = 0; i < nb_packets_needed; i++) {
-        byte_count[byte_list[i]]++;
-    }
+    return 0;
+}
 
-    byte_count_max = 0;
-    for (int i = 0; i < 256; i++) {
-        if (byte_count_max < byte_count[i]) {
-            byte_count_max = byte_count[i];
-        }
+static int type_increment_classifier(struct column_stats *stats, const struct field_ratio *ratio, int nb_packets_needed, double *prob) {
+    if ((stats->increment_count * 100 / nb_packets_needed) > ratio->increment) {
+        *prob = (double)stats->increment_count * 100 / nb_packets_needed;
+        return 1;
     }
 
-    debug("ratio : %ld\n", (byte_count_max * 100 / nb_packets_needed));
-    debug("stable : %d\n", stable_ratio);
+    return 0;    
+}
 
-    if ((byte_count_max * 100 / nb_packets_needed) > stable_ratio) {
-        *prob = (double)byte_count_max * 100 / nb_packets_needed;
-        debug("return 1\n");
-        return 1;
+static int column_is_zero(const uint8_t *column, int nb_packets_needed) {
+    for (int k = 0; k < nb_packets_needed; k++) {
+        if (column[k] != 0) {
+            return 0;
+        }
     }
 
-    return 0;
+    return 1;
 }
 
-static int type_increment_classifier(uint8_t *byte_list, uint64_t nb_packets_needed, double *prob) {
-    uint64_t increment_count;
-    uint64_t decrement_count;
+#define LENGTH_COUNTER(counts, offset, width, endian) \
+            (&(counts)[(((offset) * LENGTH_WIDTH_MAX + (width) - 1) * 2 + (endian)) * LENGTH_BIAS_WINDOW])
 
-    increment_count = 0;
-    for (int i = 1; i < nb_packets_needed; i++) {
-        debug("%x ", byte_list[i]);
-        if (byte_list[i] > byte_list[i-1]) {
-            increment_count++;
-        }
-    }
-    debug("\n");
+// every (offset, width, endianness) candidate is scored in a single pass over the packets :
+// the bias (actual length - declared length) is counted when it falls in [0, LENGTH_BIAS_WINDOW)
+static int type_length_classifier(const uint8_t *matrix, const uint16_t *length_list, const struct field_ratio *ratio, int nb_packets_needed, int nb_bytes_needed, struct length_field *field) {
+    int *counts;
+    int best_count;
 
-    if ((increment_count * 100 / nb_packets_needed) > increment_ratio) {
-        *prob = (double)increment_count * 100 / nb_packets_needed;
-        return 1;
+    counts = (int *)calloc((size_t)nb_bytes_needed * LENGTH_WIDTH_MAX * 2 * LENGTH_BIAS_WINDOW, sizeof(int));
+    if (counts == NULL) {
+        error("Memory allocation failed\n");
+        return 0;
     }
 
-    return 0;    
-}
+    for (int k = 0; k < nb_packets_needed; k++) {
+        int64_t actual = length_list[k];
 
-static int type_length_classifier(uint16_t *byte_list, uint16_t *length_list, uint64_t nb_packets_needed) {
-    uint16_t diff_index_big, diff_index_little;
-    uint64_t diff_big[65536], diff_little[65536];
+        for (int offset = 0; offset < nb_bytes_needed; offset++) {
+            uint32_t big = 0, little = 0;
 
-    for (int i = 0; i < 32; i++) {
-        diff_big[i] = 0;
-        diff_little[i] = 0;
-    }
+            for (int width = 1; width <= LENGTH_WIDTH_MAX && offset + width <= nb_bytes_needed; width++) {
+                uint32_t byte = matrix[(offset + width - 1) * nb_packets_needed + k];
+                int64_t bias;
 
-    for (int i = 0; i < nb_packets_needed; i++) {
-        diff_index_big = length_list[i] - byte_list[i];
-        diff_index_little = length_list[i] - ((byte_list[i] >> 8) | (byte_list[i] << 8));
+                big = (big << 8) | byte;
+                little |= byte << (8 * (width - 1));
 
-        diff_big[diff_index_big]++;
-        diff_little[diff_index_little]++;
+                bias = actual - big;
+                if (bias >= 0 && bias < LENGTH_BIAS_WINDOW) {
+                    LENGTH_COUNTER(counts, offset, width, LENGTH_BIG_ENDIAN)[bias]++;
+                }
 
-        // debug("[%d] diff_index_big : %d, diff_index_little : %d\n", i, diff_index_big, diff_index_little);
+                // a single byte has no byte order
+                if (width == 1) {
+                    continue;
+                }
+
+                bias = actual - little;
+                if (bias >= 0 && bias < LENGTH_BIAS_WINDOW) {
+                    LENGTH_COUNTER(counts, offset, width, LENGTH_LITTLE_ENDIAN)[bias]++;
+                }
+            }
+        }
     }
 
-    for (int i = 0; i < 32; i++) {
-        // debug("[%d] %f\n", i, (double)diff_big[i] * 100 / nb_packets_needed);
-        // debug("[%d] %f\n", i, (double)diff_little[i] * 100 / nb_packets_needed);
-        if ((diff_big[i] * 100 / nb_packets_needed) >= length_ratio) {
-            return 1;
+    // most matched candidate, then the lowest offset, then the widest field, big endian first
+    best_count = 0;
+    for (int offset = 0; offset < nb_bytes_needed; offset++) {
+        for (int width = LENGTH_WIDTH_MAX; width >= 1; width--) {
+            if (offset + width > nb_bytes_needed) {
+                continue;
+            }
+            for (int endian = LENGTH_BIG_ENDIAN; endian <= LENGTH_LITTLE_ENDIAN; endian++) {
+                int *counter = LENGTH_COUNTER(counts, offset, width, endian);
+
+                for (int bias = 0; bias < LENGTH_BIAS_WINDOW; bias++) {
+                    if (counter[bias] <= best_count) {
+                        continue;
+                    }
+                    best_count = counter[bias];
+                    field->offset = offset;
+                    field->width = width;
+                    field->endian = endian;
+                    field->bias = bias;
+                }
+            }
         }
-        if ((diff_little[i] * 100 / nb_packets_needed) >= length_ratio) {
-            return 1;
+    }
+
+    // constant zero bytes beyond the most significant end of the field match as often as the field itself :
+    // they are padding and left out, down to 2 bytes (the high byte of a 2-byte length below 256 is kept)
+    while (best_count > 0 && field->width > 2) {
+        int high = (field->endian == LENGTH_BIG_ENDIAN) ? field->offset : field->offset + field->width - 1;
+
+        if (!column_is_zero(&matrix[high * nb_packets_needed], nb_packets_needed)) {
+            break;
+        }
+        if (field->endian == LENGTH_BIG_ENDIAN) {
+            field->offset++;
         }
+        field->width--;
     }
-    return 0;
+
+    free(counts);
+
+    if (best_count == 0 || (best_count * 100 / nb_packets_needed) < ratio->length) {
+        return 0;
+    }
+
+    field->ratio = (double)best_count * 100 / nb_packets_needed;
+    debug("length field : offset %d, width %d, %s endian, bias %d (%.1lf%%)\n", field->offset, field->width,
+          field->endian == LENGTH_BIG_ENDIAN ? "big" : "little", field->bias, field->ratio);
+
+    return 1;
 }
 
-static int type_random_classifier(uint8_t *byte_list, uint64_t nb_packets_needed, double *prob) {
+static int type_random_classifier(struct column_stats *stats, int nb_packets_needed, double *prob) {
     const double permutation_threshold = 0.8;
     const double shannon_threshold = 0.5;
 
-    if ((calculate_permutation_entropy(byte_list, nb_packets_needed, 3)) < permutation_threshold) {
+    if (nb_packets_needed < PERMUTATION_ORDER) {
+        return 0;
+    }
+
+    if (permutation_entropy_from_counts(stats->pattern_count, PERMUTATION_ORDER, nb_packets_needed - PERMUTATION_ORDER + 1) < permutation_threshold) {
         return 0;
     }
 
-    if ((calculate_shannon_entropy(byte_list, nb_packets_needed)) < shannon_threshold) {
+    if (shannon_entropy_from_counts(stats->byte_count, nb_packets_needed) < shannon_threshold) {
         return 0;
     }
 
@@ -117,125 +173,170 @@ static int type_random_classifier(uint8_t *byte_list, uint64_t nb_packets_needed
 }
 
 // not used
-static int type_zero_classifier(uint8_t *byte_list, uint64_t nb_packets_needed, double *prob) {
-    uint64_t zero_count;
-
+static int type_zero_classifier(struct column_stats *stats, const struct field_ratio *ratio, int nb_packets_needed, double *prob) {
     return 0;
 
-    zero_count = 0;
-    for (int i = 0; i < nb_packets_needed; i++) {
-        if (byte_list[i] == 0) {
-            zero_count++;
-        }
-    }
-
-    if ((zero_count * 100 / nb_packets_needed) > zero_ratio) {
+    if ((stats->zero_count * 100 / nb_packets_needed) > ratio->zero) {
         return 1;
     }
 
     return 0;    
 }
 
+// single pass over one row of the byte matrix
+static void collect_column_stats(const uint8_t *column, int nb_packets_needed, struct column_stats *stats) {
+    byte_histogram(column, nb_packets_needed, stats->byte_count);
+
+    stats->byte_count_max = simd_kernel->histogram_max(stats->byte_count);
+    stats->increment_count = simd_kernel->count_increment(column, nb_packets_needed);
+    stats->zero_count = stats->byte_count[0];
+
+    memset(stats->pattern_count, 0, sizeof(stats->pattern_count));
+    count_ordinal_patterns(column, nb_packets_needed, PERMUTATION_ORDER, stats->pattern_count);
+}
+
+// materializes the packets used for classification as an offset-major matrix :
+// matrix[offset * nb_packets_needed + k] is the byte at offset of the k-th selected packet
+// entries of the packets that were not found are left as they are (zero)
+static void build_byte_matrix(struct packet_info *info_list, int nb_application_count, int nb_packets_needed, int nb_bytes_needed, uint8_t *matrix, uint16_t *length_list) {
+    int nb_selected = 0;
+
+    for (int j = INITIAL_PACKET_PASSED_SIZE; j < nb_application_count && nb_selected < nb_packets_needed; j++) {
+        if (info_list[j].direction != info_list[0].total_direction) {
+            continue;
+        }
+        if (info_list[0].transport_protocol == IPPROTO_TCP && info_list[j].packet_segmented == PACKET_NOT_USED) {
+            continue;
+        }
+
+        for (int i = 0; i < nb_bytes_needed; i++) {
+            matrix[i * nb_packets_needed + nb_selected] = info_list[j].payload[i];
+        }
+        length_list[nb_selected] = info_list[j].payload_length;
+        nb_selected++;
+    }
+
+    debug("nb_selected : %d\n", nb_selected);
+}
+
 int classify_payload(struct packet_info *info_list, struct classification_result *result_list, int nb_application_count, int nb_packets_needed, int nb_bytes_needed) {
-    uint64_t byte_list_count;
+    struct column_stats stats;
+    const struct field_ratio *ratio;
+    uint8_t *matrix;
+    uint16_t *length_list;
 
     result_list->direction = info_list[0].total_direction;
     result_list->transport_protocol = info_list[0].transport_protocol;
 
-    if (result_list->transport_protocol == IPPROTO_TCP) {
-        stable_ratio = 40;
-        increment_ratio = 70;
-        length_ratio = 10;
-        zero_ratio = 10;
-    } else {
-        stable_ratio = 50;
-        increment_ratio = 70;
-        length_ratio = 70;
-        zero_ratio = 50;
-    }
+    // no shared state : classify_payload() may run on several threads
+    ratio = (result_list->transport_protocol == IPPROTO_TCP) ? &tcp_ratio : &udp_ratio;
 
     // for (int i = 0; i < 50; i++) {
     //     debug("[%d] %lf %lf\n", i, calculate_shannon_entropy(info_list[i].payload, 16), calculate_permutation_entropy(info_list[i].payload, 16, 3));
     // }
 
+    // missing packets are left as zero
+    matrix = (uint8_t *)calloc((size_t)nb_bytes_needed * nb_packets_needed, sizeof(uint8_t));
+    length_list = (uint16_t *)calloc(nb_packets_needed, sizeof(uint16_t));
+    if (!matrix || !length_list) {
+        error("Memory allocation failed\n");
+        free(matrix);
+        free(length_list);
+        return -1;
+    }
+
+    build_byte_matrix(info_list, nb_application_count, nb_packets_needed, nb_bytes_needed, matrix, length_list);
+
     for (int i = 0; i < nb_bytes_needed; i++) {
-        uint8_t *byte_list = (uint8_t *)malloc(sizeof(uint8_t) * nb_packets_needed);
+        uint8_t *column = &matrix[i * nb_packets_needed];
 
-        byte_list_count = 0;
-        for (int j = 0; j < nb_application_count; j++) {
-            if (byte_list_count == nb_packets_needed) {
-                break;
-            }
-            if (j < INITIAL_PACKET_PASSED_SIZE) {
-                continue;
-            }
-            if (info_list[j].direction != info_list[0].total_direction) {
-                continue;
-            }
-            
-            if (info_list[0].transport_protocol == IPPROTO_TCP && info_list[j].packet_segmented == PACKET_NOT_USED) {
-                continue;
-            }
-            
-            byte_list[byte_list_count] = info_list[j].payload[i];
-            byte_list_count++;
-        }
+        collect_column_stats(column, nb_packets_needed, &stats);
 
         debug("=====================nb_byte : %d========================\n", i+1);
         result_list->field_type[i] = TYPE_UNKNOWN;
 
-        if (type_increment_classifier(byte_list, nb_packets_needed, &result_list->field_prob[i][TYPE_INCREMENT])) {
+        if (type_increment_classifier(&stats, ratio, nb_packets_needed, &result_list->field_prob[i][TYPE_INCREMENT])) {
             result_list->field_type[i] = TYPE_INCREMENT;
-            continue;
-        }
-
-        if (type_stable_classifier(byte_list, nb_packets_needed, &result_list->field_prob[i][TYPE_STABLE])) {
+        } else if (type_stable_classifier(&stats, ratio, nb_packets_needed, &result_list->field_prob[i][TYPE_STABLE])) {
             result_list->field_type[i] = TYPE_STABLE;
-            continue;
-        }
-
-        if (type_zero_classifier(byte_list, nb_packets_needed, &result_list->field_prob[i][TYPE_ZERO])) {
+        } else if (type_zero_classifier(&stats, ratio, nb_packets_needed, &result_list->field_prob[i][TYPE_ZERO])) {
             result_list->field_type[i] = TYPE_ZERO;
-            continue;
-        }
-
-        if (type_random_classifier(byte_list, nb_packets_needed, &result_list->field_prob[i][TYPE_HIGH_ENTROPY])) {
+        } else if (type_random_classifier(&stats, nb_packets_needed, &result_list->field_prob[i][TYPE_HIGH_ENTROPY])) {
             result_list->field_type[i] = TYPE_HIGH_ENTROPY;
-            continue;
         }
+    }
 
+    // the length field overrides the offsets it covers
+    result_list->length_field.width = 0;
+    if (type_length_classifier(matrix, length_list, ratio, nb_packets_needed, nb_bytes_needed, &result_list->length_field)) {
+        for (int i = 0; i < result_list->length_field.width; i++) {
+            result_list->field_type[result_list->length_field.offset + i] = TYPE_LENGTH;
+            result_list->field_prob[result_list->length_field.offset + i][TYPE_LENGTH] = result_list->length_field.ratio;
+        }
     }
 
-    for (int i = 0; i < nb_bytes_needed-1; i++) {
-        uint16_t *byte_list = (uint16_t *)malloc(sizeof(uint16_t) * nb_packets_needed);
-        uint16_t *length_list = (uint16_t *)malloc(sizeof(uint16_t) * nb_packets_needed);
+    free(matrix);
+    free(length_list);
 
-        byte_list_count = 0;
-        for (int j = 0; j < nb_application_count; j++) {
-            if (byte_list_count == nb_packets_needed) {
-                break;
-            }
-            if (j < INITIAL_PACKET_PASSED_SIZE) {
-                continue;
-            }
-            if (info_list[j].direction != info_list[0].total_direction) {
-                continue;
-            }
-            if (info_list[0].transport_protocol == IPPROTO_TCP && info_list[j].packet_segmented == PACKET_NOT_USED) {
-                continue;
-            }
- 
-            byte_list[byte_list_count] = info_list[j].payload[i] * 0x100 + info_list[j].payload[i+1];
-            length_list[byte_list_count] = info_list[j].payload_length;
-            byte_list_count++;
-        }
+    return 0;
+}
+
+// "S S I R ... " : one token per offset, followed by a space
+int field_type_to_string(struct classification_result *result_list, int nb_bytes_needed, char *buffer, size_t size) {
+    int buf_index = 0;
 
-        if (type_length_classifier(byte_list, length_list, nb_packets_needed)) {
-            result_list->field_type[i] = TYPE_LENGTH;
-            result_list->field_type[i+1] = TYPE_LENGTH;
+    memset(buffer, 0, size);
+
+    for (int i = 0; i < nb_bytes_needed; i++) {
+        const char *token = "N";
+
+        switch(result_list->field_type[i]) {
+        case TYPE_LENGTH:
+            token = "L";    
+            break;
+        case TYPE_ZERO:
+            token = "Z";
+            break;
+        case TYPE_STABLE:
+            token = "S";
+            break;
+        case TYPE_INCREMENT:
+            token = "I";
+            break;
+        case TYPE_HIGH_ENTROPY:
+            token = "R";
+            break;
+        case TYPE_UNKNOWN:
+            token = "U";
             break;
         }
-    }   
 
-    return 0;
+        int written = snprintf(&buffer[buf_index], size - buf_index, "%s ", token);
+        if (written < 0 || written >= size - buf_index) {
+            return -1;
+        }
+        buf_index += written;
+    }
+
+    return buf_index;
+}
+
+// "L@16/2/be/+2 " : offset, width, byte order and bias of the length field, nothing without one
+int length_field_to_string(const struct length_field *field, char *buffer, size_t size) {
+    int written;
+
+    if (size > 0) {
+        buffer[0] = '\0';
+    }
+    if (field->width == 0) {
+        return 0;
+    }
+
+    written = snprintf(buffer, size, "L@%d/%d/%s/+%d ", field->offset, field->width,
+                       field->endian == LENGTH_BIG_ENDIAN ? "be" : "le", field->bias);
+    if (written < 0 || written >= size) {
+        return -1;
+    }
+
+    return written;
 }
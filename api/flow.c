@@ -0,0 +1,506 @@
+#include "../include/core.h"
+#include "../include/debug.h"
+#include "../include/trace_parser.h"
+#include "../include/flow.h"
+#include "../include/tcp_stream.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define FLOW_HASH_TAG(hash)     ((uint8_t)((hash) & 0x7f))
+#define FLOW_HASH_GROUP(hash)   ((hash) >> 7)
+
+// last_seen has a 1 second resolution : one more tick so that a flow is idle for at least idle_timeout
+#define FLOW_DEADLINE(flow, timeout)    ((flow)->last_seen + (timeout) + 1)
+
+static void make_flow_key(struct decoded_packet *decoded, int flow_mode, struct flow_key *key) {
+    uint16_t port_src = 0, port_dst = 0;
+    int order, swap;
+
+    memset(key, 0, sizeof(struct flow_key));
+
+    if (flow_mode == FLOW_BY_PORT) {
+        port_src = decoded->port_src;
+        port_dst = decoded->port_dst;
+        key->protocol = decoded->protocol;
+    }
+
+    order = ip_address_compare(&decoded->ip_src, &decoded->ip_dst);
+    swap = (order > 0) || (order == 0 && port_src > port_dst);
+
+    key->ip[0] = swap ? decoded->ip_dst : decoded->ip_src;
+    key->ip[1] = swap ? decoded->ip_src : decoded->ip_dst;
+    key->port[0] = swap ? port_dst : port_src;
+    key->port[1] = swap ? port_src : port_dst;
+}
+
+// hash of the canonical key, so it is the same for both directions
+static uint64_t hash_flow_key(const struct flow_key *key) {
+    uint64_t hash;
+
+    // the last words hold the ipv4 addresses, the others are folded in for ipv6
+    hash = ((uint64_t)key->ip[0].word[3] << 32) | key->ip[1].word[3];
+    hash ^= ((uint64_t)(key->ip[0].word[0] ^ key->ip[0].word[1] ^ key->ip[0].word[2]) << 32 |
+             (key->ip[1].word[0] ^ key->ip[1].word[1] ^ key->ip[1].word[2])) * 0xc2b2ae3d27d4eb4fULL;
+    hash ^= ((uint64_t)key->port[0] << 24 | (uint64_t)key->port[1] << 8 | key->protocol) * 0x9e3779b97f4a7c15ULL;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+// same value for both directions of a flow, used to pick the worker of a packet
+uint64_t flow_hash(struct decoded_packet *decoded, int flow_mode) {
+    struct flow_key key;
+
+    make_flow_key(decoded, flow_mode, &key);
+
+    return hash_flow_key(&key);
+}
+
+static int flow_key_equal(const struct flow_key *a, const struct flow_key *b) {
+    return ip_address_equal(&a->ip[0], &b->ip[0]) && ip_address_equal(&a->ip[1], &b->ip[1]) &&
+           a->port[0] == b->port[0] && a->port[1] == b->port[1] &&
+           a->protocol == b->protocol;
+}
+
+// bit i is set when ctrl[i] == tag
+static inline uint32_t match_tag(const uint8_t *ctrl, uint8_t tag) {
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)tag)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < FLOW_GROUP_SIZE; i++) {
+        mask |= (uint32_t)(ctrl[i] == tag) << i;
+    }
+    return mask;
+#endif
+}
+
+// bit i is set when ctrl[i] is empty or deleted (high bit set)
+static inline uint32_t match_free(const uint8_t *ctrl) {
+#ifdef __SSE2__
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < FLOW_GROUP_SIZE; i++) {
+        mask |= (uint32_t)(ctrl[i] >> 7) << i;
+    }
+    return mask;
+#endif
+}
+
+static int flow_index_init(struct flow_index *index, size_t nb_group) {
+    index->groups = (struct flow_group *)aligned_alloc(CACHE_LINE_SIZE, sizeof(struct flow_group) * nb_group);
+    if (index->groups == NULL) {
+        debug("failed to allocate flow index (%ld groups)\n", nb_group);
+        return -1;
+    }
+
+    for (size_t i = 0; i < nb_group; i++) {
+        memset(index->groups[i].ctrl, FLOW_CTRL_EMPTY, FLOW_GROUP_SIZE);
+    }
+
+    index->nb_group = nb_group;
+    index->nb_full = 0;
+    index->nb_used = 0;
+
+    return 0;
+}
+
+static void flow_index_release(struct flow_index *index) {
+    free(index->groups);
+    memset(index, 0, sizeof(struct flow_index));
+}
+
+// triangular probing over the groups, visits every group since nb_group is a power of 2
+// ctrl is set to the control byte of the slot found when not NULL
+static struct flow_slot *flow_index_find(struct flow_index *index, const struct flow_key *key, uint64_t hash, uint8_t **ctrl) {
+    size_t mask = index->nb_group - 1;
+    size_t group = FLOW_HASH_GROUP(hash) & mask;
+    uint8_t tag = FLOW_HASH_TAG(hash);
+
+    if (index->groups == NULL) {
+        return NULL;
+    }
+
+    for (size_t step = 1; step <= index->nb_group; step++) {
+        struct flow_group *g = &index->groups[group];
+        uint32_t match = match_tag(g->ctrl, tag);
+
+        while (match) {
+            int i = __builtin_ctz(match);
+            if (flow_key_equal(&g->slot[i].key, key)) {
+                if (ctrl != NULL) {
+                    *ctrl = &g->ctrl[i];
+                }
+                return &g->slot[i];
+            }
+            match &= match - 1;
+        }
+
+        // an empty slot ends the probe sequence
+        if (match_tag(g->ctrl, FLOW_CTRL_EMPTY)) {
+            return NULL;
+        }
+
+        group = (group + step) & mask;
+    }
+
+    return NULL;
+}
+
+static void flow_index_insert(struct flow_index *index, const struct flow_key *key, uint64_t hash, struct flow *flow) {
+    size_t mask = index->nb_group - 1;
+    size_t group = FLOW_HASH_GROUP(hash) & mask;
+
+    for (size_t step = 1; ; step++) {
+        struct flow_group *g = &index->groups[group];
+        uint32_t match = match_free(g->ctrl);
+
+        if (match) {
+            int i = __builtin_ctz(match);
+
+            if (g->ctrl[i] == FLOW_CTRL_EMPTY) {
+                index->nb_used++;
+            }
+            g->ctrl[i] = FLOW_HASH_TAG(hash);
+            g->slot[i].key = *key;
+            g->slot[i].flow = flow;
+            index->nb_full++;
+            return;
+        }
+
+        group = (group + step) & mask;
+    }
+}
+
+// deleted, not empty : later slots of the probe sequence stay reachable
+static int flow_index_erase(struct flow_index *index, const struct flow_key *key, uint64_t hash) {
+    uint8_t *ctrl;
+
+    if (flow_index_find(index, key, hash, &ctrl) == NULL) {
+        return -1;
+    }
+
+    *ctrl = FLOW_CTRL_DELETED;
+    index->nb_full--;
+
+    return 0;
+}
+
+// moves a few groups of the old index, deleted marks keep the old probe sequences valid meanwhile
+static void migrate_flow_index(struct flow_table *table, size_t nb_group) {
+    struct flow_index *old = &table->old;
+
+    for (; nb_group > 0 && table->nb_migrated < old->nb_group; nb_group--, table->nb_migrated++) {
+        struct flow_group *g = &old->groups[table->nb_migrated];
+
+        for (int i = 0; i < FLOW_GROUP_SIZE; i++) {
+            if (g->ctrl[i] & 0x80) {
+                continue;
+            }
+            flow_index_insert(&table->current, &g->slot[i].key, hash_flow_key(&g->slot[i].key), g->slot[i].flow);
+            g->ctrl[i] = FLOW_CTRL_DELETED;
+            old->nb_full--;
+        }
+    }
+
+    if (table->nb_migrated == old->nb_group) {
+        flow_index_release(old);
+        table->nb_migrated = 0;
+    }
+}
+
+// the current index becomes the old one, moved incrementally so that no lookup pays for the whole rehash
+static int grow_flow_table(struct flow_table *table) {
+    struct flow_index index;
+    size_t nb_group = table->current.nb_group;
+
+    // finish a previous resize first, it is rare to fill a doubled index before it is moved
+    if (table->old.groups != NULL) {
+        migrate_flow_index(table, table->old.nb_group);
+    }
+
+    // mostly deleted slots : rehash at the same size
+    if (table->current.nb_full * 2 >= table->current.nb_used) {
+        nb_group *= 2;
+    }
+
+    if (flow_index_init(&index, nb_group)) {
+        return -1;
+    }
+
+    table->old = table->current;
+    table->current = index;
+    table->nb_migrated = 0;
+
+    return 0;
+}
+
+static int flow_table_full(struct flow_index *index) {
+    return (index->nb_used + 1) * FLOW_MAX_LOAD_DEN > index->nb_group * FLOW_GROUP_SIZE * FLOW_MAX_LOAD_NUM;
+}
+
+int flow_table_init(struct flow_table *table, struct parse_info *parse, flow_handler handler_func, void *arg) {
+    memset(table, 0, sizeof(struct flow_table));
+
+    if (flow_index_init(&table->current, FLOW_TABLE_INITIAL_GROUPS)) {
+        error("Memory allocation failed\n");
+        return -1;
+    }
+
+    table->parse = parse;
+    table->handler_func = handler_func;
+    table->arg = arg;
+
+    return 0;
+}
+
+// returns the flow of the packet, created on its first packet
+struct flow *flow_table_get(struct flow_table *table, struct decoded_packet *decoded) {
+    struct flow_key key;
+    struct flow_slot *slot;
+    struct flow *flow;
+    uint64_t hash;
+
+    make_flow_key(decoded, table->parse->flow_mode, &key);
+    hash = hash_flow_key(&key);
+
+    if (table->old.groups != NULL) {
+        migrate_flow_index(table, FLOW_MIGRATE_GROUPS);
+    }
+
+    slot = flow_index_find(&table->current, &key, hash, NULL);
+    if (slot == NULL && table->old.groups != NULL) {
+        slot = flow_index_find(&table->old, &key, hash, NULL);
+    }
+    if (slot != NULL) {
+        return slot->flow;
+    }
+
+    if (flow_table_full(&table->current) && grow_flow_table(table)) {
+        return NULL;
+    }
+
+    flow = (struct flow *)calloc(1, sizeof(struct flow));
+    if (flow == NULL || packet_window_init(&flow->window, table->parse->nb_bytes_needed, FLOW_ARENA_CHUNK_SLOTS, FLOW_PACKET_CAPACITY)) {
+        error("Memory allocation failed\n");
+        free(flow);
+        return NULL;
+    }
+
+    flow->key = key;
+    flow->state = FLOW_ACTIVE;
+
+    flow_index_insert(&table->current, &key, hash, flow);
+
+    flow->order_prev = table->last;
+    if (table->last == NULL) {
+        table->first = flow;
+    } else {
+        table->last->order_next = flow;
+    }
+    table->last = flow;
+    table->nb_flow++;
+    table->stats.nb_flow++;
+
+    return flow;
+}
+
+// reports the flow, the packets are not needed once it is fingerprinted
+void flow_finish(struct flow_table *table, struct flow *flow) {
+    packet_window_finish(&flow->window, table->parse);
+    table->handler_func(flow, table->arg);
+
+    packet_window_release(&flow->window);
+    flow->state = FLOW_DONE;
+}
+
+static void lru_unlink(struct flow_table *table, struct flow *flow) {
+    if (flow->lru_prev != NULL) {
+        flow->lru_prev->lru_next = flow->lru_next;
+    } else if (table->lru_first == flow) {
+        table->lru_first = flow->lru_next;
+    }
+    if (flow->lru_next != NULL) {
+        flow->lru_next->lru_prev = flow->lru_prev;
+    } else if (table->lru_last == flow) {
+        table->lru_last = flow->lru_prev;
+    }
+    flow->lru_next = flow->lru_prev = NULL;
+}
+
+// unfinished flows are reported with the packets they have, then everything is freed
+static void flow_table_remove(struct flow_table *table, struct flow *flow) {
+    if (flow->state == FLOW_ACTIVE) {
+        flow_finish(table, flow);
+    }
+
+    if (flow_index_erase(&table->current, &flow->key, hash_flow_key(&flow->key)) && table->old.groups != NULL) {
+        flow_index_erase(&table->old, &flow->key, hash_flow_key(&flow->key));
+    }
+
+    if (flow->order_prev != NULL) {
+        flow->order_prev->order_next = flow->order_next;
+    } else {
+        table->first = flow->order_next;
+    }
+    if (flow->order_next != NULL) {
+        flow->order_next->order_prev = flow->order_prev;
+    } else {
+        table->last = flow->order_prev;
+    }
+
+    lru_unlink(table, flow);
+    timer_wheel_del(&table->wheel, &flow->timer);
+
+    table->state_size -= flow->state_size;
+    table->nb_flow--;
+
+    packet_window_release(&flow->window);
+    free(flow);
+}
+
+// a timer only fires at the deadline it was armed with, packets seen since push it back
+static void expire_flow(struct timer_node *node, void *arg) {
+    struct flow_table *table = (struct flow_table *)arg;
+    struct flow *flow = container_of(node, struct flow, timer);
+    uint64_t deadline = FLOW_DEADLINE(flow, table->parse->idle_timeout);
+
+    if (deadline >= table->wheel.now) {
+        timer_wheel_add(&table->wheel, node, deadline);
+        return;
+    }
+
+    table->stats.nb_expired++;
+    flow_table_remove(table, flow);
+}
+
+// expires the flows idle for longer than idle_timeout
+void flow_table_expire(struct flow_table *table, uint64_t now) {
+    if (table->parse->idle_timeout == 0) {
+        return;
+    }
+
+    if (!table->wheel_started) {
+        timer_wheel_init(&table->wheel, now);
+        table->wheel_started = 1;
+        return;
+    }
+
+    timer_wheel_advance(&table->wheel, now, expire_flow, table);
+}
+
+// after each packet of the flow : most recently used, state size updated, least recently used flows
+// evicted while above flow_memory
+void flow_table_touch(struct flow_table *table, struct flow *flow, uint64_t now) {
+    struct packet_window *window = &flow->window;
+    size_t state_size;
+
+    flow->last_seen = now;
+
+    if (table->lru_last != flow) {
+        lru_unlink(table, flow);
+        flow->lru_prev = table->lru_last;
+        if (table->lru_last == NULL) {
+            table->lru_first = flow;
+        } else {
+            table->lru_last->lru_next = flow;
+        }
+        table->lru_last = flow;
+    }
+
+    if (table->parse->idle_timeout != 0 && flow->timer.pprev == NULL) {
+        timer_wheel_add(&table->wheel, &flow->timer, FLOW_DEADLINE(flow, table->parse->idle_timeout));
+    }
+
+    state_size = sizeof(struct flow) + sizeof(struct packet_info) * window->capacity + window->arena.nb_bytes;
+    if (window->tcp != NULL) {
+        state_size += tcp_stream_size(window->tcp);
+    }
+    table->state_size += state_size - flow->state_size;
+    flow->state_size = state_size;
+
+    if (table->parse->flow_memory == 0) {
+        return;
+    }
+
+    while (table->state_size > table->parse->flow_memory && table->lru_first != flow) {
+        table->stats.nb_evicted++;
+        flow_table_remove(table, table->lru_first);
+    }
+}
+
+// one application packet of the capture, -1 on failure
+int flow_table_add_packet(struct flow_table *table, struct decoded_packet *decoded, int64_t timestamp, uint64_t packet_count) {
+    struct flow *flow;
+    int add_ret;
+
+    flow = flow_table_get(table, decoded);
+    if (flow == NULL) {
+        return -1;
+    }
+
+    // already fingerprinted in stream mode, kept until idle so its packets are not a new flow
+    if (flow->state == FLOW_DONE) {
+        flow_table_touch(table, flow, timestamp / NSEC_PER_SEC);
+        return 0;
+    }
+
+    add_ret = packet_window_add(&flow->window, table->parse, decoded, timestamp, packet_count);
+    if (add_ret < 0) {
+        return -1;
+    }
+    if (add_ret == WINDOW_READY) {
+        flow_finish(table, flow);
+    }
+
+    flow_table_touch(table, flow, timestamp / NSEC_PER_SEC);
+
+    return 0;
+}
+
+// end of the capture : the flows not fingerprinted yet, in creation order
+void flow_table_finish_all(struct flow_table *table) {
+    for (struct flow *flow = table->first; flow != NULL; flow = flow->order_next) {
+        if (flow->state == FLOW_DONE) {
+            continue;
+        }
+        flow_finish(table, flow);
+    }
+}
+
+void flow_table_release(struct flow_table *table) {
+    struct flow *flow = table->first;
+
+    while (flow != NULL) {
+        struct flow *next = flow->order_next;
+        packet_window_release(&flow->window);
+        free(flow);
+        flow = next;
+    }
+
+    flow_index_release(&table->current);
+    flow_index_release(&table->old);
+    memset(table, 0, sizeof(struct flow_table));
+}
+
+// "src:port dst:port proto" (or "src dst" per ip pair), src being the sender of the first packet
+int flow_to_string(struct flow *flow, int flow_mode, char *buffer, size_t size) {
+    char src[INET6_ADDRSTRLEN + 2], dst[INET6_ADDRSTRLEN + 2];
+    struct packet_window *window = &flow->window;
+
+    ip_address_to_string(&window->ip_src, flow_mode != FLOW_BY_IP, src, sizeof(src));
+    ip_address_to_string(&window->ip_dst, flow_mode != FLOW_BY_IP, dst, sizeof(dst));
+
+    if (flow_mode == FLOW_BY_IP) {
+        return snprintf(buffer, size, "%s %s", src, dst);
+    }
+
+    return snprintf(buffer, size, "%s:%u %s:%u %s", src, window->port_src, dst, window->port_dst,
+                    (flow->key.protocol == IPPROTO_TCP) ? "TCP" : "UDP");
+}
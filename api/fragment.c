@@ -0,0 +1,199 @@
+#include "../include/core.h"
+#include "../include/debug.h"
+#include "../include/trace_parser.h"
+#include "../include/decoder.h"
+#include "../include/fragment.h"
+
+// the slots are only allocated when a capture has fragments
+void fragment_table_init(struct fragment_table *table, int nb_bytes) {
+    memset(table, 0, sizeof(struct fragment_table));
+    table->prefix_size = FRAGMENT_HEADER_ROOM + nb_bytes;
+}
+
+static int fragment_table_alloc(struct fragment_table *table) {
+    table->entry_list = (struct fragment_entry *)calloc(FRAGMENT_TABLE_SIZE, sizeof(struct fragment_entry));
+    table->buffer = (uint8_t *)malloc(FRAGMENT_TABLE_SIZE * table->prefix_size);
+    if (table->entry_list == NULL || table->buffer == NULL) {
+        debug("failed to allocate fragment table\n");
+        free(table->entry_list);
+        free(table->buffer);
+        table->entry_list = NULL;
+        table->buffer = NULL;
+        return -1;
+    }
+
+    for (int i = 0; i < FRAGMENT_TABLE_SIZE; i++) {
+        table->entry_list[i].prefix = table->buffer + i * table->prefix_size;
+    }
+
+    return 0;
+}
+
+void fragment_table_release(struct fragment_table *table) {
+    free(table->entry_list);
+    free(table->buffer);
+    table->entry_list = NULL;
+    table->buffer = NULL;
+}
+
+static uint64_t fragment_hash(const struct decoded_packet *decoded) {
+    uint64_t hash = decoded->fragment_id ^ ((uint64_t)decoded->protocol << 32);
+
+    for (int i = 0; i < 4; i++) {
+        hash = (hash ^ decoded->ip_src.word[i]) * 0x100000001b3ULL;
+        hash = (hash ^ decoded->ip_dst.word[i]) * 0x100000001b3ULL;
+    }
+    hash ^= hash >> 29;
+
+    return hash;
+}
+
+static int fragment_match(const struct fragment_entry *entry, const struct decoded_packet *decoded) {
+    return entry->id == decoded->fragment_id && entry->protocol == decoded->protocol &&
+           ip_address_equal(&entry->ip_src, &decoded->ip_src) && ip_address_equal(&entry->ip_dst, &decoded->ip_dst);
+}
+
+// entry of the datagram of decoded, a new one in a free (or timed out) slot, or in place of the oldest datagram
+static struct fragment_entry *fragment_lookup(struct fragment_table *table, const struct decoded_packet *decoded, int64_t timestamp) {
+    size_t index = fragment_hash(decoded) & (FRAGMENT_TABLE_SIZE - 1);
+    struct fragment_entry *free_entry = NULL;
+    struct fragment_entry *oldest = NULL;
+    struct fragment_entry *entry;
+
+    for (int i = 0; i < FRAGMENT_PROBE; i++) {
+        entry = &table->entry_list[(index + i) & (FRAGMENT_TABLE_SIZE - 1)];
+
+        if (entry->used && timestamp - entry->first_seen > FRAGMENT_TIMEOUT) {
+            debug("fragments of datagram %u timed out\n", entry->id);
+            entry->used = 0;
+        }
+        if (!entry->used) {
+            if (free_entry == NULL) {
+                free_entry = entry;
+            }
+            continue;
+        }
+        if (fragment_match(entry, decoded)) {
+            return entry;
+        }
+        if (oldest == NULL || entry->first_seen < oldest->first_seen) {
+            oldest = entry;
+        }
+    }
+
+    entry = free_entry;
+    if (entry == NULL) {
+        debug("fragment table is full, datagram %u dropped\n", oldest->id);
+        entry = oldest;
+    }
+
+    entry->ip_src = decoded->ip_src;
+    entry->ip_dst = decoded->ip_dst;
+    entry->id = decoded->fragment_id;
+    entry->protocol = decoded->protocol;
+    entry->used = 1;
+    entry->first_seen = timestamp;
+    entry->total = 0;
+    entry->received.nb_range = 0;
+    entry->copied.nb_range = 0;
+
+    return entry;
+}
+
+// merges [first, last) into ranges, -1 when it would take more than FRAGMENT_MAX_RANGES parts
+static int fragment_ranges_add(struct fragment_ranges *ranges, uint32_t first, uint32_t last) {
+    int i = 0, j;
+
+    // ranges i to j - 1 overlap or touch [first, last)
+    while (i < ranges->nb_range && ranges->end[i] < first) {
+        i++;
+    }
+    for (j = i; j < ranges->nb_range && ranges->start[j] <= last; j++) {
+        if (ranges->start[j] < first) {
+            first = ranges->start[j];
+        }
+        if (ranges->end[j] > last) {
+            last = ranges->end[j];
+        }
+    }
+
+    if (i == j) {
+        if (ranges->nb_range == FRAGMENT_MAX_RANGES) {
+            return -1;
+        }
+        memmove(&ranges->start[i + 1], &ranges->start[i], sizeof(uint32_t) * (ranges->nb_range - i));
+        memmove(&ranges->end[i + 1], &ranges->end[i], sizeof(uint32_t) * (ranges->nb_range - i));
+        ranges->nb_range++;
+    } else {
+        memmove(&ranges->start[i + 1], &ranges->start[j], sizeof(uint32_t) * (ranges->nb_range - j));
+        memmove(&ranges->end[i + 1], &ranges->end[j], sizeof(uint32_t) * (ranges->nb_range - j));
+        ranges->nb_range -= j - i - 1;
+    }
+    ranges->start[i] = first;
+    ranges->end[i] = last;
+
+    return 0;
+}
+
+// decoded is a DECODE_FRAGMENT packet : DECODE_APPLICATION when it completes its datagram, decoded is then the datagram
+// (its payload is held by the table until the next fragment), DECODE_SKIP otherwise
+// only the first bytes of a datagram are kept, so a fragment costs a copy of at most FRAGMENT_HEADER_ROOM + nb_bytes
+int fragment_table_add(struct fragment_table *table, struct decoded_packet *decoded, int64_t timestamp, int tunnel_depth) {
+    struct fragment_entry *entry;
+    uint64_t offset = decoded->fragment_offset;
+    uint64_t end = offset + decoded->payload_size;
+    uint64_t captured_size;
+
+    if (end > FRAGMENT_MAX_DATAGRAM) {
+        debug("fragment beyond the datagram size limit\n");
+        return DECODE_SKIP;
+    }
+
+    if (table->entry_list == NULL && fragment_table_alloc(table)) {
+        return DECODE_SKIP;
+    }
+
+    entry = fragment_lookup(table, decoded, timestamp);
+
+    // the last fragment gives the datagram size, nothing was received beyond it
+    if (!decoded->fragment_more) {
+        if ((entry->total != 0 && entry->total != end) ||
+            (entry->received.nb_range > 0 && entry->received.end[entry->received.nb_range - 1] > end)) {
+            debug("inconsistent fragments of datagram %u\n", entry->id);
+            entry->used = 0;
+            return DECODE_SKIP;
+        }
+        entry->total = end;
+    } else if (entry->total != 0 && end > entry->total) {
+        debug("inconsistent fragments of datagram %u\n", entry->id);
+        entry->used = 0;
+        return DECODE_SKIP;
+    }
+
+    if (fragment_ranges_add(&entry->received, offset, end)) {
+        debug("too many fragments in datagram %u\n", entry->id);
+        entry->used = 0;
+        return DECODE_SKIP;
+    }
+
+    // captured bytes within the prefix
+    if (offset < table->prefix_size && decoded->captured_size > 0) {
+        uint64_t copy_end = offset + decoded->captured_size;
+
+        if (copy_end > table->prefix_size) {
+            copy_end = table->prefix_size;
+        }
+        memcpy(entry->prefix + offset, decoded->payload, copy_end - offset);
+        fragment_ranges_add(&entry->copied, offset, copy_end);
+    }
+
+    if (entry->total == 0 || entry->received.nb_range != 1 || entry->received.start[0] != 0 || entry->received.end[0] != entry->total) {
+        return DECODE_SKIP;
+    }
+
+    // complete : the slot is free again, its prefix is read before the next fragment
+    entry->used = 0;
+    captured_size = (entry->copied.nb_range > 0 && entry->copied.start[0] == 0) ? entry->copied.end[0] : 0;
+
+    return decode_datagram(entry->protocol, entry->prefix, captured_size, entry->total, tunnel_depth, decoded);
+}
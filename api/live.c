@@ -0,0 +1,406 @@
+#include <poll.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+
+#include "../include/core.h"
+#include "../include/debug.h"
+#include "../include/trace_parser.h"
+#include "../include/flow.h"
+#include "../include/capture.h"
+#include "../include/live.h"
+#include "../include/fragment.h"
+
+static int live_stopped = 0;
+
+// makes live_next() return 0 in every worker, safe to call from a signal handler
+void live_stop(void) {
+    __atomic_store_n(&live_stopped, 1, __ATOMIC_RELAXED);
+}
+
+static int interface_type(const char *interface) {
+    struct ifreq ifr;
+    int fd;
+    int ret;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, interface, IFNAMSIZ - 1);
+    ret = ioctl(fd, SIOCGIFHWADDR, &ifr);
+    close(fd);
+
+    return (ret < 0) ? -1 : ifr.ifr_hwaddr.sa_family;
+}
+
+// ethernet devices are read with their link header, other devices from the network header (cooked socket)
+// with a fanout group, the kernel spreads the packets of interface over every socket of the group,
+// by a hash of the flow that is the same in both directions
+// filter (NULL for none) runs in the kernel : rejected packets never reach the ring
+int live_open(struct live_ring *ring, const char *interface, int fanout_group, const struct capture_filter *filter) {
+    const struct bpf_program *program;
+    struct tpacket_req3 req;
+    struct sockaddr_ll addr;
+    int version = TPACKET_V3;
+    int type;
+
+    memset(ring, 0, sizeof(struct live_ring));
+    ring->fd = -1;
+
+    type = interface_type(interface);
+    if (type < 0) {
+        error("unknown interface : %s\n", interface);
+        return -1;
+    }
+
+    if (type == ARPHRD_ETHER || type == ARPHRD_LOOPBACK) {
+        ring->linktype = LINKTYPE_ETHERNET;
+    } else {
+        ring->linktype = LINKTYPE_RAW;
+    }
+    ring->packet.decode = link_decoder(ring->linktype);
+    ring->skip_outgoing = (type == ARPHRD_LOOPBACK);
+
+    // no protocol until the ring is ready and the socket is bound to the interface
+    ring->fd = socket(AF_PACKET, (ring->linktype == LINKTYPE_ETHERNET) ? SOCK_RAW : SOCK_DGRAM, 0);
+    if (ring->fd < 0) {
+        error("failed to open packet socket : %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version))) {
+        error("TPACKET_V3 is not supported : %s\n", strerror(errno));
+        live_close(ring);
+        return -1;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = LIVE_BLOCK_SIZE;
+    req.tp_block_nr = LIVE_BLOCK_COUNT;
+    req.tp_frame_size = LIVE_FRAME_SIZE;
+    req.tp_frame_nr = (LIVE_BLOCK_SIZE / LIVE_FRAME_SIZE) * LIVE_BLOCK_COUNT;
+    req.tp_retire_blk_tov = LIVE_BLOCK_TIMEOUT;
+
+    if (setsockopt(ring->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req))) {
+        error("failed to set up the receive ring : %s\n", strerror(errno));
+        live_close(ring);
+        return -1;
+    }
+
+    ring->block_size = req.tp_block_size;
+    ring->nb_block = req.tp_block_nr;
+    ring->map_size = (size_t)req.tp_block_size * req.tp_block_nr;
+    ring->map = (uint8_t *)mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+    if (ring->map == MAP_FAILED) {
+        error("failed to map the receive ring : %s\n", strerror(errno));
+        ring->map = NULL;
+        live_close(ring);
+        return -1;
+    }
+
+    // the decoder still checks every packet if the kernel does not take the filter
+    program = capture_filter_program(filter, ring->linktype);
+    if (program != NULL) {
+        struct sock_fprog fprog;
+
+        fprog.len = program->bf_len;
+        fprog.filter = (struct sock_filter *)program->bf_insns;
+        if (setsockopt(ring->fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog))) {
+            error("failed to attach capture filter : %s\n", strerror(errno));
+        }
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_ALL);
+    addr.sll_ifindex = if_nametoindex(interface);
+    if (addr.sll_ifindex == 0 || bind(ring->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        error("failed to bind to %s : %s\n", interface, strerror(errno));
+        live_close(ring);
+        return -1;
+    }
+
+    // fragments are reassembled first, so that every fragment goes to the socket of its flow
+    if (fanout_group != LIVE_NO_FANOUT) {
+        int fanout = (fanout_group & 0xffff) | ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+
+        if (setsockopt(ring->fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout))) {
+            error("failed to join fanout group %d : %s\n", fanout_group, strerror(errno));
+            live_close(ring);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// LIVE_PACKET with the next packet, LIVE_IDLE when none arrived within LIVE_POLL_TIMEOUT,
+// 0 once live_stop() was called, -1 on failure
+// the packet stays valid until the next call : its block is handed back to the kernel once walked
+int live_next(struct live_ring *ring, struct capture_packet **packet) {
+    struct pollfd pfd;
+    int ret;
+
+    *packet = &ring->packet;
+
+    for (;;) {
+        struct tpacket_block_desc *desc;
+
+        while (ring->desc != NULL && ring->nb_left > 0) {
+            struct tpacket3_hdr *hdr = (struct tpacket3_hdr *)ring->next;
+            const struct sockaddr_ll *sll = (const struct sockaddr_ll *)(ring->next + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+
+            ring->next += hdr->tp_next_offset;
+            ring->nb_left--;
+
+            if (ring->skip_outgoing && sll->sll_pkttype == PACKET_OUTGOING) {
+                continue;
+            }
+
+            ring->packet.timestamp = (int64_t)hdr->tp_sec * NSEC_PER_SEC + hdr->tp_nsec;
+            ring->packet.caplen = hdr->tp_snaplen;
+            ring->packet.len = hdr->tp_len;
+            ring->packet.linktype = ring->linktype;
+            ring->packet.data = (const unsigned char *)hdr + hdr->tp_mac;
+
+            ring->stats.nb_packet++;
+            ring->stats.nb_byte += hdr->tp_len;
+
+            return LIVE_PACKET;
+        }
+
+        if (ring->desc != NULL) {
+            __atomic_store_n(&ring->desc->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+            ring->desc = NULL;
+            ring->block = (ring->block + 1) % ring->nb_block;
+        }
+
+        desc = (struct tpacket_block_desc *)(ring->map + (size_t)ring->block * ring->block_size);
+        if (__atomic_load_n(&desc->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) {
+            ring->desc = desc;
+            ring->nb_left = desc->hdr.bh1.num_pkts;
+            ring->next = (uint8_t *)desc + desc->hdr.bh1.offset_to_first_pkt;
+            continue;
+        }
+
+        if (__atomic_load_n(&live_stopped, __ATOMIC_RELAXED)) {
+            return 0;
+        }
+
+        pfd.fd = ring->fd;
+        pfd.events = POLLIN | POLLERR;
+        pfd.revents = 0;
+        ret = poll(&pfd, 1, LIVE_POLL_TIMEOUT);
+        if (ret < 0 && errno != EINTR) {
+            error("failed to poll the receive ring : %s\n", strerror(errno));
+            return -1;
+        }
+        if (ret == 0) {
+            return LIVE_IDLE;
+        }
+    }
+}
+
+// the kernel counters are reset on each read, they are accumulated in ring->stats
+void live_update_stats(struct live_ring *ring) {
+    struct tpacket_stats_v3 st;
+    socklen_t len = sizeof(st);
+
+    if (getsockopt(ring->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) == 0) {
+        ring->stats.nb_drop += st.tp_drops;
+        ring->stats.nb_freeze += st.tp_freeze_q_cnt;
+    }
+}
+
+void live_close(struct live_ring *ring) {
+    if (ring->map != NULL) {
+        munmap(ring->map, ring->map_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    ring->map = NULL;
+    ring->fd = -1;
+}
+
+static double elapsed_since(struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// packets of ring into table until live_stop() is called, the flows left are reported at the end
+static int capture_flows(struct live_ring *ring, struct flow_table *table) {
+    struct decoded_packet decoded;
+    struct capture_packet *packet;
+    struct fragment_table fragments;
+    struct timespec start;
+    uint64_t packet_count;
+    int ret;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fragment_table_init(&fragments, table->parse->nb_bytes_needed);
+
+    packet_count = 0;
+    while ((ret = live_next(ring, &packet)) > 0) {
+        int decode_ret;
+
+        // a quiet socket still expires its idle flows, on the clock of the packet timestamps
+        if (ret == LIVE_IDLE) {
+            struct timespec now;
+
+            clock_gettime(CLOCK_REALTIME, &now);
+            flow_table_expire(table, now.tv_sec);
+            continue;
+        }
+
+        packet_count++;
+
+        // every packet moves the clock, the ones left out by the decoder as well
+        flow_table_expire(table, packet->timestamp / NSEC_PER_SEC);
+
+        decode_ret = packet->decode(packet->data, packet->caplen, table->parse->tunnel_depth, &decoded);
+        if (decode_ret == DECODE_FRAGMENT) {
+            decode_ret = fragment_table_add(&fragments, &decoded, packet->timestamp, table->parse->tunnel_depth);
+        }
+        if (decode_ret != DECODE_APPLICATION) {
+            continue;
+        }
+
+        if (flow_table_add_packet(table, &decoded, packet->timestamp, packet_count)) {
+            ret = -1;
+            break;
+        }
+    }
+
+    ring->stats.elapsed = elapsed_since(&start);
+    live_update_stats(ring);
+    fragment_table_release(&fragments);
+
+    if (ret == 0) {
+        flow_table_finish_all(table);
+    }
+
+    return ret;
+}
+
+// same as parse_pcap_into_flows() on the traffic of interface, until live_stop() is called
+int parse_live_into_flows(const char *interface, struct parse_info *parse, flow_handler handler_func, void *arg, struct flow_stats *stats, struct live_stats *live_stats) {
+    struct flow_table table;
+    struct live_ring ring;
+    int ret;
+
+    if (live_open(&ring, interface, LIVE_NO_FANOUT, parse->prefilter)) {
+        return PARSE_FAILED;
+    }
+
+    if (flow_table_init(&table, parse, handler_func, arg)) {
+        live_close(&ring);
+        return PARSE_FAILED;
+    }
+
+    ret = capture_flows(&ring, &table);
+
+    live_close(&ring);
+
+    if (stats != NULL) {
+        *stats = table.stats;
+    }
+    if (live_stats != NULL) {
+        *live_stats = ring.stats;
+    }
+
+    flow_table_release(&table);
+
+    return (ret < 0) ? PARSE_FAILED : PARSE_OK;
+}
+
+static void *live_worker_main(void *arg) {
+    struct live_worker *worker = (struct live_worker *)arg;
+
+    worker->ret = capture_flows(&worker->ring, &worker->table);
+
+    return NULL;
+}
+
+// one fanout socket per worker : each worker reads its own ring into its own flow table,
+// handler_func gets arg_list[i] for the flows of worker i, live_stats_list gets the counters of each socket
+int parse_live_into_flows_parallel(const char *interface, struct parse_info *parse, int nb_worker, flow_handler handler_func, void **arg_list, struct flow_stats *stats, struct live_stats *live_stats_list) {
+    struct live_worker *worker_list;
+    int fanout_group = getpid() & 0xffff;
+    int nb_started = 0;
+    int ret = PARSE_OK;
+
+    worker_list = (struct live_worker *)aligned_alloc(CACHE_LINE_SIZE, sizeof(struct live_worker) * nb_worker);
+    if (worker_list == NULL) {
+        error("Memory allocation failed\n");
+        return PARSE_FAILED;
+    }
+    memset(worker_list, 0, sizeof(struct live_worker) * nb_worker);
+    for (int i = 0; i < nb_worker; i++) {
+        worker_list[i].ring.fd = -1;
+    }
+
+    // every socket joins the group before any worker starts
+    for (int i = 0; i < nb_worker; i++) {
+        if (live_open(&worker_list[i].ring, interface, fanout_group, parse->prefilter) ||
+            flow_table_init(&worker_list[i].table, parse, handler_func, arg_list[i])) {
+            ret = PARSE_FAILED;
+            break;
+        }
+    }
+
+    for (int i = 0; ret == PARSE_OK && i < nb_worker; i++) {
+        if (pthread_create(&worker_list[i].thread, NULL, live_worker_main, &worker_list[i])) {
+            debug("failed to start worker %d\n", i);
+            ret = PARSE_FAILED;
+            break;
+        }
+        nb_started++;
+    }
+
+    // the workers started are stopped as well
+    if (ret != PARSE_OK) {
+        live_stop();
+    }
+
+    if (stats != NULL) {
+        memset(stats, 0, sizeof(struct flow_stats));
+    }
+
+    for (int i = 0; i < nb_worker; i++) {
+        struct live_worker *worker = &worker_list[i];
+
+        if (i < nb_started) {
+            pthread_join(worker->thread, NULL);
+            if (worker->ret) {
+                ret = PARSE_FAILED;
+            }
+            if (stats != NULL) {
+                stats->nb_flow += worker->table.stats.nb_flow;
+                stats->nb_expired += worker->table.stats.nb_expired;
+                stats->nb_evicted += worker->table.stats.nb_evicted;
+            }
+            if (live_stats_list != NULL) {
+                live_stats_list[i] = worker->ring.stats;
+            }
+        }
+
+        if (worker->table.current.groups != NULL) {
+            flow_table_release(&worker->table);
+        }
+        live_close(&worker->ring);
+    }
+
+    free(worker_list);
+
+    return ret;
+}
@@ -1,26 +1,55 @@
+#include <endian.h>
+
 #include "../include/core.h"
 #include "../include/debug.h"
 #include "../include/trace_parser.h"
 #include "../include/vpn_fingerprint.h"
+#include "../include/simd_kernel.h"
+
+// true if bits has run consecutive set bits : each step ands the runs found so far with themselves shifted,
+// so a run of 16 takes 4 steps
+static inline int has_run_of_ones(uint64_t bits, int run) {
+    for (int found = 1; found < run && bits != 0; ) {
+        int shift = (run - found < found) ? run - found : found;
 
+        bits &= bits >> shift;
+        found += shift;
+    }
+    return bits != 0;
+}
+
+// bits are taken from the least significant one of each byte, the order of a little-endian 64-bit load,
+// so the data is scanned a word at a time : ctz and clz give the zero runs crossing word boundaries
 static int has_consecutive_zero_bits(unsigned char *data, int length, int zero_consecutive) {
-    int consecutive = 0;
+    int consecutive = 0;        // zero bits ending the previous words
 
-    for (int i = 0; i < length; i++) {
-        unsigned char byte_val = data[i];
+    if (zero_consecutive < 1) {
+        zero_consecutive = 1;
+    }
 
-        for (int bit = 0; bit < 8; bit++) {
-            int bit_val = (byte_val >> bit) & 0x01; 
+    for (int i = 0; i < length; i += 8) {
+        uint64_t word = UINT64_MAX;
 
-            if (bit_val == 0) {
-                consecutive++;
-                if (consecutive >= zero_consecutive) {
-                    return PACKET_USED; 
-                }
-            } else {
-                consecutive = 0;
+        // missing bytes of the last word are ones, they end any run
+        memcpy(&word, &data[i], (length - i < 8) ? length - i : 8);
+        word = le64toh(word);
+
+        if (word == 0) {
+            consecutive += 64;
+            if (consecutive >= zero_consecutive) {
+                return PACKET_USED;
             }
+            continue;
         }
+
+        if (consecutive + __builtin_ctzll(word) >= zero_consecutive) {
+            return PACKET_USED;
+        }
+        if (zero_consecutive <= 64 && has_run_of_ones(~word, zero_consecutive)) {
+            return PACKET_USED;
+        }
+
+        consecutive = __builtin_clzll(word);
     }
 
     return PACKET_NOT_USED;
@@ -61,91 +90,125 @@ static int filter_by_zero(struct packet_info *info_list, int zero_consecutive, i
     return 0;
 }
 
-static int filter_by_latency(struct packet_info *info_list, double latency_percentage, int nb_application_packet, int nb_bytes_needed) {
-    debug("filter_by_latency: %lf\n", latency_percentage);
-
-    // We still need separate 'before' timestamps for each direction
-    // to correctly compute inter-packet latency.
-    struct timeval before_src = {0, 0};
-    struct timeval before_dst = {0, 0};
-    struct timeval diff;
-    double timestamp_sec;
-
-    // Temporary arrays to store latencies for each direction separately
-    latency_info_t *src_latencies = (latency_info_t *)calloc(nb_application_packet, sizeof(latency_info_t));
-    latency_info_t *dst_latencies = (latency_info_t *)calloc(nb_application_packet, sizeof(latency_info_t));
+// ascending latency, ties in the order a stable sort of the source then the destination packets gives
+static inline int latency_before(const latency_info_t *a, const latency_info_t *b, const struct packet_info *info_list) {
+    if (a->latency != b->latency) {
+        return a->latency < b->latency;
+    }
+    if (info_list[a->index].direction != info_list[b->index].direction) {
+        return info_list[a->index].direction == SRC_TO_DST;
+    }
+    return a->index < b->index;
+}
 
-    int src_count = 0;
-    int dst_count = 0;
+static inline void swap_latency(latency_info_t *a, latency_info_t *b) {
+    latency_info_t tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
 
-    // 1) Compute the inter-packet latency for each direction
-    //    and store them in separate arrays.
-    for (int i = 0; i < nb_application_packet; i++) {
-        if (info_list[i].direction == SRC_TO_DST) {
-            // diff = current_timestamp - before_src
-            timeval_subtract(&diff, &info_list[i].timestamp, &before_src);
-            timestamp_sec = diff.tv_sec + diff.tv_usec / 1000000.0;
+// quickselect : moves the k lowest latencies to list[0..k-1], in no particular order
+static void select_lowest_latencies(latency_info_t *list, int count, int k, const struct packet_info *info_list) {
+    int left = 0;
+    int right = count - 1;
 
-            src_latencies[src_count].latency = timestamp_sec;
-            src_latencies[src_count].index   = i;
-            src_count++;
+    while (left < right) {
+        int middle = left + (right - left) / 2;
+        latency_info_t pivot;
+        int i = left;
+        int j = right;
 
-            // Update 'before_src'
-            before_src = info_list[i].timestamp;
+        // median of three, sorted captures do not degrade to a quadratic time
+        if (latency_before(&list[middle], &list[left], info_list)) {
+            swap_latency(&list[middle], &list[left]);
         }
-        else if (info_list[i].direction == DST_TO_SRC) {
-            // diff = current_timestamp - before_dst
-            timeval_subtract(&diff, &info_list[i].timestamp, &before_dst);
-            timestamp_sec = diff.tv_sec + diff.tv_usec / 1000000.0;
-
-            dst_latencies[dst_count].latency = timestamp_sec;
-            dst_latencies[dst_count].index   = i;
-            dst_count++;
+        if (latency_before(&list[right], &list[left], info_list)) {
+            swap_latency(&list[right], &list[left]);
+        }
+        if (latency_before(&list[right], &list[middle], info_list)) {
+            swap_latency(&list[right], &list[middle]);
+        }
+        pivot = list[middle];
 
-            // Update 'before_dst'
-            before_dst = info_list[i].timestamp;
+        while (i <= j) {
+            while (latency_before(&list[i], &pivot, info_list)) {
+                i++;
+            }
+            while (latency_before(&pivot, &list[j], info_list)) {
+                j--;
+            }
+            if (i <= j) {
+                swap_latency(&list[i], &list[j]);
+                i++;
+                j--;
+            }
         }
-    }
 
-    // Comparison function for qsort (ascending order by latency)
-    int compare_latency(const void *a, const void *b)
-    {
-        double l1 = ((latency_info_t *)a)->latency;
-        double l2 = ((latency_info_t *)b)->latency;
-        if (l1 < l2) return -1;
-        if (l1 > l2) return 1;
-        return 0;
+        // list[left..j] <= pivot <= list[i..right]
+        if (k <= j) {
+            right = j;
+        } else if (k >= i) {
+            left = i;
+        } else {
+            break;
+        }
     }
+}
 
-    // 2) Sort both arrays by latency (ascending order).
-    qsort(src_latencies, src_count, sizeof(latency_info_t), compare_latency);
-    qsort(dst_latencies, dst_count, sizeof(latency_info_t), compare_latency);
+static int filter_by_latency(struct packet_info *info_list, double latency_percentage, int nb_application_packet, int nb_bytes_needed) {
+    debug("filter_by_latency: %lf\n", latency_percentage);
 
-    // 3) Merge the two arrays into one array for unified filtering.
-    int total_count = src_count + dst_count;
-    latency_info_t *all_latencies = (latency_info_t *)calloc(total_count, sizeof(latency_info_t));
+    // We still need separate 'before' timestamps for each direction
+    // to correctly compute inter-packet latency.
+    int64_t before_src = 0;
+    int64_t before_dst = 0;
+    int64_t latency;
+    latency_info_t *latencies;
+    int total_count = 0;
+
+    latencies = (latency_info_t *)malloc(nb_application_packet * sizeof(latency_info_t));
+    if (latencies == NULL) {
+        error("Memory allocation failed\n");
+        return -1;
+    }
 
-    // Copy src_latencies and dst_latencies into all_latencies
-    memcpy(all_latencies, src_latencies, src_count * sizeof(latency_info_t));
-    memcpy(all_latencies + src_count, dst_latencies, dst_count * sizeof(latency_info_t));
+    // 1) Compute the inter-packet latency of each packet within its direction.
+    for (int i = 0; i < nb_application_packet; i++) {
+        if (info_list[i].direction == SRC_TO_DST) {
+            latency = info_list[i].timestamp - before_src;
+            before_src = info_list[i].timestamp;
+        } else if (info_list[i].direction == DST_TO_SRC) {
+            latency = info_list[i].timestamp - before_dst;
+            before_dst = info_list[i].timestamp;
+        } else {
+            continue;
+        }
 
-    // Now sort this merged array
-    qsort(all_latencies, total_count, sizeof(latency_info_t), compare_latency);
+        latencies[total_count].latency = latency;
+        latencies[total_count].index   = i;
+        total_count++;
+    }
 
-    // 4) Determine the discard index for the merged array based on latency_percentage.
+    // 2) Determine the discard index based on latency_percentage.
     //    Example: if total_count=100 and latency_percentage=10 => discard_index=10 (lowest 10 packets).
     int discard_index = (int)((latency_percentage * total_count) / 100.0);
     if (discard_index < 0) discard_index = 0;
     if (discard_index > total_count) discard_index = total_count;
 
-    debug("Merged total_count = %d, discard_index = %d\n", total_count, discard_index);
+    debug("total_count = %d, discard_index = %d\n", total_count, discard_index);
 
-    // 5) Mark the lowest 'discard_index' packets as PACKET_NOT_USED,
+    // 3) Only the boundary matters, not the order : select the lowest 'discard_index'
+    //    latencies in linear time instead of sorting them.
+    if (discard_index > 0 && discard_index < total_count) {
+        select_lowest_latencies(latencies, total_count, discard_index, info_list);
+    }
+
+    // 4) Mark the lowest 'discard_index' packets as PACKET_NOT_USED,
     //    and the rest as PACKET_USED.
     //    This ensures exactly n% of the packets (by count) are discarded,
     //    regardless of direction.
     for (int i = 0; i < total_count; i++) {
-        int pkt_index = all_latencies[i].index;
+        int pkt_index = latencies[i].index;
         if (i < discard_index) {
             // Lowest latencies => discard
             info_list[pkt_index].filter_by_latency = PACKET_NOT_USED;
@@ -155,99 +218,100 @@ static int filter_by_latency(struct packet_info *info_list, double latency_perce
         }
     }
 
-    // Free the temporary arrays
-    free(src_latencies);
-    free(dst_latencies);
-    free(all_latencies);
+    free(latencies);
 
     return 0;
 }
 
+static int filter_by_length(struct packet_info *info_list, int nb_application_packet, int nb_bytes_needed) {
+    debug("filter_by_length\n");
 
-static int get_needed_bytes(uint32_t val) {
-    if (val <= 0xFF) {
-        return 1;
-    } else if (val <= 0xFFFF) {
-        return 2;
-    } else if (val <= 0xFFFFFF) {
-        return 3;
-    } else {
-        return 4;
-    }
-}
+    for (int i = 0; i < nb_application_packet; i++) {
+        uint32_t actual_len = (uint32_t)info_list[i].payload_length;
+        uint8_t *payload = info_list[i].payload;
 
-static uint32_t read_big_endian(const uint8_t *buf, int size) {
-    uint32_t result = 0;
-    for (int i = 0; i < size; i++) {
-        result = (result << 8) | buf[i];
+        info_list[i].filter_by_length = simd_kernel->has_length(payload, nb_bytes_needed, actual_len) ? PACKET_USED : PACKET_NOT_USED;
     }
-    return result;
+    return 0;
 }
 
-static uint32_t read_little_endian(const uint8_t *buf, int size) {
-    uint32_t result = 0;
-    for (int i = size - 1; i >= 0; i--) {
-        result = (result << 8) | buf[i];
-    }
-    return result;
+void latency_stream_init(struct latency_stream *stream, double latency_percentage) {
+    stream->before_src = 0;
+    stream->before_dst = 0;
+    quantile_init(&stream->quantile, latency_percentage / 100.0);
 }
 
-static int has_length(const uint8_t *payload, int nb_bytes_needed, uint32_t actual_len) {
-    int threshold_diff = 8; 
-    int needed_bytes = get_needed_bytes(actual_len);
+// filters one packet as it arrives, the same filters as filter_packets() on the whole window
+// except for the latency threshold : the running estimate of the latency_percentage quantile
+// of the packets seen so far instead of the exact one, so no packet has to be kept for it
+int filter_packet_on_arrival(struct latency_stream *stream, struct filter_info *filter, struct packet_info *info, int nb_bytes_needed) {
+    int nb_filter_satisfied = 0;
 
-    // debug("has length\n");
+    info->filter_by_latency = PACKET_NOT_USED;
+    info->filter_by_length = PACKET_NOT_USED;
+    info->filter_by_zero = PACKET_NOT_USED;
 
-    for (int offset = 0; offset <= nb_bytes_needed - needed_bytes; offset++) {
+    if (filter->enable_latency_filter) {
+        int64_t *before = (info->direction == SRC_TO_DST) ? &stream->before_src : &stream->before_dst;
+        double latency = (double)(info->timestamp - *before);
 
-        uint32_t val_be = read_big_endian(&payload[offset], needed_bytes);
-        if ((val_be > actual_len) ? (val_be - actual_len <= threshold_diff)
-                                  : (actual_len - val_be <= threshold_diff)) {
-            return PACKET_USED;
-        }
+        *before = info->timestamp;
 
-        uint32_t val_le = read_little_endian(&payload[offset], needed_bytes);
-        if ((val_le > actual_len) ? (val_le - actual_len <= threshold_diff)
-                                  : (actual_len - val_le <= threshold_diff)) {
-            return PACKET_USED;
+        if (filter->latency_percentage <= 0.0 || stream->quantile.count == 0 || latency > quantile_value(&stream->quantile)) {
+            info->filter_by_latency = PACKET_USED;
         }
+        quantile_add(&stream->quantile, latency);
+
+        nb_filter_satisfied += info->filter_by_latency;
     }
 
-    return PACKET_NOT_USED;
-}
+    if (filter->enable_length_filter) {
+        info->filter_by_length = simd_kernel->has_length(info->payload, nb_bytes_needed, (uint32_t)info->payload_length) ? PACKET_USED : PACKET_NOT_USED;
+        nb_filter_satisfied += info->filter_by_length;
+    }
 
-static int filter_by_length(struct packet_info *info_list, int nb_application_packet, int nb_bytes_needed) {
-    debug("filter_by_length\n");
+    if (filter->enable_zero_filter) {
+        info->filter_by_zero = has_consecutive_zero_bits(info->payload, nb_bytes_needed, filter->zero_consecutive);
+        nb_filter_satisfied += info->filter_by_zero;
+    }
 
-    for (int i = 0; i < nb_application_packet; i++) {
-        uint32_t actual_len = (uint32_t)info_list[i].payload_length;
-        uint8_t *payload = info_list[i].payload;
+    info->packet_segmented = (nb_filter_satisfied >= filter->nb_filter_needed) ? PACKET_USED : PACKET_NOT_USED;
+    info->filter_applied = PACKET_USED;
 
-        info_list[i].filter_by_length = has_length(payload, nb_bytes_needed, actual_len);
-    }
-    return 0;
+    return info->packet_segmented;
 }
 
 int filter_packets(struct packet_info *info_list, struct filter_info *filter, int nb_application_packet, int nb_packets_needed, int nb_bytes_needed) {
     int nb_filter_satisfied;
     int nb_packet_satisfied_src;
     int nb_packet_satisfied_dst;
+    int nb_aligned;
     
     if (info_list[0].transport_protocol == IPPROTO_UDP) {
         debug("It's for TCP segmentation\n");
         return 0;
     }
 
-    if (filter->enable_latency_filter) {
-        filter_by_latency(info_list, filter->latency_percentage, nb_application_packet, nb_bytes_needed);
+    // reassembled record prefixes are segmented already, the filters are for the other segments
+    nb_aligned = 0;
+    for (int i = 0; i < nb_application_packet; i++) {
+        nb_aligned += info_list[i].record_aligned;
     }
+    debug("nb_aligned : %d\n", nb_aligned);
 
-    if (filter->enable_length_filter) {
-        filter_by_length(info_list, nb_application_packet, nb_bytes_needed);
-    } 
+    // stream windows are filtered as their packets arrive
+    if (info_list[0].filter_applied == PACKET_NOT_USED && nb_aligned < nb_application_packet) {
+        if (filter->enable_latency_filter) {
+            filter_by_latency(info_list, filter->latency_percentage, nb_application_packet, nb_bytes_needed);
+        }
 
-    if (filter->enable_zero_filter) {
-        filter_by_zero(info_list, filter->zero_consecutive, nb_application_packet, nb_bytes_needed);
+        if (filter->enable_length_filter) {
+            filter_by_length(info_list, nb_application_packet, nb_bytes_needed);
+        } 
+
+        if (filter->enable_zero_filter) {
+            filter_by_zero(info_list, filter->zero_consecutive, nb_application_packet, nb_bytes_needed);
+        }
     }
 
     nb_packet_satisfied_src = 0;
@@ -265,7 +329,7 @@ int filter_packets(struct packet_info *info_list, struct filter_info *filter, in
             nb_filter_satisfied += info_list[i].filter_by_zero;
         }
 
-        if (nb_filter_satisfied >= filter->nb_filter_needed) {
+        if (info_list[i].record_aligned || nb_filter_satisfied >= filter->nb_filter_needed) {
             info_list[i].packet_segmented = PACKET_USED;
 
             if (info_list[i].direction == SRC_TO_DST) {
@@ -281,6 +345,14 @@ int filter_packets(struct packet_info *info_list, struct filter_info *filter, in
     debug("nb_packet_satisfied_src : %d\n", nb_packet_satisfied_src);
     debug("nb_packet_satisfied_dst : %d\n", nb_packet_satisfied_dst);
 
+    // filtered on arrival : packet_window_finish() already picked the direction that filled up first
+    if (info_list[0].filter_applied == PACKET_USED) {
+        int nb_packet_satisfied = (info_list[0].total_direction == SRC_TO_DST) ? nb_packet_satisfied_src : nb_packet_satisfied_dst;
+        if (nb_packet_satisfied >= nb_packets_needed) {
+            return 0;
+        }
+    }
+
     // SRC_TO_DST
     // DST_TO_SRC
     if (nb_packet_satisfied_src >= nb_packets_needed) {
@@ -0,0 +1,330 @@
+#include <sched.h>
+
+#include "../include/core.h"
+#include "../include/debug.h"
+#include "../include/trace_parser.h"
+#include "../include/flow.h"
+#include "../include/pipeline.h"
+#include "../include/capture.h"
+#include "../include/fragment.h"
+
+#define SLOT(ring, index)   ((struct packet_desc *)((ring)->slot_list + ((index) & (ring)->mask) * (ring)->slot_size))
+
+static int spsc_ring_init(struct spsc_ring *ring, size_t nb_slot, size_t slot_size) {
+    memset(ring, 0, sizeof(struct spsc_ring));
+
+    ring->slot_size = (slot_size + CACHE_LINE_SIZE - 1) & ~((size_t)CACHE_LINE_SIZE - 1);
+    ring->mask = nb_slot - 1;
+    ring->slot_list = (uint8_t *)aligned_alloc(CACHE_LINE_SIZE, ring->slot_size * nb_slot);
+    if (ring->slot_list == NULL) {
+        debug("failed to allocate ring (%ld slots)\n", nb_slot);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void spsc_ring_release(struct spsc_ring *ring) {
+    free(ring->slot_list);
+    ring->slot_list = NULL;
+}
+
+// a batch boundary is crossed between index and index + nb_slot
+#define BATCH_CROSSED(index, nb_slot)   ((((index) ^ ((index) + (nb_slot))) & ~(uint64_t)(PIPELINE_BATCH - 1)) != 0)
+
+// producer side
+static void spsc_ring_publish(struct spsc_ring *ring) {
+    __atomic_store_n(&ring->head, ring->head_local, __ATOMIC_RELEASE);
+}
+
+static struct packet_desc *spsc_ring_reserve(struct spsc_ring *ring, size_t nb_slot) {
+    if (ring->head_local + nb_slot - ring->tail_cached > ring->mask + 1) {
+        ring->tail_cached = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (ring->head_local + nb_slot - ring->tail_cached > ring->mask + 1) {
+            return NULL;
+        }
+    }
+
+    return SLOT(ring, ring->head_local);
+}
+
+static void spsc_ring_push(struct spsc_ring *ring, size_t nb_slot) {
+    int crossed = BATCH_CROSSED(ring->head_local, nb_slot);
+
+    ring->head_local += nb_slot;
+    if (crossed) {
+        spsc_ring_publish(ring);
+    }
+}
+
+// consumer side
+static void spsc_ring_release_slots(struct spsc_ring *ring) {
+    __atomic_store_n(&ring->tail, ring->tail_local, __ATOMIC_RELEASE);
+}
+
+static struct packet_desc *spsc_ring_peek(struct spsc_ring *ring) {
+    if (ring->tail_local == ring->head_cached) {
+        ring->head_cached = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (ring->tail_local == ring->head_cached) {
+            return NULL;
+        }
+    }
+
+    return SLOT(ring, ring->tail_local);
+}
+
+static void spsc_ring_pop(struct spsc_ring *ring, size_t nb_slot) {
+    int crossed = BATCH_CROSSED(ring->tail_local, nb_slot);
+
+    ring->tail_local += nb_slot;
+    if (crossed) {
+        spsc_ring_release_slots(ring);
+    }
+}
+
+// waits for nb_slot free slots, the worker is behind : everything pending is published first
+static struct packet_desc *wait_free(struct spsc_ring *ring, size_t nb_slot) {
+    struct packet_desc *desc;
+
+    while ((desc = spsc_ring_reserve(ring, nb_slot)) == NULL) {
+        spsc_ring_publish(ring);
+        sched_yield();
+    }
+
+    return desc;
+}
+
+// nb_slot consecutive slots, the end of the ring is padded when they do not fit before it
+static struct packet_desc *wait_slot(struct spsc_ring *ring, size_t nb_slot) {
+    size_t index = ring->head_local & ring->mask;
+    struct packet_desc *desc;
+
+    if (index + nb_slot > ring->mask + 1) {
+        desc = wait_free(ring, ring->mask + 1 - index);
+        desc->type = DESC_PAD;
+        desc->nb_slot = ring->mask + 1 - index;
+        spsc_ring_push(ring, desc->nb_slot);
+    }
+
+    desc = wait_free(ring, nb_slot);
+    desc->nb_slot = nb_slot;
+
+    return desc;
+}
+
+static void *pipeline_worker_main(void *arg) {
+    struct pipeline_worker *worker = (struct pipeline_worker *)arg;
+    struct decoded_packet decoded;
+    struct packet_desc *desc;
+
+    memset(&decoded, 0, sizeof(struct decoded_packet));
+
+    for (;;) {
+        desc = spsc_ring_peek(&worker->ring);
+        if (desc == NULL) {
+            spsc_ring_release_slots(&worker->ring);
+            sched_yield();
+            continue;
+        }
+
+        if (desc->type == DESC_END) {
+            break;
+        }
+        if (desc->type == DESC_PAD) {
+            spsc_ring_pop(&worker->ring, desc->nb_slot);
+            continue;
+        }
+
+        flow_table_expire(&worker->table, desc->timestamp / NSEC_PER_SEC);
+
+        // once a packet failed, the remaining ones are only drained
+        if (desc->type == DESC_PACKET && worker->ret == 0) {
+            decoded.ip_src = desc->ip_src;
+            decoded.ip_dst = desc->ip_dst;
+            decoded.port_src = desc->port_src;
+            decoded.port_dst = desc->port_dst;
+            decoded.protocol = desc->protocol;
+            decoded.seq = desc->seq;
+            decoded.payload = (const char *)desc->prefix;
+            decoded.payload_size = desc->payload_size;
+            decoded.captured_size = desc->captured_size;
+
+            if (flow_table_add_packet(&worker->table, &decoded, desc->timestamp, desc->packet_count)) {
+                worker->ret = -1;
+            }
+        }
+
+        spsc_ring_pop(&worker->ring, desc->nb_slot);
+    }
+
+    spsc_ring_pop(&worker->ring, desc->nb_slot);
+    spsc_ring_release_slots(&worker->ring);
+
+    if (worker->ret == 0) {
+        flow_table_finish_all(&worker->table);
+    }
+    worker->stats = worker->table.stats;
+
+    return NULL;
+}
+
+static void push_control(struct spsc_ring *ring, int type, int64_t timestamp) {
+    struct packet_desc *desc = wait_slot(ring, 1);
+
+    desc->type = type;
+    desc->timestamp = timestamp;
+    spsc_ring_push(ring, 1);
+    spsc_ring_publish(ring);
+}
+
+// one reader (this thread) decodes the headers and steers each packet by its symmetric flow hash,
+// so every flow belongs to a single worker and the flow tables need no lock
+// arg_list[i] is passed to handler_func for the flows of worker i
+int parse_pcap_into_flows_parallel(char *filename, struct parse_info *parse, int nb_worker, flow_handler handler_func, void **arg_list, struct flow_stats *stats) {
+    struct pipeline_worker *worker_list;
+    struct decoded_packet decoded;
+
+    struct capture_reader reader;
+    struct capture_packet *packet;
+    struct fragment_table fragments;
+
+    int64_t last_tick = 0;
+    size_t prefix_size;
+    uint64_t packet_count;
+    int read_ret = 0;
+    int nb_started = 0;
+    int ret = PARSE_OK;
+
+    if (capture_open(&reader, filename, parse->reader, parse->prefilter)) {
+        return PARSE_FAILED;
+    }
+
+    prefix_size = parse->nb_bytes_needed;
+
+    worker_list = (struct pipeline_worker *)aligned_alloc(CACHE_LINE_SIZE, sizeof(struct pipeline_worker) * nb_worker);
+    if (worker_list == NULL) {
+        error("Memory allocation failed\n");
+        capture_close(&reader);
+        return PARSE_FAILED;
+    }
+    memset(worker_list, 0, sizeof(struct pipeline_worker) * nb_worker);
+
+    for (int i = 0; i < nb_worker; i++) {
+        struct pipeline_worker *worker = &worker_list[i];
+
+        if (spsc_ring_init(&worker->ring, PIPELINE_RING_SIZE, sizeof(struct packet_desc) + prefix_size) ||
+            flow_table_init(&worker->table, parse, handler_func, arg_list[i])) {
+            ret = PARSE_FAILED;
+            break;
+        }
+        if (pthread_create(&worker->thread, NULL, pipeline_worker_main, worker)) {
+            debug("failed to start worker %d\n", i);
+            ret = PARSE_FAILED;
+            break;
+        }
+        nb_started++;
+    }
+
+    // datagrams are reassembled by the reader, their fragments may belong to different workers
+    fragment_table_init(&fragments, parse->nb_bytes_needed);
+
+    // iterate pcap file
+    packet_count = 0;
+    while (ret == PARSE_OK && (read_ret = capture_next(&reader, &packet)) > 0) {
+        struct spsc_ring *ring;
+        struct packet_desc *desc;
+        uint64_t copy_size;
+        size_t nb_slot;
+        int decode_ret;
+
+        packet_count++;
+
+        decode_ret = packet->decode(packet->data, packet->caplen, parse->tunnel_depth, &decoded);
+        if (decode_ret == DECODE_FRAGMENT) {
+            decode_ret = fragment_table_add(&fragments, &decoded, packet->timestamp, parse->tunnel_depth);
+        }
+        if (decode_ret != DECODE_APPLICATION) {
+            continue;
+        }
+
+        // idle flows of every worker expire even when it gets no packet
+        if (parse->idle_timeout != 0 && packet->timestamp / NSEC_PER_SEC > last_tick / NSEC_PER_SEC) {
+            last_tick = packet->timestamp;
+            for (int i = 0; i < nb_started; i++) {
+                push_control(&worker_list[i].ring, DESC_TICK, last_tick);
+            }
+        }
+
+        // high bits : the low ones are the tag and group of the flow index
+        ring = &worker_list[((flow_hash(&decoded, parse->flow_mode) >> 32) * nb_started) >> 32].ring;
+
+        // the record parser of the worker reads the headers of the records held by a segment, wherever they are
+        copy_size = (decoded.protocol == IPPROTO_TCP && parse->reassemble) ? decoded.captured_size : prefix_size;
+        if (copy_size > decoded.captured_size) {
+            copy_size = decoded.captured_size;
+        }
+        if (sizeof(struct packet_desc) + copy_size > PIPELINE_MAX_SLOTS * ring->slot_size) {
+            copy_size = PIPELINE_MAX_SLOTS * ring->slot_size - sizeof(struct packet_desc);
+        }
+        nb_slot = (sizeof(struct packet_desc) + ((copy_size > prefix_size) ? copy_size : prefix_size) + ring->slot_size - 1) / ring->slot_size;
+        desc = wait_slot(ring, nb_slot);
+
+        desc->type = DESC_PACKET;
+        desc->timestamp = packet->timestamp;
+        desc->packet_count = packet_count;
+        desc->payload_size = decoded.payload_size;
+        desc->ip_src = decoded.ip_src;
+        desc->ip_dst = decoded.ip_dst;
+        desc->port_src = decoded.port_src;
+        desc->port_dst = decoded.port_dst;
+        desc->protocol = decoded.protocol;
+        desc->seq = decoded.seq;
+        desc->captured_size = copy_size;
+        memcpy(desc->prefix, decoded.payload, copy_size);
+        if (copy_size < prefix_size) {
+            memset(desc->prefix + copy_size, 0, prefix_size - copy_size);
+        }
+
+        spsc_ring_push(ring, nb_slot);
+    }
+
+    if (read_ret < 0) {
+        error("truncated or corrupt capture, read stopped after %lu packets : %s\n", packet_count, filename);
+    }
+
+    capture_close(&reader);
+    fragment_table_release(&fragments);
+
+    for (int i = 0; i < nb_started; i++) {
+        push_control(&worker_list[i].ring, DESC_END, last_tick);
+    }
+
+    if (stats != NULL) {
+        memset(stats, 0, sizeof(struct flow_stats));
+    }
+
+    for (int i = 0; i < nb_worker; i++) {
+        struct pipeline_worker *worker = &worker_list[i];
+
+        if (i < nb_started) {
+            pthread_join(worker->thread, NULL);
+            if (worker->ret) {
+                ret = PARSE_FAILED;
+            }
+            if (stats != NULL) {
+                stats->nb_flow += worker->stats.nb_flow;
+                stats->nb_expired += worker->stats.nb_expired;
+                stats->nb_evicted += worker->stats.nb_evicted;
+            }
+        }
+
+        if (worker->table.current.groups != NULL) {
+            flow_table_release(&worker->table);
+        }
+        spsc_ring_release(&worker->ring);
+    }
+
+    free(worker_list);
+
+    return ret;
+}
@@ -0,0 +1,318 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "../include/core.h"
+#include "../include/debug.h"
+#include "../include/prefetch.h"
+
+static int ring_setup(struct prefetch_ring *ring, unsigned entries) {
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(struct prefetch_ring));
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqe_map_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    // both rings share one mapping on recent kernels
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_map_size > ring->sq_map_size) {
+            ring->sq_map_size = ring->cq_map_size;
+        }
+        ring->cq_map_size = 0;
+    }
+
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+
+    if (ring->cq_map_size == 0) {
+        ring->cq_map = ring->sq_map;
+    } else {
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) {
+            munmap(ring->sq_map, ring->sq_map_size);
+            close(ring->fd);
+            return -1;
+        }
+    }
+
+    ring->sqe_list = (struct io_uring_sqe *)mmap(NULL, ring->sqe_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqe_list == MAP_FAILED) {
+        if (ring->cq_map_size != 0) {
+            munmap(ring->cq_map, ring->cq_map_size);
+        }
+        munmap(ring->sq_map, ring->sq_map_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->sq_head = (unsigned *)((char *)ring->sq_map + params.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_map + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_map + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_map + params.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_map + params.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_map + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_map + params.cq_off.ring_mask);
+    ring->cqe_list = (struct io_uring_cqe *)((char *)ring->cq_map + params.cq_off.cqes);
+
+    return 0;
+}
+
+static void ring_release(struct prefetch_ring *ring) {
+    munmap(ring->sqe_list, ring->sqe_map_size);
+    if (ring->cq_map_size != 0) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    munmap(ring->sq_map, ring->sq_map_size);
+    close(ring->fd);
+}
+
+// submission entries queued but not consumed by the kernel yet
+static unsigned ring_pending(struct prefetch_ring *ring) {
+    return *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+static int ring_enter(struct prefetch_ring *ring, unsigned min_complete) {
+    return syscall(__NR_io_uring_enter, ring->fd, ring_pending(ring), min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+// reads the rest of the file, slot is the position of the file in file_list
+static void submit_read(struct prefetch *prefetch, int slot) {
+    struct prefetch_ring *ring = &prefetch->ring;
+    struct prefetch_file *file = &prefetch->file_list[slot];
+    unsigned tail = *ring->sq_tail;
+    unsigned position = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqe_list[position];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = file->fd;
+    sqe->off = file->done;
+    sqe->addr = (uint64_t)(uintptr_t)(file->buffer + file->done);
+    sqe->len = file->size - file->done;
+    sqe->user_data = slot;
+
+    ring->sq_array[position] = position;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    prefetch->nb_inflight++;
+
+    // an entry left in the ring is submitted by the next call
+    if (ring_enter(ring, 0) < 0) {
+        debug("failed to submit read : %s\n", strerror(errno));
+    }
+}
+
+static void complete_read(struct prefetch *prefetch, struct io_uring_cqe *cqe) {
+    int slot = (int)cqe->user_data;
+    struct prefetch_file *file = &prefetch->file_list[slot];
+
+    prefetch->nb_inflight--;
+
+    if (cqe->res < 0) {
+        debug("read ahead failed : %s\n", strerror(-cqe->res));
+        file->state = PREFETCH_FAILED;
+    } else if (cqe->res == 0) {
+        // the file shrank since it was opened
+        file->size = file->done;
+        file->state = PREFETCH_DONE;
+    } else {
+        file->done += cqe->res;
+        if (file->done < file->size) {
+            submit_read(prefetch, slot);
+        } else {
+            file->state = PREFETCH_DONE;
+        }
+    }
+}
+
+// handles completions until file is no longer being read
+// its read is in flight until its completion arrives : the buffer cannot be freed before, even when waiting fails
+static void wait_file(struct prefetch *prefetch, struct prefetch_file *file) {
+    struct prefetch_ring *ring = &prefetch->ring;
+
+    while (file->state == PREFETCH_READING) {
+        unsigned head = *ring->cq_head;
+
+        if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            if (ring_enter(ring, 1) < 0 && errno != EINTR) {
+                struct timespec pause = { 0, PREFETCH_RETRY_NSEC };
+
+                debug("failed to wait for reads : %s\n", strerror(errno));
+                nanosleep(&pause, NULL);
+            }
+            continue;
+        }
+
+        complete_read(prefetch, &ring->cqe_list[head & *ring->cq_mask]);
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    }
+}
+
+static int read_rest(struct prefetch_file *file) {
+    while (file->done < file->size) {
+        ssize_t len = pread(file->fd, file->buffer + file->done, file->size - file->done, file->done);
+
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len < 0) {
+            return -1;
+        }
+        if (len == 0) {
+            file->size = file->done;
+            break;
+        }
+        file->done += len;
+    }
+
+    return 0;
+}
+
+static void drop_first(struct prefetch *prefetch) {
+    struct prefetch_file *file = &prefetch->file_list[prefetch->first];
+
+    // the kernel may still write into the buffer
+    if (prefetch->use_ring) {
+        wait_file(prefetch, file);
+    }
+
+    close(file->fd);
+    free(file->buffer);
+
+    prefetch->first = (prefetch->first + 1) % prefetch->capacity;
+    prefetch->nb_file--;
+}
+
+// depth captures are read ahead of the one being fingerprinted, 0 disables the read ahead
+int prefetch_init(struct prefetch *prefetch, int depth) {
+    memset(prefetch, 0, sizeof(struct prefetch));
+
+    if (depth <= 0) {
+        return 0;
+    }
+
+    prefetch->capacity = depth + 1;
+    prefetch->file_list = (struct prefetch_file *)calloc(prefetch->capacity, sizeof(struct prefetch_file));
+    if (prefetch->file_list == NULL) {
+        error("Memory allocation failed\n");
+        return -1;
+    }
+
+    if (ring_setup(&prefetch->ring, prefetch->capacity) == 0) {
+        prefetch->use_ring = 1;
+    } else {
+        debug("io_uring is not available (%s), reading with pread\n", strerror(errno));
+    }
+
+    return 0;
+}
+
+// starts reading path, files that cannot be read ahead are left to the reader
+// files are expected in the order they are taken, the oldest one makes room when the list is full
+void prefetch_add(struct prefetch *prefetch, size_t index, const char *path) {
+    struct prefetch_file *file;
+    struct stat st;
+    int slot;
+    int fd;
+
+    if (prefetch->capacity == 0) {
+        return;
+    }
+
+    if (prefetch->nb_file == prefetch->capacity) {
+        drop_first(prefetch);
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size == 0 || st.st_size > PREFETCH_MAX_FILE_SIZE) {
+        close(fd);
+        return;
+    }
+
+    slot = (prefetch->first + prefetch->nb_file) % prefetch->capacity;
+    file = &prefetch->file_list[slot];
+
+    file->buffer = (uint8_t *)malloc(st.st_size);
+    if (file->buffer == NULL) {
+        close(fd);
+        return;
+    }
+
+    file->index = index;
+    file->fd = fd;
+    file->state = PREFETCH_READING;
+    file->size = st.st_size;
+    file->done = 0;
+    prefetch->nb_file++;
+
+    if (prefetch->use_ring) {
+        submit_read(prefetch, slot);
+    } else {
+        posix_fadvise(fd, 0, st.st_size, POSIX_FADV_WILLNEED);
+    }
+}
+
+// 0 with the content of capture index (freed by the caller), -1 if it was not read ahead
+// files added before index were taken by another worker and are dropped
+int prefetch_take(struct prefetch *prefetch, size_t index, uint8_t **buffer, size_t *size) {
+    struct prefetch_file *file;
+    int position;
+
+    for (position = 0; position < prefetch->nb_file; position++) {
+        if (prefetch->file_list[(prefetch->first + position) % prefetch->capacity].index == index) {
+            break;
+        }
+    }
+    if (position == prefetch->nb_file) {
+        return -1;
+    }
+
+    while (position-- > 0) {
+        drop_first(prefetch);
+    }
+
+    file = &prefetch->file_list[prefetch->first];
+    if (prefetch->use_ring) {
+        wait_file(prefetch, file);
+    }
+
+    if (file->state != PREFETCH_DONE && read_rest(file)) {
+        drop_first(prefetch);
+        return -1;
+    }
+
+    *buffer = file->buffer;
+    *size = file->size;
+    file->buffer = NULL;
+    drop_first(prefetch);
+
+    return 0;
+}
+
+void prefetch_release(struct prefetch *prefetch) {
+    while (prefetch->nb_file > 0) {
+        drop_first(prefetch);
+    }
+
+    if (prefetch->use_ring) {
+        ring_release(&prefetch->ring);
+    }
+
+    free(prefetch->file_list);
+    memset(prefetch, 0, sizeof(struct prefetch));
+}
@@ -0,0 +1,114 @@
+#include "../include/core.h"
+#include "../include/debug.h"
+#include "../include/quantile.h"
+
+void quantile_init(struct quantile *quantile, double p) {
+    memset(quantile, 0, sizeof(struct quantile));
+
+    quantile->p = p;
+
+    quantile->desired[0] = 1;
+    quantile->desired[1] = 1 + 2 * p;
+    quantile->desired[2] = 1 + 4 * p;
+    quantile->desired[3] = 3 + 2 * p;
+    quantile->desired[4] = 5;
+
+    quantile->increment[0] = 0;
+    quantile->increment[1] = p / 2;
+    quantile->increment[2] = p;
+    quantile->increment[3] = (1 + p) / 2;
+    quantile->increment[4] = 1;
+}
+
+// piecewise parabolic prediction of the height of marker i moved by sign (+1 or -1)
+static double parabolic(const struct quantile *quantile, int i, double sign) {
+    const double *n = quantile->position;
+    const double *q = quantile->height;
+
+    return q[i] + sign / (n[i + 1] - n[i - 1]) *
+           ((n[i] - n[i - 1] + sign) * (q[i + 1] - q[i]) / (n[i + 1] - n[i]) +
+            (n[i + 1] - n[i] - sign) * (q[i] - q[i - 1]) / (n[i] - n[i - 1]));
+}
+
+static double linear(const struct quantile *quantile, int i, int sign) {
+    const double *n = quantile->position;
+    const double *q = quantile->height;
+
+    return q[i] + sign * (q[i + sign] - q[i]) / (n[i + sign] - n[i]);
+}
+
+void quantile_add(struct quantile *quantile, double value) {
+    double *q = quantile->height;
+    double *n = quantile->position;
+    int k;
+
+    // the first observations are kept sorted, they are the initial markers
+    if (quantile->count < QUANTILE_MARKERS) {
+        int i = (int)quantile->count;
+
+        while (i > 0 && q[i - 1] > value) {
+            q[i] = q[i - 1];
+            i--;
+        }
+        q[i] = value;
+        quantile->count++;
+
+        if (quantile->count == QUANTILE_MARKERS) {
+            for (i = 0; i < QUANTILE_MARKERS; i++) {
+                n[i] = i + 1;
+            }
+        }
+        return;
+    }
+
+    // cell of the observation, the extreme markers follow the minimum and the maximum
+    if (value < q[0]) {
+        q[0] = value;
+        k = 0;
+    } else if (value >= q[4]) {
+        q[4] = value;
+        k = 3;
+    } else {
+        for (k = 0; k < 3 && value >= q[k + 1]; k++) {
+        }
+    }
+
+    for (int i = k + 1; i < QUANTILE_MARKERS; i++) {
+        n[i]++;
+    }
+    for (int i = 0; i < QUANTILE_MARKERS; i++) {
+        quantile->desired[i] += quantile->increment[i];
+    }
+    quantile->count++;
+
+    // moves the middle markers by one position toward their desired position
+    for (int i = 1; i < QUANTILE_MARKERS - 1; i++) {
+        double delta = quantile->desired[i] - n[i];
+
+        if ((delta >= 1 && n[i + 1] - n[i] > 1) || (delta <= -1 && n[i - 1] - n[i] < -1)) {
+            int sign = (delta > 0) ? 1 : -1;
+            double height = parabolic(quantile, i, sign);
+
+            if (q[i - 1] < height && height < q[i + 1]) {
+                q[i] = height;
+            } else {
+                q[i] = linear(quantile, i, sign);
+            }
+            n[i] += sign;
+        }
+    }
+}
+
+// current estimate, 0.0 before any observation
+double quantile_value(const struct quantile *quantile) {
+    if (quantile->count == 0) {
+        return 0.0;
+    }
+
+    // nearest rank among the observations kept so far
+    if (quantile->count < QUANTILE_MARKERS) {
+        return quantile->height[(int)(quantile->p * (quantile->count - 1) + 0.5)];
+    }
+
+    return quantile->height[2];
+}
@@ -0,0 +1,408 @@
+#include "../include/core.h"
+#include "../include/debug.h"
+#include "../include/arena.h"
+#include "../include/simd_kernel.h"
+#include "../include/signature_db.h"
+
+/* blocks given to the kernel at once, the best distances so far prune the next ones */
+#define SIGNATURE_CHUNK_BLOCKS      16
+
+/* a signature being loaded, one code per byte */
+struct signature_line {
+    int label;
+    uint8_t code[SIGNATURE_FIELD_MAX];
+};
+
+static int signature_code(char token) {
+    switch (token) {
+    case 'S':
+        return TYPE_STABLE;
+    case 'I':
+        return TYPE_INCREMENT;
+    case 'L':
+        return TYPE_LENGTH;
+    case 'R':
+        return TYPE_HIGH_ENTROPY;
+    case 'Z':
+        return TYPE_ZERO;
+    case 'U':
+        return TYPE_UNKNOWN;
+    case '*':
+    case 'N':
+        return SIGNATURE_WILDCARD;
+    }
+    return -1;
+}
+
+// index of label, added at the end of the list when it is new
+static int signature_label(struct signature_db *db, int *capacity, const char *label) {
+    // learned signatures of a label are usually next to each other
+    if (db->nb_label > 0 && strcmp(db->label_list[db->nb_label - 1], label) == 0) {
+        return db->nb_label - 1;
+    }
+    for (int i = 0; i < db->nb_label; i++) {
+        if (strcmp(db->label_list[i], label) == 0) {
+            return i;
+        }
+    }
+
+    if (db->nb_label == *capacity) {
+        int new_capacity = (*capacity == 0) ? 16 : *capacity * 2;
+        char (*label_list)[SIGNATURE_LABEL_SIZE] = realloc(db->label_list, sizeof(*label_list) * new_capacity);
+
+        if (label_list == NULL) {
+            return -1;
+        }
+        db->label_list = label_list;
+        *capacity = new_capacity;
+    }
+
+    strcpy(db->label_list[db->nb_label], label);
+
+    return db->nb_label++;
+}
+
+// "<label>:<type> <type> ...", fields beyond SIGNATURE_FIELD_MAX are ignored
+static int parse_signature_line(struct signature_db *db, int *label_capacity, char *line, struct signature_line *signature, int *nb_field) {
+    char *separator = strchr(line, ':');
+    char *token;
+    int code;
+
+    if (separator == NULL || separator == line || separator - line >= SIGNATURE_LABEL_SIZE) {
+        return -1;
+    }
+    *separator = '\0';
+
+    signature->label = signature_label(db, label_capacity, line);
+    if (signature->label < 0) {
+        return -1;
+    }
+
+    memset(signature->code, SIGNATURE_WILDCARD, sizeof(signature->code));
+    *nb_field = 0;
+    for (token = strtok(separator + 1, " \t\r\n"); token != NULL; token = strtok(NULL, " \t\r\n")) {
+        code = signature_code(token[0]);
+        if (code < 0 || token[1] != '\0') {
+            return -1;
+        }
+        if (*nb_field < SIGNATURE_FIELD_MAX) {
+            signature->code[*nb_field] = (uint8_t)code;
+        }
+        (*nb_field)++;
+    }
+    if (*nb_field > SIGNATURE_FIELD_MAX) {
+        debug("signature %s : %d fields, only the first %d are used\n", db->label_list[signature->label], *nb_field, SIGNATURE_FIELD_MAX);
+        *nb_field = SIGNATURE_FIELD_MAX;
+    }
+
+    return (*nb_field > 0) ? 0 : -1;
+}
+
+static int compare_signature_line(const void *a, const void *b) {
+    const struct signature_line *x = (const struct signature_line *)a;
+    const struct signature_line *y = (const struct signature_line *)b;
+    int ret = memcmp(x->code, y->code, sizeof(x->code));
+
+    return (ret != 0) ? ret : x->label - y->label;
+}
+
+static void pack_signature(struct signature_db *db, int index, const uint8_t *code) {
+    uint8_t *block = &db->block_list[(size_t)(index / SIGNATURE_BLOCK) * db->nb_field * SIGNATURE_BLOCK_BYTES];
+    int lane = index % SIGNATURE_BLOCK;
+    int shift = (lane / SIGNATURE_BLOCK_BYTES) * 4;
+
+    for (int f = 0; f < db->nb_field; f++) {
+        uint8_t *byte = &block[f * SIGNATURE_BLOCK_BYTES + lane % SIGNATURE_BLOCK_BYTES];
+
+        *byte = (*byte & ~(0x0F << shift)) | (code[f] << shift);
+    }
+}
+
+// one signature per line, '#' starts a comment line
+// identical lines are kept once, the labels keep the order of their first line
+int signature_db_load(struct signature_db *db, const char *path) {
+    struct signature_line *line_list = NULL;
+    int line_capacity = 0, label_capacity = 0;
+    int nb_line = 0, line_number = 0;
+    int nb_field;
+    char *line = NULL;
+    size_t size = 0;
+    size_t block_size;
+    FILE *fp;
+    int ret = 0;
+
+    memset(db, 0, sizeof(struct signature_db));
+
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        error("failed to open signature database : %s\n", path);
+        return -1;
+    }
+
+    while (getline(&line, &size, fp) != -1) {
+        char *start = line;
+
+        line_number++;
+        while (*start == ' ' || *start == '\t') {
+            start++;
+        }
+        if (*start == '#' || *start == '\n' || *start == '\r' || *start == '\0') {
+            continue;
+        }
+
+        if (nb_line == line_capacity) {
+            int new_capacity = (line_capacity == 0) ? 64 : line_capacity * 2;
+            struct signature_line *new_list = realloc(line_list, sizeof(struct signature_line) * new_capacity);
+
+            if (new_list == NULL) {
+                error("Memory allocation failed\n");
+                ret = -1;
+                break;
+            }
+            line_list = new_list;
+            line_capacity = new_capacity;
+        }
+
+        if (parse_signature_line(db, &label_capacity, start, &line_list[nb_line], &nb_field)) {
+            error("invalid signature at %s:%d\n", path, line_number);
+            ret = -1;
+            break;
+        }
+        if (nb_field > db->nb_field) {
+            db->nb_field = nb_field;
+        }
+        nb_line++;
+    }
+
+    free(line);
+    fclose(fp);
+
+    if (ret == 0 && nb_line == 0) {
+        error("no signature in %s\n", path);
+        ret = -1;
+    }
+    if (ret) {
+        free(line_list);
+        signature_db_release(db);
+        return -1;
+    }
+
+    qsort(line_list, nb_line, sizeof(struct signature_line), compare_signature_line);
+    for (int i = 0; i < nb_line; i++) {
+        if (db->nb_signature == 0 || compare_signature_line(&line_list[db->nb_signature - 1], &line_list[i]) != 0) {
+            line_list[db->nb_signature++] = line_list[i];
+        }
+    }
+
+    // padding lanes of the last block are wildcards, their distances are never read
+    db->nb_block = (db->nb_signature + SIGNATURE_BLOCK - 1) / SIGNATURE_BLOCK;
+    block_size = (size_t)db->nb_block * db->nb_field * SIGNATURE_BLOCK_BYTES;
+    block_size = (block_size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+    db->block_list = (uint8_t *)aligned_alloc(CACHE_LINE_SIZE, block_size);
+    db->label_index = (int *)malloc(sizeof(int) * db->nb_signature);
+    if (db->block_list == NULL || db->label_index == NULL) {
+        error("Memory allocation failed\n");
+        free(line_list);
+        signature_db_release(db);
+        return -1;
+    }
+
+    memset(db->block_list, 0xFF, block_size);
+    for (int i = 0; i < db->nb_signature; i++) {
+        pack_signature(db, i, line_list[i].code);
+        db->label_index[i] = line_list[i].label;
+    }
+    free(line_list);
+
+    debug("signature database : %d signatures (%d lines), %d labels, %d fields\n", db->nb_signature, nb_line, db->nb_label, db->nb_field);
+
+    return 0;
+}
+
+void signature_db_release(struct signature_db *db) {
+    free(db->block_list);
+    free(db->label_index);
+    free(db->label_list);
+    memset(db, 0, sizeof(struct signature_db));
+}
+
+int signature_cache_init(struct signature_cache *cache) {
+    cache->entry_list = (struct signature_cache_entry *)calloc(SIGNATURE_CACHE_SIZE, sizeof(struct signature_cache_entry));
+    if (cache->entry_list == NULL) {
+        error("Memory allocation failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+void signature_cache_release(struct signature_cache *cache) {
+    free(cache->entry_list);
+    cache->entry_list = NULL;
+}
+
+static int signature_weight(int query, int signature) {
+    if (query == SIGNATURE_WILDCARD || signature == SIGNATURE_WILDCARD || query == signature) {
+        return 0;
+    }
+    if (query == TYPE_UNKNOWN || signature == TYPE_UNKNOWN) {
+        return SIGNATURE_WEIGHT_NEAR;
+    }
+    if ((query == TYPE_STABLE && signature == TYPE_ZERO) || (query == TYPE_ZERO && signature == TYPE_STABLE)) {
+        return SIGNATURE_WEIGHT_NEAR;
+    }
+    return SIGNATURE_WEIGHT_MISMATCH;
+}
+
+// adds label at distance to the top_k nearest labels, each label is kept once with its nearest signature
+static void top_add(struct signature_match *match_list, int *nb_match, int top_k, int label, int distance) {
+    int i;
+
+    for (i = 0; i < *nb_match; i++) {
+        if (match_list[i].label == label) {
+            if (match_list[i].distance <= distance) {
+                return;
+            }
+            memmove(&match_list[i], &match_list[i + 1], sizeof(struct signature_match) * (*nb_match - i - 1));
+            (*nb_match)--;
+            break;
+        }
+    }
+
+    for (i = *nb_match; i > 0; i--) {
+        struct signature_match *prev = &match_list[i - 1];
+
+        if (prev->distance < distance || (prev->distance == distance && prev->label < label)) {
+            break;
+        }
+    }
+    if (i == top_k) {
+        return;
+    }
+
+    if (*nb_match == top_k) {
+        (*nb_match)--;
+    }
+    memmove(&match_list[i + 1], &match_list[i], sizeof(struct signature_match) * (*nb_match - i));
+    match_list[i].label = label;
+    match_list[i].distance = distance;
+    (*nb_match)++;
+}
+
+// nearest signatures of a specification over every signature of the database
+static int signature_db_scan(const struct signature_db *db, const uint8_t *query_code, int top_k, struct signature_match *match_list) {
+    uint8_t weight[SIGNATURE_FIELD_MAX * 16] __attribute__((aligned(16)));
+    uint8_t distance[SIGNATURE_CHUNK_BLOCKS * SIGNATURE_BLOCK];
+    uint64_t candidate[SIGNATURE_CHUNK_BLOCKS];
+    size_t block_size = (size_t)db->nb_field * SIGNATURE_BLOCK_BYTES;
+    int nb_compared = 0;
+    int nb_match = 0;
+
+    for (int f = 0; f < db->nb_field; f++) {
+        for (int code = 0; code < 16; code++) {
+            weight[f * 16 + code] = (uint8_t)signature_weight(query_code[f], code);
+        }
+        // trailing wildcards of the query (a shorter specification) add nothing
+        if (query_code[f] != SIGNATURE_WILDCARD) {
+            nb_compared = f + 1;
+        }
+    }
+
+    for (int b = 0; b < db->nb_block; b += SIGNATURE_CHUNK_BLOCKS) {
+        int nb_block = (db->nb_block - b < SIGNATURE_CHUNK_BLOCKS) ? db->nb_block - b : SIGNATURE_CHUNK_BLOCKS;
+        int first = b * SIGNATURE_BLOCK;
+        int last = (first + nb_block * SIGNATURE_BLOCK < db->nb_signature) ? first + nb_block * SIGNATURE_BLOCK : db->nb_signature;
+        // a signature at the distance of the last match still takes its place when its label comes first
+        int limit = (nb_match == top_k) ? match_list[top_k - 1].distance + 1 : 256;
+
+        simd_kernel->signature_distance(&db->block_list[b * block_size], nb_block, db->nb_field, nb_compared, weight, limit, distance, candidate);
+
+        // most signatures are beyond the last match, only the candidates of the kernel are looked at
+        for (int k = 0; k < nb_block; k++) {
+            uint64_t bits = candidate[k];
+
+            while (bits) {
+                int i = k * SIGNATURE_BLOCK + __builtin_ctzll(bits);
+
+                bits &= bits - 1;
+                if (first + i >= last) {
+                    break;
+                }
+                if (distance[i] < limit) {
+                    top_add(match_list, &nb_match, top_k, db->label_index[first + i], distance[i]);
+                    limit = (nb_match == top_k) ? match_list[top_k - 1].distance + 1 : 256;
+                }
+            }
+        }
+    }
+
+    return nb_match;
+}
+
+// top_k (at most SIGNATURE_TOP_MAX) nearest labels of a field specification, nearest first, returns the number of matches
+// fields of the specification beyond the database (and of the database beyond it) are not compared
+int signature_db_match(const struct signature_db *db, const int *field_type, int nb_field, int top_k, struct signature_cache *cache, struct signature_match *match_list) {
+    uint8_t query_code[SIGNATURE_FIELD_MAX];
+    uint8_t query[SIGNATURE_FIELD_MAX / 2];
+    struct signature_cache_entry *entry = NULL;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    int nb_match;
+
+    if (top_k > SIGNATURE_TOP_MAX) {
+        top_k = SIGNATURE_TOP_MAX;
+    }
+    if (db->nb_signature == 0 || top_k <= 0) {
+        return 0;
+    }
+
+    memset(query_code, SIGNATURE_WILDCARD, sizeof(query_code));
+    for (int f = 0; f < nb_field && f < db->nb_field; f++) {
+        if (field_type[f] >= 0 && field_type[f] < FIELD_TYPE_SIZE) {
+            query_code[f] = (uint8_t)field_type[f];
+        }
+    }
+
+    if (cache != NULL && cache->entry_list != NULL) {
+        for (int i = 0; i < SIGNATURE_FIELD_MAX / 2; i++) {
+            query[i] = query_code[2 * i] | (query_code[2 * i + 1] << 4);
+            hash = (hash ^ query[i]) * 0x100000001b3ULL;
+        }
+        hash ^= hash >> 29;
+
+        entry = &cache->entry_list[hash & (SIGNATURE_CACHE_SIZE - 1)];
+        if (entry->top_k == top_k && memcmp(entry->query, query, sizeof(query)) == 0) {
+            memcpy(match_list, entry->match_list, sizeof(struct signature_match) * entry->nb_match);
+            return entry->nb_match;
+        }
+    }
+
+    nb_match = signature_db_scan(db, query_code, top_k, match_list);
+
+    if (entry != NULL) {
+        memcpy(entry->query, query, sizeof(query));
+        memcpy(entry->match_list, match_list, sizeof(struct signature_match) * nb_match);
+        entry->top_k = top_k;
+        entry->nb_match = nb_match;
+    }
+
+    return nb_match;
+}
+
+// "<label> (<distance>), <label> (<distance>)"
+int signature_match_to_string(const struct signature_db *db, const struct signature_match *match_list, int nb_match, char *buffer, size_t size) {
+    int buf_index = 0;
+
+    if (size > 0) {
+        buffer[0] = '\0';
+    }
+
+    for (int i = 0; i < nb_match; i++) {
+        int written = snprintf(&buffer[buf_index], size - buf_index, "%s%s (%d)", (i > 0) ? ", " : "",
+                               db->label_list[match_list[i].label], match_list[i].distance);
+        if (written < 0 || written >= (int)(size - buf_index)) {
+            return -1;
+        }
+        buf_index += written;
+    }
+
+    return buf_index;
+}
@@ -0,0 +1,586 @@
+#include "../include/core.h"
+#include "../include/debug.h"
+#include "../include/simd_kernel.h"
+#include "../include/signature_db.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86
+#endif
+
+void byte_histogram(const uint8_t *column, int size, int *histogram) {
+    memset(histogram, 0, sizeof(int) * 256);
+
+    for (int i = 0; i < size; i++) {
+        histogram[column[i]]++;
+    }
+}
+
+static int count_increment_scalar(const uint8_t *column, int size) {
+    int count = 0;
+
+    for (int i = 1; i < size; i++) {
+        if (column[i] > column[i-1]) {
+            count++;
+        }
+    }
+    return count;
+}
+
+static int max_lane(const int *lane, int nb_lane);
+
+static int histogram_max_scalar(const int *histogram) {
+    return max_lane(histogram, 256);
+}
+
+static int max_lane(const int *lane, int nb_lane) {
+    int max = 0;
+
+    for (int i = 0; i < nb_lane; i++) {
+        if (max < lane[i]) {
+            max = lane[i];
+        }
+    }
+    return max;
+}
+
+// bytes of the smallest integer holding length
+static int length_width(uint32_t length) {
+    if (length <= 0xFF) {
+        return 1;
+    } else if (length <= 0xFFFF) {
+        return 2;
+    } else if (length <= 0xFFFFFF) {
+        return 3;
+    }
+    return 4;
+}
+
+// a value matches when value - low <= range, in unsigned arithmetic
+static void length_match_range(uint32_t length, uint32_t *low, uint32_t *range) {
+    uint32_t high = (length > UINT32_MAX - LENGTH_MATCH_DIFF) ? UINT32_MAX : length + LENGTH_MATCH_DIFF;
+
+    *low = (length > LENGTH_MATCH_DIFF) ? length - LENGTH_MATCH_DIFF : 0;
+    *range = high - *low;
+}
+
+// both byte orders slide over the payload, one byte in and one byte out per offset
+static int has_length_scalar(const uint8_t *payload, int size, uint32_t length) {
+    int width = length_width(length);
+    uint32_t mask = (width == 4) ? UINT32_MAX : ((uint32_t)1 << (8 * width)) - 1;
+    uint32_t big = 0, little = 0;
+    uint32_t low, range;
+
+    length_match_range(length, &low, &range);
+
+    // the first width - 1 bytes, the loop shifts in the last one
+    for (int i = 0; i < width - 1; i++) {
+        big = (big << 8) | payload[i];
+        little |= (uint32_t)payload[i] << (8 * (i + 1));
+    }
+
+    for (int offset = 0; offset <= size - width; offset++) {
+        uint8_t next = payload[offset + width - 1];
+
+        big = ((big << 8) | next) & mask;
+        little = (little >> 8) | ((uint32_t)next << (8 * (width - 1)));
+
+        if (big - low <= range || little - low <= range) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// fields are added SIGNATURE_PRUNE_FIELDS at a time, a block is given up once all its distances reach limit
+#define SIGNATURE_PRUNE_FIELDS  8
+
+static uint64_t signature_candidate(const uint8_t *distance, int limit) {
+    uint64_t candidate = 0;
+
+    for (int i = 0; i < SIGNATURE_BLOCK; i++) {
+        if (distance[i] < limit) {
+            candidate |= (uint64_t)1 << i;
+        }
+    }
+    return candidate;
+}
+
+static uint8_t add_saturate(uint8_t a, uint8_t b) {
+    return (a > 255 - b) ? 255 : a + b;
+}
+
+static void signature_distance_scalar(const uint8_t *block_list, int nb_block, int nb_field, int nb_compared, const uint8_t *weight, int limit,
+                                      uint8_t *distance, uint64_t *candidate) {
+    for (int b = 0; b < nb_block; b++) {
+        const uint8_t *block = &block_list[(size_t)b * nb_field * SIGNATURE_BLOCK_BYTES];
+        uint8_t *out = &distance[b * SIGNATURE_BLOCK];
+
+        memset(out, 0, SIGNATURE_BLOCK);
+        candidate[b] = ~(uint64_t)0;
+        for (int f = 0; f < nb_compared; f++) {
+            const uint8_t *row = &weight[f * 16];
+            const uint8_t *code = &block[f * SIGNATURE_BLOCK_BYTES];
+
+            for (int i = 0; i < SIGNATURE_BLOCK_BYTES; i++) {
+                out[i] = add_saturate(out[i], row[code[i] & 0x0F]);
+                out[i + SIGNATURE_BLOCK_BYTES] = add_saturate(out[i + SIGNATURE_BLOCK_BYTES], row[code[i] >> 4]);
+            }
+            if ((f + 1) % SIGNATURE_PRUNE_FIELDS == 0 && signature_candidate(out, limit) == 0) {
+                break;
+            }
+        }
+        candidate[b] = signature_candidate(out, limit);
+    }
+}
+
+static const struct simd_kernel kernel_scalar = {
+    "scalar",
+    count_increment_scalar,
+    histogram_max_scalar,
+    has_length_scalar,
+    signature_distance_scalar,
+};
+
+#ifdef SIMD_X86
+
+// unsigned byte compare : flip the sign bit and use the signed compare
+
+__attribute__((target("sse2")))
+static int count_increment_sse2(const uint8_t *column, int size) {
+    const __m128i sign = _mm_set1_epi8((char)0x80);
+    int count = 0;
+    int i = 1;
+
+    for (; i + 16 <= size; i += 16) {
+        __m128i cur = _mm_xor_si128(_mm_loadu_si128((const __m128i *)&column[i]), sign);
+        __m128i prev = _mm_xor_si128(_mm_loadu_si128((const __m128i *)&column[i-1]), sign);
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpgt_epi8(cur, prev)));
+    }
+    return count + count_increment_scalar(&column[i-1], size - i + 1);
+}
+
+__attribute__((target("sse2")))
+static int histogram_max_sse2(const int *histogram) {
+    __m128i max = _mm_setzero_si128();
+    int lane[4];
+
+    // no pmaxsd before sse4.1
+    for (int i = 0; i < 256; i += 4) {
+        __m128i cur = _mm_loadu_si128((const __m128i *)&histogram[i]);
+        __m128i gt = _mm_cmpgt_epi32(cur, max);
+        max = _mm_or_si128(_mm_and_si128(gt, cur), _mm_andnot_si128(gt, max));
+    }
+
+    _mm_storeu_si128((__m128i *)lane, max);
+    return max_lane(lane, 4);
+}
+
+// building the integers and looking up the weights need pshufb (ssse3), sse2 keeps the scalar has_length and signature_distance
+static const struct simd_kernel kernel_sse2 = {
+    "sse2",
+    count_increment_sse2,
+    histogram_max_sse2,
+    has_length_scalar,
+    signature_distance_scalar,
+};
+
+__attribute__((target("avx2")))
+static int count_increment_avx2(const uint8_t *column, int size) {
+    const __m256i sign = _mm256_set1_epi8((char)0x80);
+    int count = 0;
+    int i = 1;
+
+    for (; i + 32 <= size; i += 32) {
+        __m256i cur = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&column[i]), sign);
+        __m256i prev = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&column[i-1]), sign);
+        count += __builtin_popcount((uint32_t)_mm256_movemask_epi8(_mm256_cmpgt_epi8(cur, prev)));
+    }
+    return count + count_increment_sse2(&column[i-1], size - i + 1);
+}
+
+__attribute__((target("avx2")))
+static int histogram_max_avx2(const int *histogram) {
+    __m256i max = _mm256_setzero_si256();
+    int lane[8];
+
+    for (int i = 0; i < 256; i += 8) {
+        max = _mm256_max_epi32(max, _mm256_loadu_si256((const __m256i *)&histogram[i]));
+    }
+
+    _mm256_storeu_si256((__m256i *)lane, max);
+    return max_lane(lane, 8);
+}
+
+// pshufb patterns building the 32-bit integer at offsets 0 to 7 of a 16-byte load, one offset per lane
+// the load is copied in both 128-bit halves, so the upper half also picks from bytes 0 to 15
+#define LENGTH_BYTE_LITTLE(lane, k, width)      ((k) < (width) ? (lane) + (k) : 0x80)
+#define LENGTH_BYTE_BIG(lane, k, width)         ((k) < (width) ? (lane) + (width) - 1 - (k) : 0x80)
+#define LENGTH_LANE(order, lane, width) \
+            order(lane, 0, width), order(lane, 1, width), order(lane, 2, width), order(lane, 3, width)
+#define LENGTH_SHUFFLE(order, width) \
+            { LENGTH_LANE(order, 0, width), LENGTH_LANE(order, 1, width), LENGTH_LANE(order, 2, width), LENGTH_LANE(order, 3, width), \
+              LENGTH_LANE(order, 4, width), LENGTH_LANE(order, 5, width), LENGTH_LANE(order, 6, width), LENGTH_LANE(order, 7, width) }
+
+static const uint8_t length_shuffle_little[4][32] __attribute__((aligned(32))) = {
+    LENGTH_SHUFFLE(LENGTH_BYTE_LITTLE, 1), LENGTH_SHUFFLE(LENGTH_BYTE_LITTLE, 2),
+    LENGTH_SHUFFLE(LENGTH_BYTE_LITTLE, 3), LENGTH_SHUFFLE(LENGTH_BYTE_LITTLE, 4),
+};
+
+static const uint8_t length_shuffle_big[4][32] __attribute__((aligned(32))) = {
+    LENGTH_SHUFFLE(LENGTH_BYTE_BIG, 1), LENGTH_SHUFFLE(LENGTH_BYTE_BIG, 2),
+    LENGTH_SHUFFLE(LENGTH_BYTE_BIG, 3), LENGTH_SHUFFLE(LENGTH_BYTE_BIG, 4),
+};
+
+// 8 offsets per iteration, both byte orders, unsigned range check with min_epu32
+__attribute__((target("avx2")))
+static int has_length_avx2(const uint8_t *payload, int size, uint32_t length) {
+    int width = length_width(length);
+    int last = size - width;
+    uint32_t low, range;
+
+    length_match_range(length, &low, &range);
+
+    const __m256i shuffle_little = _mm256_load_si256((const __m256i *)length_shuffle_little[width - 1]);
+    const __m256i shuffle_big = _mm256_load_si256((const __m256i *)length_shuffle_big[width - 1]);
+    const __m256i low_vec = _mm256_set1_epi32((int)low);
+    const __m256i range_vec = _mm256_set1_epi32((int)range);
+
+    for (int offset = 0; offset <= last; offset += 8) {
+        const uint8_t *src = &payload[offset];
+        uint8_t tail[16];
+
+        // never read past size, the missing bytes only feed offsets past last
+        if (size - offset < 16) {
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, src, size - offset);
+            src = tail;
+        }
+
+        __m256i bytes = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)src));
+        __m256i little = _mm256_sub_epi32(_mm256_shuffle_epi8(bytes, shuffle_little), low_vec);
+        __m256i big = _mm256_sub_epi32(_mm256_shuffle_epi8(bytes, shuffle_big), low_vec);
+        __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi32(_mm256_min_epu32(little, range_vec), little),
+                                      _mm256_cmpeq_epi32(_mm256_min_epu32(big, range_vec), big));
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(hit));
+
+        if (last - offset < 7) {
+            mask &= (1 << (last - offset + 1)) - 1;
+        }
+        if (mask) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// one field of a block per vector : the weights of the 64 codes are two pshufb in the weight row of the field
+// a lane is below limit when max(distance, limit - 1) == limit - 1, limit above 255 takes every lane
+__attribute__((target("avx2")))
+static void signature_distance_avx2(const uint8_t *block_list, int nb_block, int nb_field, int nb_compared, const uint8_t *weight, int limit,
+                                    uint8_t *distance, uint64_t *candidate) {
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i below = _mm256_set1_epi8((char)((limit > 255) ? 255 : (limit > 0) ? limit - 1 : 0));
+
+    for (int b = 0; b < nb_block; b++) {
+        const uint8_t *block = &block_list[(size_t)b * nb_field * SIGNATURE_BLOCK_BYTES];
+        __m256i low = _mm256_setzero_si256();
+        __m256i high = _mm256_setzero_si256();
+
+        for (int f = 0; f < nb_compared; f++) {
+            __m256i row = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)&weight[f * 16]));
+            __m256i code = _mm256_loadu_si256((const __m256i *)&block[f * SIGNATURE_BLOCK_BYTES]);
+
+            low = _mm256_adds_epu8(low, _mm256_shuffle_epi8(row, _mm256_and_si256(code, nibble)));
+            high = _mm256_adds_epu8(high, _mm256_shuffle_epi8(row, _mm256_and_si256(_mm256_srli_epi16(code, 4), nibble)));
+
+            if (limit <= 255 && (f + 1) % SIGNATURE_PRUNE_FIELDS == 0) {
+                __m256i nearest = _mm256_min_epu8(low, high);
+
+                if (limit == 0 || _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(nearest, below), below)) == 0) {
+                    break;
+                }
+            }
+        }
+
+        _mm256_storeu_si256((__m256i *)&distance[b * SIGNATURE_BLOCK], low);
+        _mm256_storeu_si256((__m256i *)&distance[b * SIGNATURE_BLOCK + SIGNATURE_BLOCK_BYTES], high);
+
+        if (limit > 255) {
+            candidate[b] = ~(uint64_t)0;
+        } else if (limit == 0) {
+            candidate[b] = 0;
+        } else {
+            candidate[b] = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(low, below), below)) |
+                           (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(high, below), below)) << 32;
+        }
+    }
+}
+
+static const struct simd_kernel kernel_avx2 = {
+    "avx2",
+    count_increment_avx2,
+    histogram_max_avx2,
+    has_length_avx2,
+    signature_distance_avx2,
+};
+
+// avx-512bw has unsigned byte compares into mask registers, the tail is a masked load
+__attribute__((target("avx512f,avx512bw")))
+static int count_increment_avx512(const uint8_t *column, int size) {
+    int count = 0;
+    int i = 1;
+
+    for (; i < size; i += 64) {
+        __mmask64 mask = (size - i >= 64) ? ~(__mmask64)0 : (((__mmask64)1 << (size - i)) - 1);
+        __m512i cur = _mm512_maskz_loadu_epi8(mask, &column[i]);
+        __m512i prev = _mm512_maskz_loadu_epi8(mask, &column[i-1]);
+        count += __builtin_popcountll(_mm512_mask_cmpgt_epu8_mask(mask, cur, prev));
+    }
+    return count;
+}
+
+__attribute__((target("avx512f")))
+static int histogram_max_avx512(const int *histogram) {
+    __m512i max = _mm512_setzero_si512();
+
+    for (int i = 0; i < 256; i += 16) {
+        max = _mm512_max_epi32(max, _mm512_loadu_si512((const void *)&histogram[i]));
+    }
+    return _mm512_reduce_max_epi32(max);
+}
+
+// two fields of a block per vector, the 256-bit halves are added when the block is pruned or done
+// fields f and f + 1 are next to each other, as are their weight rows, each row is copied in the two 128-bit lanes of its half
+__attribute__((target("avx512f,avx512bw")))
+static void signature_distance_avx512(const uint8_t *block_list, int nb_block, int nb_field, int nb_compared, const uint8_t *weight, int limit,
+                                      uint8_t *distance, uint64_t *candidate) {
+    const __m512i nibble = _mm512_set1_epi8(0x0F);
+    const __m512i limit_vec = _mm512_set1_epi8((char)((limit > 255) ? 255 : limit));
+
+    for (int b = 0; b < nb_block; b++) {
+        const uint8_t *block = &block_list[(size_t)b * nb_field * SIGNATURE_BLOCK_BYTES];
+        __m512i low = _mm512_setzero_si512();
+        __m512i high = _mm512_setzero_si512();
+        __m512i sum;
+
+        for (int f = 0; f < nb_compared; f += 2) {
+            // the odd last field only takes the lower half
+            __mmask64 mask = (nb_compared - f >= 2) ? ~(__mmask64)0 : (__mmask64)0xFFFFFFFF;
+            __m512i rows = _mm512_maskz_loadu_epi8((nb_compared - f >= 2) ? 0xFFFFFFFF : 0xFFFF, &weight[f * 16]);
+            __m512i code = _mm512_maskz_loadu_epi8(mask, &block[f * SIGNATURE_BLOCK_BYTES]);
+
+            rows = _mm512_shuffle_i64x2(rows, rows, 0x50);
+            low = _mm512_adds_epu8(low, _mm512_maskz_shuffle_epi8(mask, rows, _mm512_and_si512(code, nibble)));
+            high = _mm512_adds_epu8(high, _mm512_maskz_shuffle_epi8(mask, rows, _mm512_and_si512(_mm512_srli_epi16(code, 4), nibble)));
+
+            if (limit <= 255 && (f + 2) % SIGNATURE_PRUNE_FIELDS == 0) {
+                sum = _mm512_adds_epu8(_mm512_shuffle_i64x2(low, high, 0x44), _mm512_shuffle_i64x2(low, high, 0xEE));
+                if (_mm512_cmplt_epu8_mask(sum, limit_vec) == 0) {
+                    break;
+                }
+            }
+        }
+
+        // low and high halves of both accumulators : the 64 distances of the block, in signature order
+        sum = _mm512_adds_epu8(_mm512_shuffle_i64x2(low, high, 0x44), _mm512_shuffle_i64x2(low, high, 0xEE));
+        _mm512_storeu_si512((void *)&distance[b * SIGNATURE_BLOCK], sum);
+        candidate[b] = (limit > 255) ? ~(uint64_t)0 : _mm512_cmplt_epu8_mask(sum, limit_vec);
+    }
+}
+
+// payload prefixes are a few 8-offset vectors long, the avx2 has_length is kept
+static const struct simd_kernel kernel_avx512 = {
+    "avx512",
+    count_increment_avx512,
+    histogram_max_avx512,
+    has_length_avx2,
+    signature_distance_avx512,
+};
+
+#endif // SIMD_X86
+
+const struct simd_kernel *simd_kernel = &kernel_scalar;
+
+__attribute__((constructor)) static void select_simd_kernel() {
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+        simd_kernel = &kernel_avx512;
+    } else if (__builtin_cpu_supports("avx2")) {
+        simd_kernel = &kernel_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        simd_kernel = &kernel_sse2;
+    }
+#endif
+    debug("simd kernel : %s\n", simd_kernel->name);
+}
+
+#define CHECK_SIGNATURE_BLOCKS  3
+
+// same candidates, and the same distances for them
+static int check_signature_distance(const struct simd_kernel *kernel) {
+    const int nb_field_list[] = {1, 7, 8, 9, 16, 33, SIGNATURE_FIELD_MAX};
+    const int limit_list[] = {0, 1, 5, 20, 60, 255, 256};
+    const int nb_case = sizeof(nb_field_list) / sizeof(nb_field_list[0]);
+    static uint8_t block_list[CHECK_SIGNATURE_BLOCKS * SIGNATURE_FIELD_MAX * SIGNATURE_BLOCK_BYTES];
+    uint8_t weight[SIGNATURE_FIELD_MAX * 16];
+    uint8_t expected[CHECK_SIGNATURE_BLOCKS * SIGNATURE_BLOCK];
+    uint8_t actual[CHECK_SIGNATURE_BLOCKS * SIGNATURE_BLOCK];
+    uint64_t expected_candidate[CHECK_SIGNATURE_BLOCKS];
+    uint64_t actual_candidate[CHECK_SIGNATURE_BLOCKS];
+    uint32_t seed = 7;
+
+    for (int i = 0; i < (int)sizeof(block_list); i++) {
+        seed = seed * 1103515245 + 12345;
+        block_list[i] = (uint8_t)(seed >> 16);
+    }
+    for (int i = 0; i < (int)sizeof(weight); i++) {
+        seed = seed * 1103515245 + 12345;
+        weight[i] = (uint8_t)((seed >> 16) % 6);
+    }
+
+    // every number of compared fields up to the fields of the blocks, for every limit
+    for (int i = 0; i < nb_case; i++) {
+        for (int nb_compared = 0; nb_compared <= nb_field_list[i]; nb_compared++) {
+            for (int j = 0; j < (int)(sizeof(limit_list) / sizeof(limit_list[0])); j++) {
+                int limit = limit_list[j];
+
+                kernel_scalar.signature_distance(block_list, CHECK_SIGNATURE_BLOCKS, nb_field_list[i], nb_compared, weight, limit, expected, expected_candidate);
+                kernel->signature_distance(block_list, CHECK_SIGNATURE_BLOCKS, nb_field_list[i], nb_compared, weight, limit, actual, actual_candidate);
+
+                for (int k = 0; k < CHECK_SIGNATURE_BLOCKS * SIGNATURE_BLOCK; k++) {
+                    uint64_t bit = (uint64_t)1 << (k % SIGNATURE_BLOCK);
+
+                    if ((expected_candidate[k / SIGNATURE_BLOCK] & bit) != (actual_candidate[k / SIGNATURE_BLOCK] & bit) ||
+                        ((expected_candidate[k / SIGNATURE_BLOCK] & bit) && expected[k] != actual[k])) {
+                        error("simd kernel %s signature_distance mismatch (nb_field : %d, nb_compared : %d, limit : %d, lane : %d)\n",
+                              kernel->name, nb_field_list[i], nb_compared, limit, k);
+                        return -1;
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+// mode and increment counts as the classifiers computed them before the kernels : one loop over the column
+static void original_column_stats(const uint8_t *column, int size, int *byte_count_max, int *increment_count) {
+    int byte_count[256] = {0};
+
+    *byte_count_max = 0;
+    *increment_count = 0;
+    for (int i = 0; i < size; i++) {
+        byte_count[column[i]]++;
+
+        if (i > 0 && column[i] > column[i-1]) {
+            (*increment_count)++;
+        }
+    }
+
+    for (int i = 0; i < 256; i++) {
+        if (*byte_count_max < byte_count[i]) {
+            *byte_count_max = byte_count[i];
+        }
+    }
+}
+
+// type_stable_classifier and type_increment_classifier decisions, at every ratio, against the original loops
+static int check_original_classifiers(const struct simd_kernel *kernel, const uint8_t *column, int size) {
+    int histogram[256];
+    int expected_max, expected_increment;
+    int max, increment;
+
+    if (size == 0) {
+        return 0;
+    }
+
+    original_column_stats(column, size, &expected_max, &expected_increment);
+    byte_histogram(column, size, histogram);
+    max = kernel->histogram_max(histogram);
+    increment = kernel->count_increment(column, size);
+    if (max != expected_max || increment != expected_increment) {
+        error("simd kernel %s column stats mismatch (size : %d)\n", kernel->name, size);
+        return -1;
+    }
+
+    for (int ratio = 0; ratio <= 100; ratio++) {
+        if ((max * 100 / size > ratio) != (expected_max * 100 / size > ratio) ||
+            (increment * 100 / size > ratio) != (expected_increment * 100 / size > ratio)) {
+            error("simd kernel %s classifier mismatch (size : %d, ratio : %d)\n", kernel->name, size, ratio);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int check_kernel(const struct simd_kernel *kernel) {
+    const uint32_t length_list[] = {0, 1, 8, 9, 0x81, 0xff, 0x100, 0x8100, 0xfff9, 0x10000, 0x818181, 0x1000000, 0x81818181, 0xfffffffa};
+    uint8_t column[256];
+    int histogram[256];
+    uint32_t seed = 1;
+
+    for (int pass = 0; pass < 4; pass++) {
+        for (int i = 0; i < 256; i++) {
+            seed = seed * 1103515245 + 12345;
+            switch (pass) {
+            case 0: column[i] = (uint8_t)(seed >> 16); break;           // random
+            case 1: column[i] = (uint8_t)i; break;                      // increasing
+            case 2: column[i] = (uint8_t)((seed >> 16) & 0x81); break;  // zeros and sign bits
+            default: column[i] = (i & 1) ? 0xff : 0x00; break;          // alternating extremes
+            }
+        }
+
+        for (int size = 0; size <= 256; size++) {
+            if (kernel->count_increment(column, size) != kernel_scalar.count_increment(column, size)) {
+                error("simd kernel %s mismatch (pass : %d, size : %d)\n", kernel->name, pass, size);
+                return -1;
+            }
+
+            for (int j = 0; j < (int)(sizeof(length_list) / sizeof(length_list[0])); j++) {
+                if (kernel->has_length(column, size, length_list[j]) != kernel_scalar.has_length(column, size, length_list[j])) {
+                    error("simd kernel %s has_length mismatch (pass : %d, size : %d, length : %u)\n", kernel->name, pass, size, length_list[j]);
+                    return -1;
+                }
+            }
+
+            byte_histogram(column, size, histogram);
+            if (kernel->histogram_max(histogram) != kernel_scalar.histogram_max(histogram)) {
+                error("simd kernel %s histogram mismatch (pass : %d, size : %d)\n", kernel->name, pass, size);
+                return -1;
+            }
+
+            if (check_original_classifiers(kernel, column, size)) {
+                return -1;
+            }
+        }
+    }
+
+    if (check_signature_distance(kernel)) {
+        return -1;
+    }
+
+    debug("simd kernel %s matches scalar\n", kernel->name);
+    return 0;
+}
+
+// differential check of every kernel the cpu supports against the scalar one, and of all of them against the original classifier loops
+int simd_kernel_self_check(void) {
+    if (check_kernel(&kernel_scalar)) {
+        return -1;
+    }
+#ifdef SIMD_X86
+    if (__builtin_cpu_supports("sse2") && check_kernel(&kernel_sse2)) {
+        return -1;
+    }
+    if (__builtin_cpu_supports("avx2") && check_kernel(&kernel_avx2)) {
+        return -1;
+    }
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && check_kernel(&kernel_avx512)) {
+        return -1;
+    }
+#endif
+    return 0;
+}
@@ -0,0 +1,458 @@
+#include "../include/core.h"
+#include "../include/debug.h"
+#include "../include/trace_parser.h"
+#include "../include/tcp_stream.h"
+
+// tls record : content type, version 3.x
+static int check_tls_header(const uint8_t *header) {
+    return header[0] >= 20 && header[0] <= 24 && header[1] == 3 && header[2] <= 4;
+}
+
+// openvpn over tcp and other length prefixed protocols : nothing to check besides the length
+static int check_length_header(const uint8_t *header) {
+    return 1;
+}
+
+static const struct record_framing framing_list[TCP_FRAMING_COUNT] = {
+    { "tls", 5, 3, 5, TLS_MAX_RECORD, check_tls_header },
+    { "length", 2, 0, 2, UINT16_MAX, check_length_header },
+};
+
+static void record_parser_start(struct record_parser *parser, uint64_t offset) {
+    parser->start = offset;
+    parser->end = 0;
+    parser->len = 0;
+    parser->emitted = 0;
+    parser->failed = 0;
+    parser->nb_crossed = 0;
+}
+
+// bytes of the record to read : its header until the size is known, then up to prefix_size
+static uint64_t record_keep(const struct record_parser *parser, const struct record_framing *framing, uint64_t prefix_size) {
+    uint64_t keep = framing->header_size;
+
+    if (parser->end == 0) {
+        return keep;
+    }
+    if (keep < prefix_size) {
+        keep = prefix_size;
+    }
+    if (keep > parser->end - parser->start) {
+        keep = parser->end - parser->start;
+    }
+
+    return keep;
+}
+
+static void record_parser_fail(struct record_parser *parser) {
+    parser->failed = 1;
+    parser->nb_aligned = 0;
+}
+
+// every framing is tried again, from the next segment start
+static void tcp_direction_detect(struct tcp_direction *direction) {
+    direction->state = TCP_DIRECTION_DETECT;
+    direction->nb_segment = 0;
+    direction->framing = -1;
+
+    for (int i = 0; i < TCP_FRAMING_COUNT; i++) {
+        record_parser_fail(&direction->parser[i]);
+    }
+}
+
+static void tcp_direction_clear(struct tcp_direction *direction) {
+    for (int i = 0; i < direction->nb_pending; i++) {
+        free(direction->pending[i].data);
+    }
+    direction->nb_pending = 0;
+    direction->pending_bytes = 0;
+}
+
+// segment of side as a decoded packet, for the handler
+static void make_record(struct tcp_stream *stream, int side, const uint8_t *payload, uint64_t size, uint64_t captured_size, struct decoded_packet *record) {
+    memset(record, 0, sizeof(struct decoded_packet));
+
+    record->ip_src = stream->ip[side];
+    record->ip_dst = stream->ip[!side];
+    record->port_src = stream->port[side];
+    record->port_dst = stream->port[!side];
+    record->protocol = IPPROTO_TCP;
+    record->payload = (const char *)payload;
+    record->payload_size = size;
+    record->captured_size = captured_size;
+}
+
+// reads the bytes [offset, offset + size) of the stream, the first captured_size of them are in data
+// only the header of each record is kept, and its prefix when emit is set (reported through handler_func)
+static int parse_records(struct tcp_stream *stream, int side, struct record_parser *parser, const struct record_framing *framing,
+                         const uint8_t *data, uint64_t size, uint64_t captured_size, uint64_t offset, int64_t timestamp, uint64_t packet_count,
+                         int emit, tcp_record_handler handler_func, void *arg) {
+    struct tcp_direction *direction = &stream->direction[side];
+    struct decoded_packet record;
+    uint64_t position = offset;
+    uint64_t segment_end = offset + size;
+    int ret = WINDOW_COLLECTING;
+
+    // out of sync : a record is assumed to start here
+    if (parser->failed) {
+        record_parser_start(parser, offset);
+    }
+
+    while (position < segment_end) {
+        uint64_t read = position - parser->start;
+        uint64_t keep = record_keep(parser, framing, emit ? direction->prefix_size : 0);
+
+        if (read == 0) {
+            parser->timestamp = timestamp;
+            parser->packet_count = packet_count;
+        }
+
+        // header and prefix bytes held in this segment
+        if (read < keep) {
+            uint64_t stop = (parser->start + keep < segment_end) ? parser->start + keep : segment_end;
+            uint64_t index = position - offset;
+            uint64_t copy_size = (captured_size > index) ? captured_size - index : 0;
+
+            if (copy_size > stop - position) {
+                copy_size = stop - position;
+            }
+
+            // bytes past the snap length are not known, they end the prefix
+            if (parser->len == read) {
+                if (read < framing->header_size) {
+                    memcpy(parser->header + read, data + index, copy_size);
+                }
+                if (emit) {
+                    memcpy(direction->prefix + read, data + index, copy_size);
+                }
+                parser->len += copy_size;
+            }
+
+            position = stop;
+
+            if (parser->end == 0) {
+                uint64_t length;
+
+                // the header goes on in the next segment
+                if (position - parser->start < framing->header_size) {
+                    break;
+                }
+
+                if (parser->len < framing->header_size || !framing->check(parser->header)) {
+                    record_parser_fail(parser);
+                    return ret;
+                }
+
+                length = (uint64_t)parser->header[framing->length_offset] << 8 | parser->header[framing->length_offset + 1];
+                if (length == 0 || length > framing->max_length) {
+                    record_parser_fail(parser);
+                    return ret;
+                }
+
+                // the prefix is read once the record size is known
+                parser->end = parser->start + length + framing->length_bias;
+                continue;
+            }
+
+            // the prefix goes on in the next segment
+            if (position - parser->start < keep) {
+                break;
+            }
+        }
+
+        if (emit && !parser->emitted) {
+            make_record(stream, side, direction->prefix, parser->end - parser->start, parser->len, &record);
+            parser->emitted = 1;
+            ret = handler_func(&record, 1, parser->timestamp, parser->packet_count, arg);
+        }
+
+        // the rest of the record is not needed
+        position = (parser->end < segment_end) ? parser->end : segment_end;
+        if (position == parser->end) {
+            if (position == segment_end) {
+                parser->nb_aligned++;
+            }
+            record_parser_start(parser, position);
+        }
+
+        if (ret != WINDOW_COLLECTING) {
+            break;
+        }
+    }
+
+    // a weak header check lets a wrong start read lengths out of random bytes, far longer than real records
+    if (!emit && parser->start < segment_end && ++parser->nb_crossed > TCP_STREAM_MAX_CROSSED) {
+        record_parser_fail(parser);
+    }
+
+    return ret;
+}
+
+// in-order bytes of side, at next_seq
+static int tcp_direction_deliver(struct tcp_stream *stream, int side, const uint8_t *data, uint32_t size, uint32_t captured_size,
+                                 int64_t timestamp, uint64_t packet_count, tcp_record_handler handler_func, void *arg) {
+    struct tcp_direction *direction = &stream->direction[side];
+    struct decoded_packet record;
+    int ret = WINDOW_COLLECTING;
+
+    switch (direction->state) {
+    case TCP_DIRECTION_DETECT:
+        make_record(stream, side, data, size, captured_size, &record);
+        ret = handler_func(&record, 0, timestamp, packet_count, arg);
+
+        for (int i = 0; i < TCP_FRAMING_COUNT; i++) {
+            parse_records(stream, side, &direction->parser[i], &framing_list[i], data, size, captured_size, direction->offset, timestamp, packet_count, 0, handler_func, arg);
+        }
+
+        // a framing is trusted at a record end, the next segment starts a record
+        for (int i = 0; i < TCP_FRAMING_COUNT; i++) {
+            if (direction->parser[i].nb_aligned >= TCP_STREAM_CONFIRM) {
+                debug("tcp stream : %s records after %d segments\n", framing_list[i].name, direction->nb_segment + 1);
+                direction->state = TCP_DIRECTION_RECORDS;
+                direction->framing = i;
+                break;
+            }
+        }
+
+        if (direction->state == TCP_DIRECTION_DETECT && ++direction->nb_segment == TCP_STREAM_DETECT_SEGMENTS) {
+            debug("tcp stream : no framing, segments are filtered\n");
+            direction->state = TCP_DIRECTION_SEGMENTS;
+        }
+        break;
+    case TCP_DIRECTION_RECORDS:
+        ret = parse_records(stream, side, &direction->parser[direction->framing], &framing_list[direction->framing],
+                            data, size, captured_size, direction->offset, timestamp, packet_count, 1, handler_func, arg);
+
+        if (direction->parser[direction->framing].failed) {
+            debug("tcp stream : %s records out of sync\n", framing_list[direction->framing].name);
+            tcp_direction_detect(direction);
+        }
+        break;
+    default:
+        make_record(stream, side, data, size, captured_size, &record);
+        ret = handler_func(&record, 0, timestamp, packet_count, arg);
+        break;
+    }
+
+    direction->next_seq += size;
+    direction->offset += size;
+
+    return ret;
+}
+
+// held segments that are now in order, retransmitted bytes are trimmed
+static int tcp_direction_drain(struct tcp_stream *stream, int side, tcp_record_handler handler_func, void *arg) {
+    struct tcp_direction *direction = &stream->direction[side];
+    int ret = WINDOW_COLLECTING;
+
+    while (ret == WINDOW_COLLECTING && direction->nb_pending > 0) {
+        struct tcp_segment *segment = &direction->pending[0];
+        int32_t diff = (int32_t)(segment->seq - direction->next_seq);
+
+        if (diff > 0) {
+            break;
+        }
+
+        if ((int64_t)diff + segment->size > 0) {
+            uint32_t trim = -diff;
+            ret = tcp_direction_deliver(stream, side, segment->data + trim, segment->size - trim,
+                                        (segment->captured_size > trim) ? segment->captured_size - trim : 0,
+                                        segment->timestamp, segment->packet_count, handler_func, arg);
+        }
+
+        direction->pending_bytes -= segment->captured_size;
+        free(segment->data);
+        direction->nb_pending--;
+        memmove(&direction->pending[0], &direction->pending[1], sizeof(struct tcp_segment) * direction->nb_pending);
+    }
+
+    return ret;
+}
+
+// keeps a segment received ahead of next_seq, -1 when there is no room left
+static int tcp_direction_hold(struct tcp_direction *direction, const struct decoded_packet *decoded, int64_t timestamp, uint64_t packet_count) {
+    struct tcp_segment *segment;
+    int32_t diff = (int32_t)(decoded->seq - direction->next_seq);
+    int index;
+
+    for (index = 0; index < direction->nb_pending; index++) {
+        int32_t pending_diff = (int32_t)(direction->pending[index].seq - direction->next_seq);
+
+        if (pending_diff == diff && direction->pending[index].size >= decoded->payload_size) {
+            return 0;       // retransmitted while held
+        }
+        if (pending_diff > diff) {
+            break;
+        }
+    }
+
+    if (direction->nb_pending == TCP_STREAM_MAX_PENDING || direction->pending_bytes + decoded->captured_size > TCP_STREAM_PENDING_BYTES) {
+        return -1;
+    }
+
+    memmove(&direction->pending[index + 1], &direction->pending[index], sizeof(struct tcp_segment) * (direction->nb_pending - index));
+
+    segment = &direction->pending[index];
+    segment->seq = decoded->seq;
+    segment->size = decoded->payload_size;
+    segment->captured_size = decoded->captured_size;
+    segment->timestamp = timestamp;
+    segment->packet_count = packet_count;
+    segment->data = (uint8_t *)malloc(decoded->captured_size + 1);
+    if (segment->data == NULL) {
+        memmove(&direction->pending[index], &direction->pending[index + 1], sizeof(struct tcp_segment) * (direction->nb_pending - index));
+        return -1;
+    }
+    memcpy(segment->data, decoded->payload, decoded->captured_size);
+
+    direction->nb_pending++;
+    direction->pending_bytes += decoded->captured_size;
+
+    return 0;
+}
+
+// the bytes before seq are assumed lost, records are looked for again
+static void tcp_direction_skip(struct tcp_direction *direction, uint32_t seq) {
+    debug("tcp stream : %u bytes lost\n", seq - direction->next_seq);
+
+    direction->offset += (uint32_t)(seq - direction->next_seq);
+    direction->next_seq = seq;
+
+    if (direction->state != TCP_DIRECTION_SEGMENTS) {
+        tcp_direction_detect(direction);
+    }
+}
+
+int tcp_stream_init(struct tcp_stream *stream, int nb_bytes) {
+    memset(stream, 0, sizeof(struct tcp_stream));
+
+    for (int side = 0; side < 2; side++) {
+        stream->direction[side].prefix = (uint8_t *)malloc(nb_bytes);
+        if (stream->direction[side].prefix == NULL) {
+            error("Memory allocation failed\n");
+            tcp_stream_release(stream);
+            return -1;
+        }
+        stream->direction[side].prefix_size = nb_bytes;
+    }
+
+    return 0;
+}
+
+// one data segment of a window : the first connection seen is reassembled
+// returns TCP_STREAM_SEGMENT for the segments of other connections and of directions without framing,
+// otherwise what the handler returned (WINDOW_COLLECTING when it was not called)
+int tcp_stream_add(struct tcp_stream *stream, const struct decoded_packet *decoded, int64_t timestamp, uint64_t packet_count, tcp_record_handler handler_func, void *arg) {
+    struct tcp_direction *direction;
+    uint32_t size = decoded->payload_size;
+    uint32_t captured_size = decoded->captured_size;
+    const uint8_t *data = (const uint8_t *)decoded->payload;
+    int32_t diff;
+    int side;
+    int ret;
+
+    if (!stream->started) {
+        stream->ip[0] = decoded->ip_src;
+        stream->ip[1] = decoded->ip_dst;
+        stream->port[0] = decoded->port_src;
+        stream->port[1] = decoded->port_dst;
+        stream->started = 1;
+    }
+
+    if (ip_address_equal(&decoded->ip_src, &stream->ip[0]) && ip_address_equal(&decoded->ip_dst, &stream->ip[1]) &&
+        decoded->port_src == stream->port[0] && decoded->port_dst == stream->port[1]) {
+        side = 0;
+    } else if (ip_address_equal(&decoded->ip_src, &stream->ip[1]) && ip_address_equal(&decoded->ip_dst, &stream->ip[0]) &&
+               decoded->port_src == stream->port[1] && decoded->port_dst == stream->port[0]) {
+        side = 1;
+    } else {
+        return TCP_STREAM_SEGMENT;
+    }
+
+    direction = &stream->direction[side];
+
+    if (direction->state == TCP_DIRECTION_SEGMENTS && direction->nb_pending == 0) {
+        return TCP_STREAM_SEGMENT;
+    }
+
+    if (direction->state == TCP_DIRECTION_NEW) {
+        direction->next_seq = decoded->seq;
+        tcp_direction_detect(direction);
+    }
+
+    // retransmission
+    diff = (int32_t)(decoded->seq - direction->next_seq);
+    if ((int64_t)diff + size <= 0) {
+        return WINDOW_COLLECTING;
+    }
+
+    // out of order : held until the bytes before it arrive, or until there is no room left
+    while ((diff = (int32_t)(decoded->seq - direction->next_seq)) > 0) {
+        uint32_t seq = decoded->seq;
+
+        if (tcp_direction_hold(direction, decoded, timestamp, packet_count) == 0) {
+            return WINDOW_COLLECTING;
+        }
+
+        if (direction->nb_pending > 0 && (int32_t)(direction->pending[0].seq - seq) < 0) {
+            seq = direction->pending[0].seq;
+        }
+        tcp_direction_skip(direction, seq);
+
+        ret = tcp_direction_drain(stream, side, handler_func, arg);
+        if (ret != WINDOW_COLLECTING) {
+            return ret;
+        }
+    }
+
+    // overlaps bytes already read
+    if (diff < 0) {
+        uint32_t trim = -diff;
+
+        data += trim;
+        size -= trim;
+        captured_size = (captured_size > trim) ? captured_size - trim : 0;
+    }
+
+    ret = tcp_direction_deliver(stream, side, data, size, captured_size, timestamp, packet_count, handler_func, arg);
+    if (ret != WINDOW_COLLECTING) {
+        return ret;
+    }
+
+    return tcp_direction_drain(stream, side, handler_func, arg);
+}
+
+size_t tcp_stream_size(const struct tcp_stream *stream) {
+    size_t size = sizeof(struct tcp_stream);
+
+    for (int side = 0; side < 2; side++) {
+        size += stream->direction[side].prefix_size + stream->direction[side].pending_bytes;
+    }
+
+    return size;
+}
+
+// forgets the connection, the prefix buffers are kept
+void tcp_stream_reset(struct tcp_stream *stream) {
+    for (int side = 0; side < 2; side++) {
+        struct tcp_direction *direction = &stream->direction[side];
+        uint8_t *prefix = direction->prefix;
+        int prefix_size = direction->prefix_size;
+
+        tcp_direction_clear(direction);
+        memset(direction, 0, sizeof(struct tcp_direction));
+        direction->prefix = prefix;
+        direction->prefix_size = prefix_size;
+    }
+
+    stream->started = 0;
+}
+
+void tcp_stream_release(struct tcp_stream *stream) {
+    for (int side = 0; side < 2; side++) {
+        tcp_direction_clear(&stream->direction[side]);
+        free(stream->direction[side].prefix);
+    }
+
+    memset(stream, 0, sizeof(struct tcp_stream));
+}
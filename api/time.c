@@ -3,22 +3,6 @@
 #include "../include/trace_parser.h"
 #include "../include/vpn_fingerprint.h"
 
-void timeval_subtract(struct timeval *result, struct timeval *x, struct timeval *y) {
-    if (x->tv_usec < y->tv_usec) {
-        int nsec = (y->tv_usec - x->tv_usec) / 1000000 + 1;
-        y->tv_usec -= 1000000 * nsec;
-        y->tv_sec += nsec;
-    }
-    if (x->tv_usec - y->tv_usec > 1000000) {
-        int nsec = (x->tv_usec - y->tv_usec) / 1000000;
-        y->tv_usec += 1000000 * nsec;
-        y->tv_sec -= nsec;
-    }
-
-    result->tv_sec = x->tv_sec - y->tv_sec;
-    result->tv_usec = x->tv_usec - y->tv_usec;
-}
-
 uint64_t current_time;
 uint64_t elapsed_time;
 
@@ -0,0 +1,115 @@
+#include "../include/core.h"
+#include "../include/debug.h"
+#include "../include/timer_wheel.h"
+
+#define LEVEL_INDEX(tick, level)    (((tick) >> (TIMER_WHEEL_BITS * (level))) & TIMER_WHEEL_MASK)
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now) {
+    memset(wheel, 0, sizeof(struct timer_wheel));
+    wheel->now = now;
+}
+
+static void link_node(struct timer_node **head, struct timer_node *node) {
+    node->next = *head;
+    if (*head != NULL) {
+        (*head)->pprev = &node->next;
+    }
+    *head = node;
+    node->pprev = head;
+}
+
+// the lowest level where expire and now share the upper block, so its slot is cascaded before it wraps
+void timer_wheel_add(struct timer_wheel *wheel, struct timer_node *node, uint64_t expire) {
+    int level;
+
+    if (node->pprev != NULL) {
+        timer_wheel_del(wheel, node);
+    }
+
+    // late timers run on the next tick
+    if (expire < wheel->now) {
+        expire = wheel->now;
+    }
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        int shift = TIMER_WHEEL_BITS * (level + 1);
+        if ((expire >> shift) == (wheel->now >> shift)) {
+            break;
+        }
+    }
+
+    // beyond the wheel : runs early at the end of its range, callers check their own deadline
+    if (level == TIMER_WHEEL_LEVELS) {
+        level = TIMER_WHEEL_LEVELS - 1;
+        expire = wheel->now | ((1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1);
+    }
+
+    node->expire = expire;
+    link_node(&wheel->slot[level][LEVEL_INDEX(expire, level)], node);
+    wheel->nb_timer++;
+}
+
+void timer_wheel_del(struct timer_wheel *wheel, struct timer_node *node) {
+    if (node->pprev == NULL) {
+        return;
+    }
+
+    *node->pprev = node->next;
+    if (node->next != NULL) {
+        node->next->pprev = node->pprev;
+    }
+    node->next = NULL;
+    node->pprev = NULL;
+    wheel->nb_timer--;
+}
+
+// moves the timers of one upper slot down to the levels below, returns the slot index
+static int cascade(struct timer_wheel *wheel, int level) {
+    int index = LEVEL_INDEX(wheel->now, level);
+    struct timer_node *node = wheel->slot[level][index];
+
+    wheel->slot[level][index] = NULL;
+
+    while (node != NULL) {
+        struct timer_node *next = node->next;
+
+        node->pprev = NULL;
+        wheel->nb_timer--;
+        timer_wheel_add(wheel, node, node->expire);
+        node = next;
+    }
+
+    return index;
+}
+
+// runs every tick up to now, O(1) per tick, callback may rearm the node
+void timer_wheel_advance(struct timer_wheel *wheel, uint64_t now, timer_callback callback, void *arg) {
+    while (wheel->now <= now) {
+        int index = LEVEL_INDEX(wheel->now, 0);
+        struct timer_node *node;
+
+        // nothing armed : jump straight to now
+        if (wheel->nb_timer == 0) {
+            wheel->now = now + 1;
+            return;
+        }
+
+        if (index == 0) {
+            for (int level = 1; level < TIMER_WHEEL_LEVELS && cascade(wheel, level) == 0; level++);
+        }
+
+        node = wheel->slot[0][index];
+        wheel->slot[0][index] = NULL;
+        wheel->now++;
+
+        while (node != NULL) {
+            struct timer_node *next = node->next;
+
+            node->next = NULL;
+            node->pprev = NULL;
+            wheel->nb_timer--;
+            callback(node, arg);
+            node = next;
+        }
+    }
+}
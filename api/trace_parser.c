@@ -2,304 +2,412 @@
 #include "../include/debug.h"
 #include "../include/trace_parser.h"
 #include "../include/vpn_fingerprint.h"
+#include "../include/arena.h"
+#include "../include/flow.h"
+#include "../include/capture.h"
+#include "../include/tcp_stream.h"
+#include "../include/fragment.h"
+
+static int grow_packet_info(struct packet_info **info_list, int *capacity, int initial_capacity, int window_size) {
+    struct packet_info *new_list;
+    int new_capacity;
+
+    new_capacity = (*capacity == 0) ? initial_capacity : *capacity * 2;
+    if (window_size > 0 && new_capacity > window_size) {
+        new_capacity = window_size;
+    }
 
-int check_ip_address(char *filename) {
-    struct sniff_ip *ip;
-    uint64_t ip_src, ip_dst;
+    new_list = (struct packet_info *)realloc(*info_list, sizeof(struct packet_info) * new_capacity);
+    if (new_list == NULL) {
+        debug("failed to grow packet info list (%d)\n", new_capacity);
+        return -1;
+    }
 
-    const unsigned char *packet;  
-    struct pcap_pkthdr *header;
-    pcap_t *handler;
+    *info_list = new_list;
+    *capacity = new_capacity;
 
-    char error_buf[PCAP_ERRBUF_SIZE];
+    return 0;
+}
 
-    if (filename == NULL) {
-        debug("ERROR: no pcap input\n");
-        return -1;
-    }
+// initial_capacity : packets of the first info list, doubled up to the window size
+int packet_window_init(struct packet_window *window, int nb_bytes, int chunk_slots, int initial_capacity) {
+    memset(window, 0, sizeof(struct packet_window));
+    window->initial_capacity = initial_capacity;
 
-    //open file and create pcap handler
-    handler = pcap_open_offline(filename, error_buf);
+    return payload_arena_init(&window->arena, nb_bytes, chunk_slots);
+}
 
-    if (handler == NULL) {
-        debug("%s\n", error_buf);
-        return -1;
-    }
+// drops the stored packets, the list and the arena chunks are kept for the next capture
+void packet_window_reset(struct packet_window *window) {
+    payload_arena_reset(&window->arena);
 
-    if (pcap_datalink(handler) != DLT_EN10MB) {
-        debug("this is not ethernet capture\n");
-        pcap_close(handler);
-        return -1;
+    window->nb_stored = 0;
+    window->src_count = window->dst_count = 0;
+    window->src_passed = window->dst_passed = 0;
+
+    if (window->tcp != NULL) {
+        tcp_stream_reset(window->tcp);
     }
+}
 
-    // iterate pcap file
-    uint32_t prev_ip1 = 0, prev_ip2 = 0;
-    int ip_flag = 0;
-    while (pcap_next_ex(handler, &header, &packet) >= 0) {
-        // get ip
-        ip = (struct sniff_ip *)(packet + SIZE_ETHERNET);
-        ip_src = ip->ip_src.s_addr;
-        ip_dst = ip->ip_dst.s_addr;
-
-        if (ip_flag == 0) {
-            prev_ip1 = ip_src;
-            prev_ip2 = ip_dst;
-            ip_flag = 1;
-            continue;
-        } 
+void packet_window_release(struct packet_window *window) {
+    packet_window_reset(window);
+    payload_arena_release(&window->arena);
 
-        if ((ip_src != prev_ip1 && ip_src != prev_ip2) ||
-            (ip_dst != prev_ip1 && ip_dst != prev_ip2)) {
-            debug("there are more than two ip\n");
-            return -1;
-        }        
+    if (window->tcp != NULL) {
+        tcp_stream_release(window->tcp);
+        free(window->tcp);
+        window->tcp = NULL;
     }
 
-    pcap_close(handler);
-    return 0;
+    free(window->info_list);
+    window->info_list = NULL;
+    window->capacity = 0;
+}
+
+static int packet_direction(struct packet_window *window, struct decoded_packet *decoded) {
+    // both ends on the same host : only the ports tell the direction
+    if (ip_address_equal(&window->ip_src, &window->ip_dst)) {
+        return (decoded->port_src == window->port_src) ? SRC_TO_DST : DST_TO_SRC;
+    }
+    return ip_address_equal(&decoded->ip_src, &window->ip_src) ? SRC_TO_DST : DST_TO_SRC;
 }
 
-int check_application_count(char *filename) {
-    struct sniff_ethernet *ethernet;
-    struct sniff_ip *ip;
-    struct sniff_tcp *tcp;
-    struct sniff_udp *udp;
-    struct sniff_openvpn openvpn;
-    char *payload;
-
-    int ethernet_size;
-    uint64_t ip_size;
-    uint64_t tcp_size;
-    uint64_t udp_size;
-    uint64_t payload_size;
-
-    const unsigned char *packet;  
-    struct pcap_pkthdr *header;
-    pcap_t *handler;
-
-    char error_buf[PCAP_ERRBUF_SIZE];
-    int application_layer_count;
-
-    if (filename == NULL) {
-        debug("ERROR: no pcap input\n");
+// stores a packet, or the prefix of a reassembled tcp record (aligned set)
+static int packet_window_store(struct packet_window *window, struct parse_info *parse, struct decoded_packet *decoded, int aligned, int64_t timestamp, uint64_t packet_count) {
+    struct packet_info *info;
+    int nb_byte = parse->nb_bytes_needed;
+    int direction;
+    int passed;
+    uint64_t copy_size;
+
+    // a segment may hold several records
+    if (parse->window_size > 0 && window->nb_stored == parse->window_size) {
+        return WINDOW_COLLECTING;
+    }
+
+    direction = packet_direction(window, decoded);
+
+    if (window->nb_stored == window->capacity && grow_packet_info(&window->info_list, &window->capacity, window->initial_capacity, parse->window_size)) {
         return -1;
     }
 
-    //open file and create pcap handler
-    handler = pcap_open_offline(filename, error_buf);
+    info = &window->info_list[window->nb_stored];
 
-    if (handler == NULL) {
-        debug("failed to open pcap file\n");
-        debug("%s\n", error_buf);
+    info->payload = payload_arena_alloc(&window->arena);
+    if (info->payload == NULL) {
+        debug("failed to allocate payload (%d)\n", window->nb_stored);
         return -1;
     }
 
-    ethernet_size = 0;
-    if (pcap_datalink(handler) != DLT_EN10MB) {
-        ethernet_size = SIZE_ETHERNET;
-        debug("it is not an Ethernet capture\n");
+    info->timestamp = timestamp;
+    info->transport_protocol = decoded->protocol;
+    info->payload_length = decoded->payload_size;
+    info->packet_count = packet_count;
+    info->direction = direction;
+    info->filter_applied = PACKET_NOT_USED;
+    info->record_aligned = aligned;
+
+    // zero padded to the whole slot : the helpers below read up to byte 18, whatever was captured
+    copy_size = (decoded->captured_size < nb_byte) ? decoded->captured_size : nb_byte;
+    memcpy(info->payload, decoded->payload, copy_size);
+    memset(info->payload + copy_size, 0, window->arena.slot_size - copy_size);
+
+    info->openvpn.payload_length = decoded->payload_size - 2;
+    info->openvpn.openvpn_length = get_openvpn_length((char *)info->payload, decoded->protocol);
+    info->openvpn.opcode = get_openvpn_opcode((char *)info->payload, decoded->protocol);
+
+    info->wireguard.opcode = get_wireguard_opcode((char *)info->payload, decoded->protocol);
+    info->ikev2.opcode = get_ikev2_opcode((char *)info->payload, decoded->protocol);
+    info->ikev2.esp_marker = get_ikev2_marker((char *)info->payload, decoded->protocol);
+
+    window->nb_stored++;
+
+    if (!parse->stream) {
+        return WINDOW_COLLECTING;
     }
 
-    // iterate pcap file
-    application_layer_count = 0;
-    while (pcap_next_ex(handler, &header, &packet) >= 0) {
-        // get ethernet
-        ethernet = (struct sniff_ethernet *)(packet);
+    // classify_payload() only uses packets after INITIAL_PACKET_PASSED_SIZE in a single direction,
+    // tcp packets also have to pass the filters, decided here since the latency filter has an on arrival estimate
+    // record prefixes are aligned already
+    passed = (window->info_list[0].transport_protocol == IPPROTO_UDP);
+    if (window->info_list[0].transport_protocol == IPPROTO_TCP && aligned) {
+        info->packet_segmented = PACKET_USED;
+        info->filter_applied = PACKET_USED;
+        passed = 1;
+    } else if (window->info_list[0].transport_protocol == IPPROTO_TCP && parse->filter != NULL) {
+        passed = (filter_packet_on_arrival(&window->latency, parse->filter, info, nb_byte) == PACKET_USED);
+    }
 
-        // get ip
-        ip = (struct sniff_ip *)(packet + SIZE_ETHERNET - ethernet_size);
-        ip_size = IP_HL(ip)*4;
+    if (passed && window->nb_stored > INITIAL_PACKET_PASSED_SIZE) {
+        if (direction == SRC_TO_DST) {
+            window->src_passed++;
+        } else {
+            window->dst_passed++;
+        }
 
-        if (ip_size < 20 || (ip_size > (ntohs(ip->ip_len)) && (ntohs(ip->ip_len) != 0))) {
-            debug("invalid IP header length\n");
-            continue;
+        if (window->src_passed == parse->nb_packets_needed || window->dst_passed == parse->nb_packets_needed) {
+            debug("stream : enough packets after %d application packets\n", window->nb_stored);
+            return WINDOW_READY;
         }
+    }
 
-        // determine tcp or udp
-        uint64_t temp_size;
+    if (window->nb_stored == parse->window_size) {
+        debug("stream : window is full\n");
+        return WINDOW_READY;
+    }
 
-        switch (ip->ip_p) {
-        case IPPROTO_TCP:
-            tcp = (struct sniff_tcp *)(packet + SIZE_ETHERNET - ethernet_size + ip_size);
-            tcp_size = TH_OFF(tcp)*4;        
-            temp_size = tcp_size;
-            break;
-        case IPPROTO_UDP:
-            udp = (struct sniff_udp *)(packet + SIZE_ETHERNET - ethernet_size + ip_size);
-            udp_size = ntohs(udp->uh_ulen);
-            temp_size = 8;
-            break;
-        default:
-            // debug("unknown protocol\n");
-            continue;
+    return WINDOW_COLLECTING;
+}
+
+struct window_context {
+    struct packet_window *window;
+    struct parse_info *parse;
+};
+
+static int store_tcp_record(struct decoded_packet *record, int aligned, int64_t timestamp, uint64_t packet_count, void *arg) {
+    struct window_context *context = (struct window_context *)arg;
+
+    return packet_window_store(context->window, context->parse, record, aligned, timestamp, packet_count);
+}
+
+// adds an application packet to the window, tcp segments go through the reassembler when parse->reassemble is set
+// returns WINDOW_READY in stream mode when classify_payload() has enough packets, -1 on failure
+int packet_window_add(struct packet_window *window, struct parse_info *parse, struct decoded_packet *decoded, int64_t timestamp, uint64_t packet_count) {
+    int ret;
+
+    if (window->src_count == 0 && window->dst_count == 0) {
+        window->ip_src = decoded->ip_src;
+        window->ip_dst = decoded->ip_dst;
+        window->port_src = decoded->port_src;
+        window->port_dst = decoded->port_dst;
+
+        if (parse->stream && parse->filter != NULL) {
+            latency_stream_init(&window->latency, parse->filter->latency_percentage);
         }
+    }
 
-        // get payload size
-        payload_size = ntohs(ip->ip_len) - (ip_size + temp_size);
+    if (packet_direction(window, decoded) == SRC_TO_DST) {
+        window->src_count++;
+    } else {
+        window->dst_count++;
+    }
 
-        if (payload_size == 0) {
-            // debug("payload size none\n");
-            continue;
+    // the window is full, keep counting directions only
+    if (parse->window_size > 0 && window->nb_stored == parse->window_size) {
+        return WINDOW_COLLECTING;
+    }
+
+    if (decoded->protocol == IPPROTO_TCP && parse->reassemble) {
+        struct window_context context = { window, parse };
+
+        if (window->tcp == NULL) {
+            window->tcp = (struct tcp_stream *)malloc(sizeof(struct tcp_stream));
+            if (window->tcp == NULL || tcp_stream_init(window->tcp, parse->nb_bytes_needed)) {
+                debug("failed to allocate tcp stream\n");
+                free(window->tcp);
+                window->tcp = NULL;
+                return -1;
+            }
+        }
+
+        ret = tcp_stream_add(window->tcp, decoded, timestamp, packet_count, store_tcp_record, &context);
+        if (ret != TCP_STREAM_SEGMENT) {
+            return ret;
         }
-        
-        application_layer_count++;
     }
 
-    pcap_close(handler);
-    return application_layer_count;
+    return packet_window_store(window, parse, decoded, 0, timestamp, packet_count);
 }
 
-int parse_pcap_into_packet_info(char *filename, struct packet_info *info_list, int nb_packet, int nb_byte) {
-    struct sniff_ethernet *ethernet;
-    struct sniff_ip *ip;
-    struct sniff_tcp *tcp;
-    struct sniff_udp *udp;
-    char *payload;
-
-    int ethernet_size;
-    uint64_t ip_size;
-    uint64_t tcp_size;
-    uint64_t udp_size;
-    uint64_t payload_size;
-    uint64_t ip_src, ip_dst;
-    uint64_t src_count, dst_count;
-
-    const unsigned char *packet;  
-    struct pcap_pkthdr *header;
-    pcap_t *handler;
-
-    char error_buf[PCAP_ERRBUF_SIZE];
-    int application_layer_count;
-    int packet_count;
-
-    if (filename == NULL) {
-        debug("ERROR: no pcap input\n");
-        return -1;
+// sets the direction classify_payload() works on, in info_list[0]
+void packet_window_finish(struct packet_window *window, struct parse_info *parse) {
+    if (window->nb_stored == 0) {
+        return;
     }
 
-    //open file and create pcap handler
-    handler = pcap_open_offline(filename, error_buf);
-
-    if (handler == NULL) {
-        debug("failed to open pcap file\n");
-        debug("%s\n", error_buf);
-        return -1;
+    if (parse->stream && (window->src_passed == parse->nb_packets_needed || window->dst_passed == parse->nb_packets_needed)) {
+        window->info_list[0].total_direction = (window->src_passed == parse->nb_packets_needed) ? SRC_TO_DST : DST_TO_SRC;
+    } else if (window->src_count > window->dst_count) {
+        window->info_list[0].total_direction = SRC_TO_DST;
+    } else {
+        window->info_list[0].total_direction = DST_TO_SRC;
     }
+}
 
-    if (pcap_datalink(handler) == DLT_EN10MB) {
-        ethernet_size = SIZE_ETHERNET;
+// single pass over a single session capture : checks the ip pair, counts application packets and fills the window
+// the window stores up to parse->window_size packets, payload prefixes are carved from its arena
+// in stream mode, reading stops as soon as the window holds enough packets for classify_payload()
+// buffer is the content of filename when it was read beforehand (freed here), NULL to read the file
+int parse_pcap_into_packet_info(char *filename, uint8_t *buffer, size_t size, struct parse_info *parse, struct packet_window *window) {
+    struct decoded_packet decoded;
+
+    struct capture_reader reader;
+    struct capture_packet *packet;
+    struct fragment_table fragments;
+    const struct capture_filter *prefilter;
+
+    uint64_t packet_count;
+    int read_ret = 0;
+    int ret;
+
+    struct ip_address pair_ip1 = {{0}}, pair_ip2 = {{0}};
+    int pair_flag = 0;
+
+    // the window may hold a previous capture
+    packet_window_reset(window);
+
+    // the ip pair check looks at every ip packet, only an explicit host or port restriction drops some
+    prefilter = (parse->check_ip_pair && (parse->prefilter == NULL || !parse->prefilter->restricted)) ? NULL : parse->prefilter;
+
+    if (buffer != NULL) {
+        ret = capture_open_buffer(&reader, filename, buffer, size, parse->reader, prefilter);
     } else {
-        ethernet_size = 0;
-        debug("it is not an Ethernet capture\n");
+        ret = capture_open(&reader, filename, parse->reader, prefilter);
+    }
+    if (ret) {
+        return PARSE_FAILED;
     }
 
+    if (parse->check_ip_pair && !link_supported(reader.linktype)) {
+        debug("unsupported link type %d\n", reader.linktype);
+        capture_close(&reader);
+        return PARSE_FAILED;
+    }
+
+    ret = PARSE_OK;
+    fragment_table_init(&fragments, parse->nb_bytes_needed);
+
     // iterate pcap file
-    application_layer_count = 0;
-    src_count = dst_count = 0;
     packet_count = 0;
-    while (pcap_next_ex(handler, &header, &packet) >= 0) {
+    while ((read_ret = capture_next(&reader, &packet)) > 0) {
+        int decode_ret;
 
         packet_count++;
 
-        if (application_layer_count == nb_packet) {
-            break;
+        decode_ret = packet->decode(packet->data, packet->caplen, parse->tunnel_depth, &decoded);
+        if (decode_ret == DECODE_FRAGMENT) {
+            decode_ret = fragment_table_add(&fragments, &decoded, packet->timestamp, parse->tunnel_depth);
         }
-
-        // get ethernet
-        ethernet = (struct sniff_ethernet *)(packet);
-
-        if (header->caplen < ethernet_size + sizeof(struct sniff_ip)) {
-            debug("packet is too short for IP header\n");
+        if (decode_ret == DECODE_NO_IP) {
             continue;
         }
 
-        // get ip
-        ip = (struct sniff_ip *)(packet + ethernet_size);
-        ip_size = IP_HL(ip)*4;
+        if (parse->check_ip_pair) {
+            if (pair_flag == 0) {
+                pair_ip1 = decoded.ip_src;
+                pair_ip2 = decoded.ip_dst;
+                pair_flag = 1;
+            } else if ((!ip_address_equal(&decoded.ip_src, &pair_ip1) && !ip_address_equal(&decoded.ip_src, &pair_ip2)) ||
+                       (!ip_address_equal(&decoded.ip_dst, &pair_ip1) && !ip_address_equal(&decoded.ip_dst, &pair_ip2))) {
+                debug("there are more than two ip\n");
+                ret = PARSE_NOT_IP_PAIR;
+                break;
+            }
+        }
 
-        if (ip_size < 20 || (ip_size > (ntohs(ip->ip_len)) && (ntohs(ip->ip_len) != 0))) {
-            debug("invalid IP header length\n");
+        if (decode_ret != DECODE_APPLICATION) {
             continue;
         }
 
-        // determine tcp or udp
-        uint64_t temp_size;
-
-        switch (ip->ip_p) {
-        case IPPROTO_TCP:
-            tcp = (struct sniff_tcp *)(packet + ethernet_size + ip_size);
-            tcp_size = TH_OFF(tcp)*4;        
-            temp_size = tcp_size;
+        decode_ret = packet_window_add(window, parse, &decoded, packet->timestamp, packet_count);
+        if (decode_ret < 0) {
+            ret = PARSE_FAILED;
             break;
-        case IPPROTO_UDP:
-            udp = (struct sniff_udp *)(packet + ethernet_size + ip_size);
-            udp_size = ntohs(udp->uh_ulen);
-            temp_size = 8;
+        }
+        if (decode_ret == WINDOW_READY) {
             break;
-        default:
-            // debug("unknown protocol\n");
-            continue;
         }
+    }
 
-        if (application_layer_count == 0) {
-            ip_src = ip->ip_src.s_addr;
-            ip_dst = ip->ip_dst.s_addr;
-        }
+    if (read_ret < 0) {
+        error("truncated or corrupt capture, read stopped after %lu packets : %s\n", packet_count, filename);
+    }
 
-        // get payload
-        payload = (char *)(packet + ethernet_size + ip_size + temp_size);
-        payload_size = ntohs(ip->ip_len) - (ip_size + temp_size);
+    capture_close(&reader);
+    fragment_table_release(&fragments);
 
-        if (payload_size == 0) {
-            continue;
-        }
+    if (ret != PARSE_OK) {
+        packet_window_reset(window);
+        return ret;
+    }
 
-        info_list[application_layer_count].openvpn.payload_length = payload_size - 2;
-        info_list[application_layer_count].openvpn.openvpn_length = get_openvpn_length(payload, ip->ip_p);
-        info_list[application_layer_count].openvpn.opcode = get_openvpn_opcode(payload, ip->ip_p);
+    // if (src_count < PACKET_WINDOW_SIZE && dst_count < PACKET_WINDOW_SIZE) {
+    //     debug("The number of packets in single direction should be more than %d (src : %ld, dst : %ld)\n", PACKET_WINDOW_SIZE, src_count, dst_count);
+    //     return -1;
+    // }
 
-        info_list[application_layer_count].wireguard.opcode = get_wireguard_opcode(payload, ip->ip_p);
-        info_list[application_layer_count].ikev2.opcode = get_ikev2_opcode(payload, ip->ip_p);
-        info_list[application_layer_count].ikev2.esp_marker = get_ikev2_marker(payload, ip->ip_p);
-        
-        info_list[application_layer_count].timestamp = header->ts;
-        info_list[application_layer_count].transport_protocol = ip->ip_p;
-        info_list[application_layer_count].payload_length = payload_size;
+    packet_window_finish(window, parse);
 
-        info_list[application_layer_count].packet_count = packet_count;
+    return PARSE_OK;
+}
 
-        if (ip_src == ip->ip_src.s_addr) {
-            info_list[application_layer_count].direction = SRC_TO_DST;
-            src_count++;
-        } else {
-            info_list[application_layer_count].direction = DST_TO_SRC;
-            dst_count++;
+// single pass over a multi session capture : every flow gets its own window,
+// handler is called once per flow, as soon as it is ready in stream mode, when it expires or is evicted,
+// or at the end of the capture
+int parse_pcap_into_flows(char *filename, struct parse_info *parse, flow_handler handler_func, void *arg, struct flow_stats *stats) {
+    struct flow_table table;
+    struct decoded_packet decoded;
+
+    struct capture_reader reader;
+    struct capture_packet *packet;
+    struct fragment_table fragments;
+
+    uint64_t packet_count;
+    int read_ret = 0;
+    int ret;
+
+    if (capture_open(&reader, filename, parse->reader, parse->prefilter)) {
+        return PARSE_FAILED;
+    }
+
+    if (flow_table_init(&table, parse, handler_func, arg)) {
+        capture_close(&reader);
+        return PARSE_FAILED;
+    }
+
+    ret = PARSE_OK;
+    fragment_table_init(&fragments, parse->nb_bytes_needed);
+
+    // iterate pcap file
+    packet_count = 0;
+    while ((read_ret = capture_next(&reader, &packet)) > 0) {
+        int decode_ret;
+
+        packet_count++;
+
+        decode_ret = packet->decode(packet->data, packet->caplen, parse->tunnel_depth, &decoded);
+        if (decode_ret == DECODE_FRAGMENT) {
+            decode_ret = fragment_table_add(&fragments, &decoded, packet->timestamp, parse->tunnel_depth);
+        }
+        if (decode_ret != DECODE_APPLICATION) {
+            continue;
         }
 
-        for (int i = 0; i < nb_byte; i++) {
-            if (i >= payload_size) {
-                info_list[application_layer_count].payload[i] = 0;
-                continue;
-            }
-            info_list[application_layer_count].payload[i] = *((uint8_t *)(payload+i));
-            // debug("%x ", *((uint8_t *)(payload+i)));
+        flow_table_expire(&table, packet->timestamp / NSEC_PER_SEC);
+
+        if (flow_table_add_packet(&table, &decoded, packet->timestamp, packet_count)) {
+            ret = PARSE_FAILED;
+            break;
         }
-        // debug("\n");
-        
-        application_layer_count++;
     }
 
-    // if (src_count < PACKET_WINDOW_SIZE && dst_count < PACKET_WINDOW_SIZE) {
-    //     debug("The number of packets in single direction should be more than %d (src : %ld, dst : %ld)\n", PACKET_WINDOW_SIZE, src_count, dst_count);
-    //     return -1;
-    // }
+    if (read_ret < 0) {
+        error("truncated or corrupt capture, read stopped after %lu packets : %s\n", packet_count, filename);
+    }
 
-    if (src_count > dst_count) {
-        info_list[0].total_direction = SRC_TO_DST;
-    } else {
-        info_list[0].total_direction = DST_TO_SRC;
+    capture_close(&reader);
+    fragment_table_release(&fragments);
+
+    if (ret == PARSE_OK) {
+        flow_table_finish_all(&table);
     }
 
-    pcap_close(handler);
-    return 0;
-}
\ No newline at end of file
+    if (stats != NULL) {
+        *stats = table.stats;
+    }
+
+    flow_table_release(&table);
+
+    return ret;
+}
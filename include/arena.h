@@ -0,0 +1,34 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "core.h"
+#include "debug.h"
+
+#define CACHE_LINE_SIZE         64
+
+/* number of payload slots allocated at once */
+#define ARENA_CHUNK_SLOTS       1024
+
+/* chunk of contiguous payload slots, slots start on the cache line following the header */
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t nb_slot;
+};
+
+/* payload prefix arena : fixed-size cache line aligned slots, carved from chained chunks */
+struct payload_arena {
+    struct arena_chunk *head;
+    struct arena_chunk *current;
+
+    size_t slot_size;
+    size_t nb_used;             /* slots used in current chunk */
+    size_t chunk_slots;
+    size_t nb_bytes;            /* allocated by all chunks */
+};
+
+int payload_arena_init(struct payload_arena *arena, int nb_bytes, int chunk_slots);
+uint8_t *payload_arena_alloc(struct payload_arena *arena);
+void payload_arena_reset(struct payload_arena *arena);
+void payload_arena_release(struct payload_arena *arena);
+
+#endif // ARENA_H
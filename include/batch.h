@@ -0,0 +1,45 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <pthread.h>
+
+#include "core.h"
+#include "debug.h"
+#include "arena.h"
+
+#define BATCH_INITIAL_FILES     256
+
+#define BATCH_TAGGED            0       /* results written as they complete */
+#define BATCH_ORDERED           1       /* results written in corpus order */
+
+/* contiguous range of tasks : the owner takes from begin, thieves take the upper half */
+struct batch_deque {
+    pthread_mutex_t lock;
+    size_t begin;
+    size_t end;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* returns 0 on success, worker is the index of the calling worker, in [0, nb_worker) */
+typedef int (*batch_task)(size_t index, int worker, void *arg);
+/* announces a task the calling worker is about to run, to start its i/o early */
+typedef void (*batch_lookahead)(size_t index, int worker, void *arg);
+
+struct batch_output {
+    pthread_mutex_t lock;
+    int mode;
+    char **line_list;           /* completed lines waiting for the previous ones, ordered mode */
+    size_t nb_line;
+    size_t next;
+};
+
+int corpus_list_files(const char *source, char ***file_list, size_t *nb_file);
+void corpus_release(char **file_list, size_t nb_file);
+
+int batch_nb_worker(size_t nb_task);
+int batch_run(size_t nb_task, int nb_worker, batch_task task_func, batch_lookahead lookahead_func, int lookahead, void *arg);
+
+int batch_output_init(struct batch_output *output, int mode, size_t nb_line);
+void batch_output_put(struct batch_output *output, size_t index, char *line);
+void batch_output_release(struct batch_output *output);
+
+#endif // BATCH_H
@@ -0,0 +1,118 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "core.h"
+#include "debug.h"
+#include "decoder.h"
+
+#define CAPTURE_READER_MMAP         0       /* native reader on a memory mapped file, libpcap as fallback */
+#define CAPTURE_READER_PCAP         1       /* libpcap only */
+
+#define CAPTURE_FORMAT_PCAP         0
+#define CAPTURE_FORMAT_PCAPNG       1
+#define CAPTURE_FORMAT_LIBPCAP      2
+
+/* classic pcap magics, as read in host order */
+#define PCAP_MAGIC_USEC             0xa1b2c3d4
+#define PCAP_MAGIC_NSEC             0xa1b23c4d
+#define PCAP_MAGIC_USEC_SWAPPED     0xd4c3b2a1
+#define PCAP_MAGIC_NSEC_SWAPPED     0x4d3cb2a1
+
+#define PCAP_FILE_HEADER_SIZE       24
+#define PCAP_RECORD_HEADER_SIZE     16
+
+/* pcapng blocks */
+#define PCAPNG_SHB                  0x0a0d0d0a
+#define PCAPNG_IDB                  0x00000001
+#define PCAPNG_PB                   0x00000002      /* obsolete packet block */
+#define PCAPNG_SPB                  0x00000003
+#define PCAPNG_EPB                  0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC     0x1a2b3c4d
+
+#define PCAPNG_OPT_END              0
+#define PCAPNG_OPT_IF_TSRESOL       9
+#define PCAPNG_OPT_IF_TSOFFSET      14
+
+/* caplen above this is a corrupt record */
+#define CAPTURE_MAX_CAPLEN          (256 * 1024 * 1024)
+
+#define CAPTURE_FILTER_SNAPLEN      262144
+#define CAPTURE_FILTER_SIZE         2048
+
+/* what the link decoders keep : tcp or udp over ipv4 or ipv6, with a payload
+ * ipv4 fragments (tcp and udp only match first fragments) and ipv6 packets with extension headers are left to the decoder
+ * a zero length (ipv4 total length wraps in the subtraction, ipv6 payload length is tested) is a jumbogram or an offloaded
+ * segment : the decoder takes the captured length instead */
+#define CAPTURE_FILTER_BASE \
+    "(ip and tcp and ip[2:2] - ((ip[0] & 0xf) << 2) - ((tcp[12] & 0xf0) >> 2) != 0)" \
+    " or (ip and udp and udp[4:2] > 8)" \
+    " or (ip and (ip[6:2] & 0x3fff) != 0)" \
+    " or (ip6 and ip6[6] == 6 and (ip6[4:2] == 0 or ip6[4:2] > ((ip6[52] & 0xf0) >> 2)))" \
+    " or (ip6 and ip6[6] == 17 and (ip6[4:2] == 0 or ip6[4:2] > 8))" \
+    " or (ip6 and ip6[6] != 6 and ip6[6] != 17 and ip6[6] != 58 and ip6[6] != 59)"
+
+/* ipv4 tunnels left to the decoder when decapsulation is on (ipv6 ones already are, vxlan and gtp-u are udp) */
+#define CAPTURE_FILTER_TUNNEL \
+    " or (ip and (ip[9] == 4 or ip[9] == 41 or ip[9] == 47))"
+
+/* ethernet : the expression again behind one and two vlan tags, "vlan" moves the offsets of what follows */
+#define CAPTURE_FILTER_VLAN_FORMAT  "%s or (vlan and (%s or (vlan and %s)))"
+
+struct capture_interface {
+    int linktype;
+    packet_decoder decode;
+    uint64_t ts_units;              /* timestamp units per second */
+    int64_t ts_offset;              /* seconds */
+};
+
+/* current packet, data points into the mapping (or the libpcap buffer) */
+struct capture_packet {
+    int64_t timestamp;              /* nanoseconds */
+    uint32_t caplen;
+    uint32_t len;
+    int linktype;
+    packet_decoder decode;          /* of linktype */
+    const unsigned char *data;
+};
+
+/* compiled once, before any reader is opened : pcap_compile() is not thread safe */
+struct capture_filter {
+    char expression[CAPTURE_FILTER_SIZE];
+    int restricted;                 /* hosts or ports were given, the native reader runs the filter too */
+    int has_ethernet;
+    int has_raw;
+    struct bpf_program ethernet;    /* LINKTYPE_ETHERNET, vlan tagged packets included */
+    struct bpf_program raw;         /* LINKTYPE_RAW, cooked live sockets */
+};
+
+struct capture_reader {
+    int format;
+    int linktype;                   /* of the first interface */
+    packet_decoder decode;
+
+    const uint8_t *base;            /* mapping, or buffer */
+    size_t size;
+    uint8_t *buffer;                /* content read beforehand, owned by the reader */
+    size_t offset;
+    int swapped;
+    int nano;
+
+    struct capture_interface *if_list;
+    int nb_if;
+    int if_capacity;
+
+    pcap_t *pcap;
+    const struct capture_filter *filter;    /* run by the native reader, NULL when the link decoder is enough */
+    struct capture_packet packet;
+};
+
+int capture_filter_init(struct capture_filter *filter, const char *host_list, const char *port_list, int tunnel);
+const struct bpf_program *capture_filter_program(const struct capture_filter *filter, int linktype);
+void capture_filter_release(struct capture_filter *filter);
+
+int capture_open(struct capture_reader *reader, char *filename, int reader_type, const struct capture_filter *filter);
+int capture_open_buffer(struct capture_reader *reader, char *filename, uint8_t *buffer, size_t size, int reader_type, const struct capture_filter *filter);
+int capture_next(struct capture_reader *reader, struct capture_packet **packet);
+void capture_close(struct capture_reader *reader);
+
+#endif // CAPTURE_H
@@ -4,6 +4,7 @@
 #include <pcap.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -19,4 +20,8 @@
 #include <stdarg.h>
 #include <time.h>
 
+/* packet timestamps are int64_t nanoseconds since the epoch */
+#define NSEC_PER_SEC    1000000000LL
+#define NSEC_PER_USEC   1000LL
+
 #endif // CORE_H
\ No newline at end of file
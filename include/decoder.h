@@ -0,0 +1,26 @@
+#ifndef DECODER_H
+#define DECODER_H
+
+#include "core.h"
+#include "debug.h"
+#include "trace_parser.h"
+
+/* link types of pcap files and pcapng interfaces, libpcap returns the matching DLT_ value */
+#define LINKTYPE_ETHERNET           1
+#define LINKTYPE_RAW                101     /* starts with the ip header */
+#define LINKTYPE_LINUX_SLL          113     /* linux cooked capture, "any" interface */
+#define LINKTYPE_IPV4               228
+#define LINKTYPE_IPV6               229
+#define LINKTYPE_LINUX_SLL2         276
+
+/* DLT_RAW of libpcap, 12 on most systems and 14 on some BSDs */
+#define DLT_RAW_LINUX               12
+#define DLT_RAW_BSD                 14
+
+/* decoder of a link type, picked once per capture (or pcapng interface) instead of per packet
+ * never NULL : the decoder of an unsupported link type returns DECODE_NO_IP */
+packet_decoder link_decoder(int linktype);
+int link_supported(int linktype);
+int decode_datagram(uint8_t protocol, const unsigned char *data, uint64_t captured_size, uint64_t length, int tunnel_depth, struct decoded_packet *decoded);
+
+#endif // DECODER_H
@@ -0,0 +1,115 @@
+#ifndef FLOW_H
+#define FLOW_H
+
+#include "core.h"
+#include "debug.h"
+#include "trace_parser.h"
+#include "timer_wheel.h"
+
+/* payload slots allocated at once and first packet info list of a flow, kept small since most flows are short
+ * (the list is doubled up to the window size) */
+#define FLOW_ARENA_CHUNK_SLOTS      16
+#define FLOW_PACKET_CAPACITY        16
+
+/* swiss table : groups of FLOW_GROUP_SIZE slots, probed 16 control bytes at a time */
+#define FLOW_GROUP_SIZE             16
+#define FLOW_TABLE_INITIAL_GROUPS   64
+#define FLOW_MAX_LOAD_NUM           7       /* grow above 7/8 of the slots */
+#define FLOW_MAX_LOAD_DEN           8
+#define FLOW_MIGRATE_GROUPS         4       /* groups moved to the new index per lookup while growing */
+
+/* control bytes : 7-bit hash tag for a used slot, or one of these (high bit set) */
+#define FLOW_CTRL_EMPTY             0x80
+#define FLOW_CTRL_DELETED           0xfe
+
+/* "[ipv6]:65535 [ipv6]:65535 UDP", ipv4 without brackets */
+#define FLOW_STRING_SIZE            128
+
+#define FLOW_ACTIVE                 0
+#define FLOW_DONE                   1
+
+/* canonical flow key : the lower (ip, port) end comes first, so both directions map to one key */
+struct flow_key {
+    struct ip_address ip[2];
+    uint16_t port[2];
+    uint8_t protocol;
+    uint8_t pad[3];
+};
+
+struct flow {
+    struct flow_key key;
+    struct packet_window window;
+    int state;
+
+    uint64_t last_seen;             /* capture time in seconds */
+    size_t state_size;              /* bytes held by the flow and its window */
+    struct timer_node timer;        /* idle expiry, rearmed lazily from last_seen */
+
+    struct flow *order_next;        /* creation order */
+    struct flow *order_prev;
+    struct flow *lru_next;          /* least recently seen first */
+    struct flow *lru_prev;
+};
+
+struct flow_slot {
+    struct flow_key key;            /* inline, compared before following the pointer */
+    struct flow *flow;
+};
+
+/* control bytes first, then the slots, on cache line boundaries */
+struct flow_group {
+    uint8_t ctrl[FLOW_GROUP_SIZE];
+    struct flow_slot slot[FLOW_GROUP_SIZE];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct flow_index {
+    struct flow_group *groups;
+    size_t nb_group;                /* power of 2 */
+    size_t nb_full;
+    size_t nb_used;                 /* full and deleted slots */
+};
+
+typedef void (*flow_handler)(struct flow *flow, void *arg);
+
+/* flows removed before the end of the capture */
+struct flow_stats {
+    uint64_t nb_flow;
+    uint64_t nb_expired;
+    uint64_t nb_evicted;
+};
+
+struct flow_table {
+    struct flow_index current;
+    struct flow_index old;          /* being moved into current, a few groups per lookup */
+    size_t nb_migrated;
+
+    size_t nb_flow;
+    struct flow *first;
+    struct flow *last;
+    struct flow *lru_first;
+    struct flow *lru_last;
+
+    struct timer_wheel wheel;
+    int wheel_started;
+    size_t state_size;
+    struct flow_stats stats;
+
+    struct parse_info *parse;
+    flow_handler handler_func;      /* called for unfinished flows before they are expired or evicted */
+    void *arg;
+};
+
+int flow_table_init(struct flow_table *table, struct parse_info *parse, flow_handler handler_func, void *arg);
+struct flow *flow_table_get(struct flow_table *table, struct decoded_packet *decoded);
+void flow_table_expire(struct flow_table *table, uint64_t now);
+void flow_table_touch(struct flow_table *table, struct flow *flow, uint64_t now);
+int flow_table_add_packet(struct flow_table *table, struct decoded_packet *decoded, int64_t timestamp, uint64_t packet_count);
+void flow_table_finish_all(struct flow_table *table);
+void flow_table_release(struct flow_table *table);
+void flow_finish(struct flow_table *table, struct flow *flow);
+uint64_t flow_hash(struct decoded_packet *decoded, int flow_mode);
+int flow_to_string(struct flow *flow, int flow_mode, char *buffer, size_t size);
+
+int parse_pcap_into_flows(char *filename, struct parse_info *parse, flow_handler handler_func, void *arg, struct flow_stats *stats);
+
+#endif // FLOW_H
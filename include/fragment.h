@@ -0,0 +1,47 @@
+#ifndef FRAGMENT_H
+#define FRAGMENT_H
+
+#include "core.h"
+#include "debug.h"
+#include "trace_parser.h"
+
+#define FRAGMENT_TABLE_SIZE         1024    /* datagrams reassembled at once, power of 2 */
+#define FRAGMENT_PROBE              8       /* slots looked at per datagram, the oldest is taken over when all are used */
+#define FRAGMENT_TIMEOUT            (30 * NSEC_PER_SEC)
+#define FRAGMENT_MAX_RANGES         8       /* disjoint parts of a datagram, it is dropped beyond */
+#define FRAGMENT_HEADER_ROOM        128     /* transport (and tunnel) headers kept ahead of the payload prefix */
+#define FRAGMENT_MAX_DATAGRAM       65535
+
+/* received parts of a datagram, merged and sorted */
+struct fragment_ranges {
+    uint32_t start[FRAGMENT_MAX_RANGES];
+    uint32_t end[FRAGMENT_MAX_RANGES];
+    int nb_range;
+};
+
+/* a datagram being reassembled : only its first bytes are kept, the rest is counted */
+struct fragment_entry {
+    struct ip_address ip_src;
+    struct ip_address ip_dst;
+    uint32_t id;
+    uint8_t protocol;
+    uint8_t used;
+
+    int64_t first_seen;             /* nanoseconds */
+    uint32_t total;                 /* datagram size after the ip header, 0 until the last fragment */
+    struct fragment_ranges received;
+    struct fragment_ranges copied;  /* bytes of prefix actually captured */
+    uint8_t *prefix;
+};
+
+struct fragment_table {
+    struct fragment_entry *entry_list;      /* allocated with the first fragment */
+    uint8_t *buffer;                        /* prefixes of the entries */
+    size_t prefix_size;
+};
+
+void fragment_table_init(struct fragment_table *table, int nb_bytes);
+int fragment_table_add(struct fragment_table *table, struct decoded_packet *decoded, int64_t timestamp, int tunnel_depth);
+void fragment_table_release(struct fragment_table *table);
+
+#endif // FRAGMENT_H
@@ -0,0 +1,69 @@
+#ifndef LIVE_H
+#define LIVE_H
+
+#include <pthread.h>
+#include <linux/if_packet.h>
+
+#include "core.h"
+#include "debug.h"
+#include "trace_parser.h"
+#include "capture.h"
+#include "flow.h"
+
+#define LIVE_BLOCK_SIZE         (1 << 20)   /* bytes, a multiple of the page size */
+#define LIVE_BLOCK_COUNT        64
+#define LIVE_FRAME_SIZE         2048
+#define LIVE_BLOCK_TIMEOUT      50          /* ms, a partly filled block is handed over after this long */
+#define LIVE_POLL_TIMEOUT       200         /* ms, how often live_stop() and idle flows are checked while the interface is quiet */
+#define LIVE_NO_FANOUT          -1
+
+/* live_next() without a packet : -1 on failure, 0 once live_stop() was called */
+#define LIVE_PACKET             1
+#define LIVE_IDLE               2           /* nothing arrived within LIVE_POLL_TIMEOUT */
+
+struct live_stats {
+    uint64_t nb_packet;         /* handed to the decoder */
+    uint64_t nb_byte;
+    uint64_t nb_drop;           /* PACKET_STATISTICS : dropped by the kernel, the ring was full */
+    uint64_t nb_freeze;         /* PACKET_STATISTICS : times the ring was frozen */
+    double elapsed;             /* seconds from the start to the end of the capture */
+};
+
+/* TPACKET_V3 receive ring : the kernel fills whole blocks, which are walked without a system call per packet */
+struct live_ring {
+    int fd;
+    int linktype;
+    int skip_outgoing;          /* loopback : every packet is seen leaving and entering */
+
+    uint8_t *map;
+    size_t map_size;
+    unsigned block_size;
+    unsigned nb_block;
+
+    unsigned block;             /* next block to walk */
+    struct tpacket_block_desc *desc;    /* block being walked, NULL when none */
+    uint32_t nb_left;
+    uint8_t *next;
+
+    struct capture_packet packet;
+    struct live_stats stats;
+};
+
+/* one fanout socket, its flows and its counters, nothing is shared with the other workers */
+struct live_worker {
+    struct live_ring ring;
+    struct flow_table table;
+    pthread_t thread;
+    int ret;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+int live_open(struct live_ring *ring, const char *interface, int fanout_group, const struct capture_filter *filter);
+int live_next(struct live_ring *ring, struct capture_packet **packet);
+void live_update_stats(struct live_ring *ring);
+void live_close(struct live_ring *ring);
+void live_stop(void);
+
+int parse_live_into_flows(const char *interface, struct parse_info *parse, flow_handler handler_func, void *arg, struct flow_stats *stats, struct live_stats *live_stats);
+int parse_live_into_flows_parallel(const char *interface, struct parse_info *parse, int nb_worker, flow_handler handler_func, void **arg_list, struct flow_stats *stats, struct live_stats *live_stats_list);
+
+#endif // LIVE_H
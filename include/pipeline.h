@@ -0,0 +1,68 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <pthread.h>
+
+#include "core.h"
+#include "debug.h"
+#include "trace_parser.h"
+#include "flow.h"
+
+/* descriptors per reader -> worker ring, power of 2 */
+#define PIPELINE_RING_SIZE      4096
+/* slots published (or released) at once */
+#define PIPELINE_BATCH          32
+/* slots of the largest descriptor, a longer payload is cut as if it had not been captured */
+#define PIPELINE_MAX_SLOTS      (PIPELINE_RING_SIZE / 4)
+
+#define DESC_PACKET             0
+#define DESC_TICK               1       /* capture time moved to the next second */
+#define DESC_END                2
+#define DESC_PAD                3       /* end of the ring skipped, the next descriptor starts at the first slot */
+
+/* compact packet descriptor : decoded headers and the payload prefix, the packet itself is not kept
+ * with tcp reassembly, a tcp descriptor holds the whole captured payload in consecutive slots :
+ * records may start anywhere in a segment */
+struct packet_desc {
+    int64_t timestamp;
+    uint64_t packet_count;
+    uint64_t payload_size;
+    struct ip_address ip_src;
+    struct ip_address ip_dst;
+    uint32_t seq;
+    uint16_t port_src;
+    uint16_t port_dst;
+    uint32_t captured_size;     /* bytes of prefix[] taken from the packet */
+    uint32_t nb_slot;
+    uint8_t protocol;
+    uint8_t type;
+    uint8_t prefix[];
+};
+
+/* lock-free single producer single consumer ring of fixed-size descriptor slots
+ * each side keeps a copy of the other index and reads the shared one only when it runs out */
+struct spsc_ring {
+    uint64_t head __attribute__((aligned(CACHE_LINE_SIZE)));    /* written by the producer */
+    uint64_t head_local;
+    uint64_t tail_cached;
+
+    uint64_t tail __attribute__((aligned(CACHE_LINE_SIZE)));    /* written by the consumer */
+    uint64_t tail_local;
+    uint64_t head_cached;
+
+    uint8_t *slot_list __attribute__((aligned(CACHE_LINE_SIZE)));
+    size_t slot_size;
+    size_t mask;
+};
+
+struct pipeline_worker {
+    struct spsc_ring ring;
+    struct flow_table table;
+    struct flow_stats stats;
+    pthread_t thread;
+    int ret;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+int parse_pcap_into_flows_parallel(char *filename, struct parse_info *parse, int nb_worker, flow_handler handler_func, void **arg_list, struct flow_stats *stats);
+
+#endif // PIPELINE_H
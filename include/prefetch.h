@@ -0,0 +1,67 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <linux/io_uring.h>
+
+#include "core.h"
+#include "debug.h"
+
+#define PREFETCH_DEFAULT_DEPTH      4                       /* captures read ahead of the one being fingerprinted */
+#define PREFETCH_MAX_FILE_SIZE      (64 * 1024 * 1024)      /* larger captures are mapped by the reader instead */
+#define PREFETCH_RETRY_NSEC         1000000                 /* pause before waiting again when io_uring_enter fails */
+
+#define PREFETCH_READING            0
+#define PREFETCH_DONE               1
+#define PREFETCH_FAILED             2       /* read again with pread() when taken */
+
+/* one capture read ahead, the whole file goes into buffer */
+struct prefetch_file {
+    size_t index;
+    int fd;
+    int state;
+    uint8_t *buffer;
+    size_t size;
+    size_t done;
+};
+
+/* submission and completion rings shared with the kernel */
+struct prefetch_ring {
+    int fd;
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    struct io_uring_sqe *sqe_list;
+    size_t sqe_map_size;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqe_list;
+};
+
+/*
+ * read ahead of one worker, files are added and taken in the same order
+ * without io_uring, reads are hinted to the kernel with posix_fadvise() and done with pread() when taken
+ */
+struct prefetch {
+    int use_ring;
+    struct prefetch_ring ring;
+    int nb_inflight;                /* submitted reads not completed yet */
+
+    struct prefetch_file *file_list;
+    int capacity;
+    int first;
+    int nb_file;
+};
+
+int prefetch_init(struct prefetch *prefetch, int depth);
+void prefetch_add(struct prefetch *prefetch, size_t index, const char *path);
+int prefetch_take(struct prefetch *prefetch, size_t index, uint8_t **buffer, size_t *size);
+void prefetch_release(struct prefetch *prefetch);
+
+#endif // PREFETCH_H
@@ -0,0 +1,29 @@
+#ifndef QUANTILE_H
+#define QUANTILE_H
+
+#include "core.h"
+#include "debug.h"
+
+#define QUANTILE_MARKERS        5
+
+/*
+ * P-square estimator (Jain and Chlamtac) : one quantile of a stream in fixed memory
+ * five markers follow the minimum, p/2, p, (1+p)/2 and the maximum, their heights are
+ * adjusted by a parabolic interpolation as observations arrive
+ * the first QUANTILE_MARKERS observations are kept as they are and the quantile is exact
+ */
+struct quantile {
+    double p;                               /* 0.0 to 1.0 */
+    uint64_t count;
+
+    double height[QUANTILE_MARKERS];
+    double position[QUANTILE_MARKERS];      /* actual marker positions, 1-based */
+    double desired[QUANTILE_MARKERS];       /* desired marker positions */
+    double increment[QUANTILE_MARKERS];     /* of the desired positions per observation */
+};
+
+void quantile_init(struct quantile *quantile, double p);
+void quantile_add(struct quantile *quantile, double value);
+double quantile_value(const struct quantile *quantile);
+
+#endif // QUANTILE_H
@@ -0,0 +1,63 @@
+#ifndef SIGNATURE_DB_H
+#define SIGNATURE_DB_H
+
+#include "core.h"
+#include "debug.h"
+#include "vpn_fingerprint.h"
+
+/* a signature is one 4-bit code per field : an enum field_type, or SIGNATURE_WILDCARD ('*' in the database)
+ * signatures are stored by blocks of SIGNATURE_BLOCK, field after field : the SIGNATURE_BLOCK_BYTES bytes of a field
+ * hold signature i of the block in the low nibble of byte i, and signature i + SIGNATURE_BLOCK_BYTES in its high nibble */
+#define SIGNATURE_BLOCK             64
+#define SIGNATURE_BLOCK_BYTES       (SIGNATURE_BLOCK / 2)
+#define SIGNATURE_WILDCARD          0xF
+#define SIGNATURE_FIELD_MAX         64      /* fields of a signature, a distance stays below 256 */
+#define SIGNATURE_LABEL_SIZE        64
+
+/* weight of a field whose types differ, halved for U against a type and for S against Z */
+#define SIGNATURE_WEIGHT_MISMATCH   2
+#define SIGNATURE_WEIGHT_NEAR       1
+
+#define SIGNATURE_TOP_MAX           8
+#define SIGNATURE_TOP_DEFAULT       3
+#define SIGNATURE_CACHE_SIZE        256     /* specifications whose matches are kept, power of 2 */
+
+/* "<label> (<distance>), " per match */
+#define SIGNATURE_MATCH_STRING_SIZE (SIGNATURE_TOP_MAX * (SIGNATURE_LABEL_SIZE + 16))
+
+struct signature_db {
+    int nb_signature;               /* distinct (label, signature) pairs */
+    int nb_field;                   /* fields of the longest signature, shorter ones end with wildcards */
+    int nb_block;
+    uint8_t *block_list;            /* nb_block blocks of nb_field * SIGNATURE_BLOCK_BYTES bytes */
+    int *label_index;               /* label of each signature */
+    char (*label_list)[SIGNATURE_LABEL_SIZE];
+    int nb_label;
+};
+
+/* nearest labels first, ties in the order of the database */
+struct signature_match {
+    int label;
+    int distance;
+};
+
+struct signature_cache_entry {
+    uint8_t query[SIGNATURE_FIELD_MAX / 2];
+    int top_k;                      /* 0 : empty */
+    int nb_match;
+    struct signature_match match_list[SIGNATURE_TOP_MAX];
+};
+
+/* matches of the last specifications, one per thread : flows of a protocol mostly share their specification */
+struct signature_cache {
+    struct signature_cache_entry *entry_list;
+};
+
+int signature_db_load(struct signature_db *db, const char *path);
+void signature_db_release(struct signature_db *db);
+int signature_cache_init(struct signature_cache *cache);
+void signature_cache_release(struct signature_cache *cache);
+int signature_db_match(const struct signature_db *db, const int *field_type, int nb_field, int top_k, struct signature_cache *cache, struct signature_match *match_list);
+int signature_match_to_string(const struct signature_db *db, const struct signature_match *match_list, int nb_match, char *buffer, size_t size);
+
+#endif // SIGNATURE_DB_H
@@ -0,0 +1,34 @@
+#ifndef SIMD_KERNEL_H
+#define SIMD_KERNEL_H
+
+#include "core.h"
+#include "debug.h"
+
+/* a length field matches when it is within this many bytes of the payload length */
+#define LENGTH_MATCH_DIFF       8
+
+/* byte column and payload kernels, one implementation per instruction set */
+struct simd_kernel {
+    const char *name;
+
+    /* number of k in [1, size) with column[k] > column[k-1] */
+    int (*count_increment)(const uint8_t *column, int size);
+    /* largest bin of a 256-bin byte histogram */
+    int (*histogram_max)(const int *histogram);
+    /* 1 if an integer as wide as length, in either byte order, at any offset of payload[0..size)
+       is within LENGTH_MATCH_DIFF of length */
+    int (*has_length)(const uint8_t *payload, int size, uint32_t length);
+    /* weighted distance of a query to nb_block blocks of nb_field signature fields (see signature_db.h) over their first nb_compared
+       fields, into distance[SIGNATURE_BLOCK * nb_block], weight holds a row of 16 bytes per field, the weight of each code there
+       bit i of candidate[b] is set when signature i of block b is below limit, the other distances are only known to reach it */
+    void (*signature_distance)(const uint8_t *block_list, int nb_block, int nb_field, int nb_compared, const uint8_t *weight, int limit,
+                               uint8_t *distance, uint64_t *candidate);
+};
+
+/* selected once at startup from the cpu features */
+extern const struct simd_kernel *simd_kernel;
+
+void byte_histogram(const uint8_t *column, int size, int *histogram);
+int simd_kernel_self_check(void);
+
+#endif // SIMD_KERNEL_H
@@ -0,0 +1,96 @@
+#ifndef TCP_STREAM_H
+#define TCP_STREAM_H
+
+#include "core.h"
+#include "debug.h"
+#include "trace_parser.h"
+
+#define TCP_STREAM_MAX_PENDING      16      /* out of order segments held per direction, a gap is assumed beyond */
+#define TCP_STREAM_PENDING_BYTES    65536   /* captured bytes held per direction, a gap is assumed beyond */
+#define TCP_STREAM_CONFIRM          3       /* record ends on segment ends before a framing is trusted */
+#define TCP_STREAM_DETECT_SEGMENTS  64      /* in-order segments a direction has to show a framing */
+#define TCP_STREAM_MAX_CROSSED      12      /* segment ends within a record before a framing guess is dropped */
+#define TCP_RECORD_HEADER_MAX       8
+#define TCP_FRAMING_COUNT           2       /* tls, 16-bit length prefix */
+#define TLS_MAX_RECORD              (16384 + 2048)
+
+/* return value of tcp_stream_add : the segment is not reassembled, the caller keeps it as it is */
+#define TCP_STREAM_SEGMENT          2
+
+/* state of a direction */
+#define TCP_DIRECTION_NEW           0       /* no data yet */
+#define TCP_DIRECTION_DETECT        1       /* every framing is tried from a segment start */
+#define TCP_DIRECTION_RECORDS       2       /* framing found, records are reported */
+#define TCP_DIRECTION_SEGMENTS      3       /* no framing found, the segments are left to the filters */
+
+/* how records are delimited : a big endian 16-bit length in a fixed header */
+struct record_framing {
+    const char *name;
+    int header_size;
+    int length_offset;
+    int length_bias;                        /* record size = length + length_bias */
+    int max_length;
+    int (*check)(const uint8_t *header);    /* 0 if header cannot start a record */
+};
+
+/* a record being read, offsets are in the byte stream of the direction */
+struct record_parser {
+    uint64_t start;
+    uint64_t end;                           /* 0 until the header is read */
+    int len;                                /* bytes of the record held, from its start */
+    int emitted;
+    int nb_aligned;                         /* record ends that were segment ends */
+    int nb_crossed;                         /* segment ends within the current record */
+    int failed;                             /* out of sync, starts over on the next segment */
+    int64_t timestamp;                      /* of the segment the record starts in */
+    uint64_t packet_count;
+    uint8_t header[TCP_RECORD_HEADER_MAX];
+};
+
+/* segment received ahead of the bytes before it, its captured payload is copied */
+struct tcp_segment {
+    uint32_t seq;
+    uint32_t size;
+    uint32_t captured_size;
+    int64_t timestamp;
+    uint64_t packet_count;
+    uint8_t *data;
+};
+
+struct tcp_direction {
+    int state;
+    uint32_t next_seq;
+    uint64_t offset;                        /* stream offset of next_seq */
+    int nb_segment;                         /* in-order segments read while detecting */
+
+    struct record_parser parser[TCP_FRAMING_COUNT];     /* one per framing while detecting */
+    int framing;                            /* index of the framing found, -1 : none */
+
+    uint8_t *prefix;                        /* first bytes of the current record */
+    int prefix_size;
+
+    struct tcp_segment pending[TCP_STREAM_MAX_PENDING];     /* by sequence number */
+    int nb_pending;
+    size_t pending_bytes;
+};
+
+/* both directions of the first tcp connection of a window, side 0 sent its first data segment */
+struct tcp_stream {
+    int started;
+    struct ip_address ip[2];
+    uint16_t port[2];
+    struct tcp_direction direction[2];
+};
+
+/* called with each record prefix (aligned set) : payload is the prefix, payload_size the record size
+ * or, while no framing is found, with each in-order segment (aligned unset)
+ * returns WINDOW_COLLECTING to go on, anything else stops the segment */
+typedef int (*tcp_record_handler)(struct decoded_packet *record, int aligned, int64_t timestamp, uint64_t packet_count, void *arg);
+
+int tcp_stream_init(struct tcp_stream *stream, int nb_bytes);
+int tcp_stream_add(struct tcp_stream *stream, const struct decoded_packet *decoded, int64_t timestamp, uint64_t packet_count, tcp_record_handler handler_func, void *arg);
+size_t tcp_stream_size(const struct tcp_stream *stream);
+void tcp_stream_reset(struct tcp_stream *stream);
+void tcp_stream_release(struct tcp_stream *stream);
+
+#endif // TCP_STREAM_H
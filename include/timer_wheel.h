@@ -0,0 +1,36 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include "core.h"
+#include "debug.h"
+
+/* 4 levels of 64 slots : 1 tick resolution up to 64^4 ticks ahead */
+#define TIMER_WHEEL_BITS        6
+#define TIMER_WHEEL_SLOTS       (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK        (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS      4
+
+#define container_of(ptr, type, member) \
+            ((type *)((char *)(ptr) - offsetof(type, member)))
+
+/* intrusive timer, embedded in the object it expires */
+struct timer_node {
+    struct timer_node *next;
+    struct timer_node **pprev;      /* NULL when not armed */
+    uint64_t expire;
+};
+
+struct timer_wheel {
+    struct timer_node *slot[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    uint64_t now;                   /* next tick to run */
+    size_t nb_timer;
+};
+
+typedef void (*timer_callback)(struct timer_node *node, void *arg);
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now);
+void timer_wheel_add(struct timer_wheel *wheel, struct timer_node *node, uint64_t expire);
+void timer_wheel_del(struct timer_wheel *wheel, struct timer_node *node);
+void timer_wheel_advance(struct timer_wheel *wheel, uint64_t now, timer_callback callback, void *arg);
+
+#endif // TIMER_WHEEL_H
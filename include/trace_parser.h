@@ -3,6 +3,8 @@
 
 #include "core.h"
 #include "debug.h"
+#include "arena.h"
+#include "quantile.h"
 
 /* default snap length (maximum bytes per packet to capture) */
 #define SNAP_LEN 1518
@@ -39,6 +41,111 @@ struct sniff_ip {
 #define IP_HL(ip)               (((ip)->ip_vhl) & 0x0f)
 #define IP_V(ip)                (((ip)->ip_vhl) >> 4)
 
+/* IPv6 header */
+struct sniff_ipv6 {
+    uint32_t ip6_vfc;               /* version << 28 | traffic class << 20 | flow label */
+    uint16_t ip6_plen;              /* payload length, extension headers included */
+    uint8_t  ip6_nxt;               /* next header */
+    uint8_t  ip6_hlim;              /* hop limit */
+    struct  in6_addr ip6_src,ip6_dst;   /* source and dest address */
+};
+#define SIZE_IPV6               40
+
+/* IPv6 extension headers walked to the transport header (IPPROTO_HOPOPTS ...), longer chains are not decoded */
+#define IPV6_EXTENSION_MAX      8
+
+/* IPv6 fragment header */
+struct sniff_ipv6_frag {
+    uint8_t  ip6f_nxt;
+    uint8_t  ip6f_reserved;
+    uint16_t ip6f_offlg;            /* offset << 3 | more fragments */
+    uint32_t ip6f_ident;
+};
+#define IP6F_OFF_MASK           0xfff8
+#define IP6F_MORE_FRAG          0x0001
+
+/* ether types, in host order */
+#define ETHERTYPE_IPV4          0x0800
+#define ETHERTYPE_IPV6          0x86dd
+#define ETHERTYPE_VLAN          0x8100  /* 802.1Q */
+#define ETHERTYPE_QINQ          0x88a8  /* 802.1ad service tag */
+#define ETHERTYPE_QINQ_OLD      0x9100
+#define VLAN_TAG_SIZE           4
+#define VLAN_TAG_MAX            4       /* stacked tags decoded, deeper packets are skipped */
+
+/* tunnels, decapsulated up to parse_info.tunnel_depth layers */
+#define ETHERTYPE_TEB           0x6558  /* transparent ethernet bridging, ethernet in gre */
+#define TUNNEL_DEPTH_MAX        8
+
+#define GRE_HEADER_SIZE         4
+#define GRE_CHECKSUM            0x8000
+#define GRE_ROUTING             0x4000  /* deprecated source routing, not decoded */
+#define GRE_KEY                 0x2000
+#define GRE_SEQUENCE            0x1000
+#define GRE_VERSION_MASK        0x0007
+
+#define VXLAN_PORT              4789
+#define VXLAN_HEADER_SIZE       8
+#define VXLAN_FLAG_VNI          0x08
+
+#define GTPU_PORT               2152
+#define GTPU_HEADER_SIZE        8
+#define GTPU_VERSION_MASK       0xe0
+#define GTPU_VERSION_1          0x20
+#define GTPU_PT                 0x10    /* gtp, not gtp' */
+#define GTPU_OPTIONAL           0x07    /* extension header, sequence number, n-pdu number */
+#define GTPU_EXTENSION          0x04
+#define GTPU_GPDU               0xff
+#define GTPU_EXTENSION_MAX      4
+
+/* Linux cooked capture headers, the protocol is an ether type */
+#define SIZE_SLL                16
+#define SLL_PROTOCOL_OFFSET     14
+#define SIZE_SLL2               20
+#define SLL2_PROTOCOL_OFFSET    0
+
+/* address in network order, IPv4 as an IPv4-mapped IPv6 address (::ffff:a.b.c.d) */
+struct ip_address {
+    uint32_t word[4];
+};
+
+static inline void ip_address_set_v4(struct ip_address *address, uint32_t ipv4) {
+    address->word[0] = 0;
+    address->word[1] = 0;
+    address->word[2] = htonl(0xffff);
+    address->word[3] = ipv4;
+}
+
+static inline void ip_address_set_v6(struct ip_address *address, const struct in6_addr *ipv6) {
+    memcpy(address->word, ipv6, sizeof(address->word));
+}
+
+static inline int ip_address_is_v4(const struct ip_address *address) {
+    return address->word[0] == 0 && address->word[1] == 0 && address->word[2] == htonl(0xffff);
+}
+
+static inline int ip_address_equal(const struct ip_address *a, const struct ip_address *b) {
+    return ((a->word[0] ^ b->word[0]) | (a->word[1] ^ b->word[1]) | (a->word[2] ^ b->word[2]) | (a->word[3] ^ b->word[3])) == 0;
+}
+
+/* ipv4 dotted, ipv6 in brackets when a port follows */
+static inline void ip_address_to_string(const struct ip_address *address, int bracket, char *buffer, size_t size) {
+    char text[INET6_ADDRSTRLEN];
+
+    if (ip_address_is_v4(address)) {
+        inet_ntop(AF_INET, &address->word[3], buffer, size);
+        return;
+    }
+
+    inet_ntop(AF_INET6, address->word, text, sizeof(text));
+    snprintf(buffer, size, bracket ? "[%s]" : "%s", text);
+}
+
+/* any total order, the same one for every packet */
+static inline int ip_address_compare(const struct ip_address *a, const struct ip_address *b) {
+    return memcmp(a->word, b->word, sizeof(a->word));
+}
+
 /* TCP header */
 typedef uint32_t tcp_seq;
 
@@ -108,7 +215,7 @@ struct packet_info {
     struct sniff_wireguard wireguard;
     struct sniff_ikev2 ikev2;
 
-    struct timeval timestamp;
+    int64_t timestamp;          /* nanoseconds */
     uint16_t payload_length;
     uint8_t transport_protocol;
     uint8_t direction;
@@ -124,13 +231,120 @@ struct packet_info {
     uint8_t filter_by_length;
 
     uint8_t packet_segmented;
+    uint8_t record_aligned;     /* tcp : prefix of a reassembled record, segmented without the filters */
     uint8_t nb_filter_passed;
     uint8_t nb_filter_applied;
 };
 
-int check_ip_address(char *filename);
-int check_application_count(char *filename);
-int parse_pcap_into_packet_info(char *filename, struct packet_info *info_list, int nb_packet, int nb_byte);
+/* packet info list is grown by doubling while parsing, up to the analysis window
+ * from INITIAL_PACKET_CAPACITY for a single capture, from FLOW_PACKET_CAPACITY (flow.h) for a flow */
+#define INITIAL_PACKET_CAPACITY     1024
+#define ANALYSIS_WINDOW_SIZE        5000
+
+/* return values of parse_pcap_into_packet_info */
+#define PARSE_OK                    0
+#define PARSE_FAILED                -1
+#define PARSE_NOT_IP_PAIR           -2
+
+/* return values of a packet_decoder */
+#define DECODE_APPLICATION          0
+#define DECODE_SKIP                 1
+#define DECODE_FRAGMENT             2       /* ip fragment, for fragment_table_add() */
+#define DECODE_NO_IP                -1
+
+/* return values of packet_window_add */
+#define WINDOW_COLLECTING           0
+#define WINDOW_READY                1
+
+/* how packets are grouped into flows */
+#define FLOW_SINGLE                 0       /* the whole capture is one session */
+#define FLOW_BY_IP                  1       /* one flow per ip pair */
+#define FLOW_BY_PORT                2       /* one flow per 5-tuple */
+
+struct capture_filter;
+struct filter_info;
+struct tcp_stream;
+
+typedef struct parse_info {
+    int check_ip_pair;
+    int stream;
+    int flow_mode;
+    int reassemble;             /* tcp : records are reassembled, the filters only take the segments without framing */
+    int tunnel_depth;           /* tunnel layers decapsulated, 0 : none */
+
+    int window_size;
+    int nb_packets_needed;
+    int nb_bytes_needed;
+
+    int reader;                 /* CAPTURE_READER_MMAP or CAPTURE_READER_PCAP */
+    const struct capture_filter *prefilter;     /* packets dropped before the link decoder, NULL : none */
+    struct filter_info *filter;                 /* stream mode : tcp packets are filtered on arrival, NULL : at the end */
+
+    uint32_t idle_timeout;      /* seconds without packets before a flow expires, 0 : never */
+    uint64_t flow_memory;       /* bytes of flow state before the least recently used flow is evicted, 0 : no limit */
+}parse_info;
+
+/* headers of a decoded packet, addresses in network order and ports in host order */
+struct decoded_packet {
+    struct ip_address ip_src;
+    struct ip_address ip_dst;
+    uint16_t port_src;
+    uint16_t port_dst;
+    uint8_t protocol;
+    uint32_t seq;                   /* tcp : sequence number of the first payload byte */
+
+    /* DECODE_FRAGMENT : the payload is the part of the datagram (after the ip header) the fragment holds */
+    uint32_t fragment_id;
+    uint32_t fragment_offset;       /* bytes */
+    uint8_t fragment_more;
+
+    const char *payload;
+    uint64_t payload_size;          /* from the ip header */
+    uint64_t captured_size;         /* present in the capture */
+};
+
+/* decodes a packet of one link type, see link_decoder() : returns DECODE_APPLICATION, DECODE_SKIP, DECODE_FRAGMENT or DECODE_NO_IP
+ * addresses are set as soon as the ip header fits in the capture, unless DECODE_NO_IP is returned
+ * up to tunnel_depth tunnels (gre, vxlan, gtp-u, ip in ip) are decapsulated, the innermost packet is decoded */
+typedef int (*packet_decoder)(const unsigned char *packet, uint32_t caplen, int tunnel_depth, struct decoded_packet *decoded);
+
+/* latency filter of a window decided on arrival, against a running quantile estimate */
+struct latency_stream {
+    int64_t before_src;
+    int64_t before_dst;
+    struct quantile quantile;
+};
+
+/* packets of a flow kept for the analysis, at most parse_info.window_size */
+struct packet_window {
+    struct packet_info *info_list;
+    int nb_stored;
+    int capacity;
+    int initial_capacity;
+
+    /* the sender of the first application packet is SRC_TO_DST */
+    struct ip_address ip_src;
+    struct ip_address ip_dst;
+    uint16_t port_src;
+    uint16_t port_dst;
+
+    uint64_t src_count, dst_count;
+    uint64_t src_passed, dst_passed;
+
+    struct latency_stream latency;
+
+    struct tcp_stream *tcp;         /* allocated with the first tcp packet when parse_info.reassemble is set */
+
+    struct payload_arena arena;
+};
+
+int packet_window_init(struct packet_window *window, int nb_bytes, int chunk_slots, int initial_capacity);
+int packet_window_add(struct packet_window *window, struct parse_info *parse, struct decoded_packet *decoded, int64_t timestamp, uint64_t packet_count);
+void packet_window_finish(struct packet_window *window, struct parse_info *parse);
+void packet_window_reset(struct packet_window *window);
+void packet_window_release(struct packet_window *window);
+
+int parse_pcap_into_packet_info(char *filename, uint8_t *buffer, size_t size, struct parse_info *parse, struct packet_window *window);
 
 uint8_t get_openvpn_opcode(char *payload, int protocol);
 uint16_t get_openvpn_length(char *payload, int protocol);
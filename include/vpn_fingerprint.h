@@ -14,6 +14,10 @@
 #define FILTER_BY_ZERO_WINDOW           2
 #define NB_PACKET_MATCHED               5
 
+#define PERMUTATION_ORDER               3
+#define PERMUTATION_ORDER_MAX           5
+#define PERMUTATION_PATTERN_MAX         120     /* PERMUTATION_ORDER_MAX! */
+
 enum field_type {
     TYPE_STABLE,
     TYPE_INCREMENT,
@@ -35,20 +39,53 @@ typedef struct filter_info {
     int zero_consecutive;
 }filter_info;
 
+/* length field candidates : 1 to LENGTH_WIDTH_MAX bytes, both byte orders, bias below LENGTH_BIAS_WINDOW */
+#define LENGTH_WIDTH_MAX                4
+#define LENGTH_BIAS_WINDOW              32
+
+#define LENGTH_BIG_ENDIAN               0
+#define LENGTH_LITTLE_ENDIAN            1
+
+/* "L@<offset>/<width>/<be|le>/+<bias> " */
+#define LENGTH_FIELD_STRING_SIZE        32
+
+typedef struct length_field {
+    int offset;
+    int width;                          /* 0 : no length field */
+    int endian;
+    int bias;                           /* payload length - declared length */
+    double ratio;
+}length_field;
+
 typedef struct classification_result {
     uint8_t transport_protocol;
     uint8_t direction;
     int *field_type;
     double **field_prob;
+    struct length_field length_field;
 }classification_result;
 
+/* per-offset statistics, collected in a single sweep over a byte matrix row */
+typedef struct column_stats {
+    int byte_count[256];
+    int byte_count_max;
+    int increment_count;
+    int zero_count;
+    int pattern_count[PERMUTATION_PATTERN_MAX];
+}column_stats;
+
 typedef struct latency_info_t{
-    double latency;  
+    int64_t latency;            /* nanoseconds */
     int index;      
 } latency_info_t;
 
 typedef int (*type_classifier)(uint8_t *byte_list, double *prob);
 int classify_payload(struct packet_info *info_list, struct classification_result *result_list, int nb_application_count, int nb_packets_needed, int nb_bytes_needed);
+/* one token and a space per byte */
+#define TOKEN_BUFFER_SIZE(nb_bytes)     ((nb_bytes)*2 + 1)
+
+int field_type_to_string(struct classification_result *result_list, int nb_bytes_needed, char *buffer, size_t size);
+int length_field_to_string(const struct length_field *field, char *buffer, size_t size);
 // int type_stable_classifier(uint8_t *byte_list, double *prob);
 // int type_increment_classifier(uint8_t *byte_list, double *prob);
 // int type_length_classifier(uint8_t *byte_list, uint8_t *length_list, double *prob);
@@ -61,6 +98,8 @@ extern int enable_length_filter;
 
 typedef int (*packet_filter)(struct packet_info *info_list, int nb_packet, int nb_byte);
 int filter_packets(struct packet_info *info_list, struct filter_info *filter, int nb_application_packet, int nb_packets_needed, int nb_bytes_needed);
+void latency_stream_init(struct latency_stream *stream, double latency_percentage);
+int filter_packet_on_arrival(struct latency_stream *stream, struct filter_info *filter, struct packet_info *info, int nb_bytes_needed);
 // int filter_by_latency(struct packet_info *info_list, int nb_application_packet, int nb_bytes_needed);
 // int filter_by_zero(struct packet_info *info_list, int nb_application_packet, int nb_bytes_needed);
 // int filter_by_length(struct packet_info *info_list, int nb_application_packet, int nb_bytes_needed);
@@ -69,10 +108,13 @@ int filter_packets(struct packet_info *info_list, struct filter_info *filter, in
 int count_filtered_packets(struct packet_info *info_list, int nb_packet);
 int count_filtered_openvpn(char *filename, struct packet_info *info_list, int nb_packet);
 
+int ordinal_pattern(const uint8_t *window, int order);
+void count_ordinal_patterns(const uint8_t *sequence, int size, int order, int *pattern_counts);
+double permutation_entropy_from_counts(const int *pattern_counts, int order, int num_vectors);
+double shannon_entropy_from_counts(const int *frequencies, int size);
 double calculate_permutation_entropy(uint8_t *sequence, int size, int order);
 double calculate_shannon_entropy(uint8_t *sequence, int size);
 
-void timeval_subtract(struct timeval *result, struct timeval *x, struct timeval *y);
 extern uint64_t current_time;
 extern uint64_t elapsed_time;
 
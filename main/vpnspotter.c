@@ -2,6 +2,15 @@
 #include "../include/debug.h"
 #include "../include/trace_parser.h"
 #include "../include/vpn_fingerprint.h"
+#include "../include/flow.h"
+#include "../include/batch.h"
+#include "../include/pipeline.h"
+#include "../include/capture.h"
+#include "../include/prefetch.h"
+#include "../include/live.h"
+#include "../include/signature_db.h"
+
+#include <signal.h>
 
 #define MAX_ARG_LEN     256
 #define MAX_FILENAME    1024
@@ -10,6 +19,25 @@ char filename[MAX_FILENAME];
 int skip_pair_flag = 0;
 int nb_packets_needed = PACKET_WINDOW_SIZE;
 int nb_bytes_needed = NUM_OF_BYTES;
+int stream_flag = 0;
+int reassemble_flag = 1;
+int tunnel_depth = 0;
+int window_size = ANALYSIS_WINDOW_SIZE;
+int flow_mode = FLOW_SINGLE;
+uint32_t idle_timeout = 0;
+uint64_t flow_memory = 0;
+char batch_source[MAX_FILENAME];
+int nb_thread = 0;
+int ordered_flag = 1;
+int reader_type = CAPTURE_READER_MMAP;
+int prefetch_depth = PREFETCH_DEFAULT_DEPTH;
+char live_interface[MAX_ARG_LEN];
+char host_list[MAX_ARG_LEN];
+char port_list[MAX_ARG_LEN];
+char db_path[MAX_FILENAME];
+int top_k = SIGNATURE_TOP_DEFAULT;
+int length_field_flag = 0;
+struct signature_db signature_db;
 
 int enable_zero_filter = 0;
 int enable_latency_filter = 0;
@@ -70,6 +98,235 @@ int handle_nb_byte(const char *value, void *ptr) {
     return 0; 
 }
 
+int handle_stream(const char *value, void *ptr) {
+    debug("handle_stream : %s\n", value);
+    if (value == NULL || (value[0] != '0' && value[0] != '1') || value[1] != '\0') {
+        fprintf(stderr, "Error: -stream argument must be '0' or '1'. Got '%s'\n", value);
+        return -1; 
+    }
+    stream_flag = value[0] - '0';
+    
+    return 0;
+}
+
+int handle_reassemble(const char *value, void *ptr) {
+    debug("handle_reassemble : %s\n", value);
+    if (value == NULL || (value[0] != '0' && value[0] != '1') || value[1] != '\0') {
+        fprintf(stderr, "Error: -reassemble argument must be '0' or '1'. Got '%s'\n", value);
+        return -1; 
+    }
+    reassemble_flag = value[0] - '0';
+    
+    return 0;
+}
+
+int handle_tunnel(const char *value, void *ptr) {
+    char *endptr;
+    int result = (int)strtol(value, &endptr, 10);
+
+    debug("handle_tunnel : %s\n", value);
+    if (*endptr != '\0' || result < 0 || result > TUNNEL_DEPTH_MAX) {
+        fprintf(stderr, "Error: -tunnel requires a depth between 0 and %d, got '%s'\n", TUNNEL_DEPTH_MAX, value);
+        return -1;
+    }
+    tunnel_depth = result;
+
+    return 0;
+}
+
+int handle_window(const char *value, void *ptr) {
+    char *endptr;
+    int result = (int)strtol(value, &endptr, 10);
+
+    debug("handle_window : %s\n", value);
+    if (*endptr != '\0' || result <= 0) {
+        fprintf(stderr, "Error: -window requires a positive numeric value, got '%s'\n", value);
+        return -1; 
+    }
+    window_size = result;    
+
+    return 0; 
+}
+
+int handle_flow(const char *value, void *ptr) {
+    debug("handle_flow : %s\n", value);
+    if (strcmp(value, "ip") == 0) {
+        flow_mode = FLOW_BY_IP;
+    } else if (strcmp(value, "port") == 0) {
+        flow_mode = FLOW_BY_PORT;
+    } else {
+        fprintf(stderr, "Error: -flow argument must be 'ip' or 'port'. Got '%s'\n", value);
+        return -1;
+    }
+
+    return 0;
+}
+
+int handle_timeout(const char *value, void *ptr) {
+    char *endptr;
+    long result = strtol(value, &endptr, 10);
+
+    debug("handle_timeout : %s\n", value);
+    if (*endptr != '\0' || result < 0 || result > UINT32_MAX) {
+        fprintf(stderr, "Error: -timeout requires a number of seconds, got '%s'\n", value);
+        return -1;
+    }
+    idle_timeout = (uint32_t)result;
+
+    return 0;
+}
+
+int handle_flow_memory(const char *value, void *ptr) {
+    char *endptr;
+    long result = strtol(value, &endptr, 10);
+
+    debug("handle_flow_memory : %s\n", value);
+    if (*endptr != '\0' || result < 0) {
+        fprintf(stderr, "Error: -flow_memory requires a size in MB, got '%s'\n", value);
+        return -1;
+    }
+    flow_memory = (uint64_t)result << 20;
+
+    return 0;
+}
+
+int handle_batch(const char *value, void *ptr) {
+    debug("handle_batch : %s\n", value);
+    strcpy(batch_source, value);
+
+    return 0;
+}
+
+int handle_threads(const char *value, void *ptr) {
+    char *endptr;
+    int result = (int)strtol(value, &endptr, 10);
+
+    debug("handle_threads : %s\n", value);
+    if (*endptr != '\0' || result <= 0) {
+        fprintf(stderr, "Error: -threads requires a positive numeric value, got '%s'\n", value);
+        return -1; 
+    }
+    nb_thread = result;
+
+    return 0;
+}
+
+int handle_ordered(const char *value, void *ptr) {
+    debug("handle_ordered : %s\n", value);
+    if (value == NULL || (value[0] != '0' && value[0] != '1') || value[1] != '\0') {
+        fprintf(stderr, "Error: -ordered argument must be '0' or '1'. Got '%s'\n", value);
+        return -1; 
+    }
+    ordered_flag = value[0] - '0';
+    
+    return 0;
+}
+
+int handle_length_field(const char *value, void *ptr) {
+    debug("handle_length_field : %s\n", value);
+    if (value == NULL || (value[0] != '0' && value[0] != '1') || value[1] != '\0') {
+        fprintf(stderr, "Error: -length_field argument must be '0' or '1'. Got '%s'\n", value);
+        return -1; 
+    }
+    length_field_flag = value[0] - '0';
+    
+    return 0;
+}
+
+int handle_reader(const char *value, void *ptr) {
+    debug("handle_reader : %s\n", value);
+    if (strcmp(value, "mmap") == 0) {
+        reader_type = CAPTURE_READER_MMAP;
+    } else if (strcmp(value, "pcap") == 0) {
+        reader_type = CAPTURE_READER_PCAP;
+    } else {
+        fprintf(stderr, "Error: -reader argument must be 'mmap' or 'pcap'. Got '%s'\n", value);
+        return -1;
+    }
+
+    return 0;
+}
+
+int handle_prefetch(const char *value, void *ptr) {
+    char *endptr;
+    int result = (int)strtol(value, &endptr, 10);
+
+    debug("handle_prefetch : %s\n", value);
+    if (*endptr != '\0' || result < 0) {
+        fprintf(stderr, "Error: -prefetch requires a number of captures, got '%s'\n", value);
+        return -1;
+    }
+    prefetch_depth = result;
+
+    return 0;
+}
+
+int handle_live(const char *value, void *ptr) {
+    debug("handle_live : %s\n", value);
+    if (value[0] == '\0' || strlen(value) >= sizeof(live_interface)) {
+        fprintf(stderr, "Error: -live requires an interface name, got '%s'\n", value);
+        return -1;
+    }
+    strcpy(live_interface, value);
+
+    return 0;
+}
+
+// comma separated addresses or host names
+int handle_host(const char *value, void *ptr) {
+    debug("handle_host : %s\n", value);
+    for (const char *c = value; *c != '\0'; c++) {
+        if (!isalnum((unsigned char)*c) && strchr(".:-_,", *c) == NULL) {
+            fprintf(stderr, "Error: -host requires comma separated addresses, got '%s'\n", value);
+            return -1;
+        }
+    }
+    strcpy(host_list, value);
+
+    return 0;
+}
+
+// comma separated port numbers
+int handle_port(const char *value, void *ptr) {
+    const char *c = value;
+
+    debug("handle_port : %s\n", value);
+    while (*c != '\0') {
+        char *endptr;
+        long port = strtol(c, &endptr, 10);
+
+        if (endptr == c || port <= 0 || port > 65535 || (*endptr != ',' && *endptr != '\0')) {
+            fprintf(stderr, "Error: -port requires comma separated port numbers, got '%s'\n", value);
+            return -1;
+        }
+        c = endptr + (*endptr == ',');
+    }
+    strcpy(port_list, value);
+
+    return 0;
+}
+
+int handle_db(const char *value, void *ptr) {
+    debug("handle_db : %s\n", value);
+    strcpy(db_path, value);
+
+    return 0;
+}
+
+int handle_top(const char *value, void *ptr) {
+    char *endptr;
+    int result = (int)strtol(value, &endptr, 10);
+
+    debug("handle_top : %s\n", value);
+    if (*endptr != '\0' || result <= 0 || result > SIGNATURE_TOP_MAX) {
+        fprintf(stderr, "Error: -top requires a number of labels between 1 and %d, got '%s'\n", SIGNATURE_TOP_MAX, value);
+        return -1;
+    }
+    top_k = result;
+
+    return 0;
+}
+
 int handle_filter(const char *value, void *ptr) {
     struct filter_info *filter = (struct filter_info *)(ptr);
 
@@ -180,13 +437,31 @@ int handle_zero(const char *value, void *ptr) {
 }
 
 Option options[] = {
-    {"input", 1, "", handle_input},
+    {"input", 0, "", handle_input},
     {"skip_check", 0, "", handle_skip_pair},
     {"nb_packet", 0, "", handle_nb_packet},
     {"nb_byte", 0, "", handle_nb_byte},
     {"filter", 0, "", handle_filter},
     {"latency", 0, "", handle_latency},
     {"zero", 0, "", handle_zero},    
+    {"stream", 0, "", handle_stream},
+    {"reassemble", 0, "", handle_reassemble},
+    {"tunnel", 0, "", handle_tunnel},
+    {"window", 0, "", handle_window},
+    {"flow", 0, "", handle_flow},
+    {"timeout", 0, "", handle_timeout},
+    {"flow_memory", 0, "", handle_flow_memory},
+    {"batch", 0, "", handle_batch},
+    {"threads", 0, "", handle_threads},
+    {"ordered", 0, "", handle_ordered},
+    {"reader", 0, "", handle_reader},
+    {"prefetch", 0, "", handle_prefetch},
+    {"live", 0, "", handle_live},
+    {"host", 0, "", handle_host},
+    {"port", 0, "", handle_port},
+    {"db", 0, "", handle_db},
+    {"top", 0, "", handle_top},
+    {"length_field", 0, "", handle_length_field},
 };
 
 const int num_options = sizeof(options) / sizeof(Option);
@@ -230,87 +505,139 @@ void parse_arguments(int argc, char *argv[]) {
     }
 }
 
-int main(int argc, char *argv[]) {
-    struct packet_info *info_list;
-    struct classification_result result_list;
-    struct filter_info filter;
+#define CAPTURE_OK              0
+#define CAPTURE_NOT_IP_PAIR     -1
+#define CAPTURE_PARSE_FAILED    -2
+#define CAPTURE_NOT_ENOUGH      -3
+#define CAPTURE_FILTER_FAILED   -4
+#define CAPTURE_CLASSIFY_FAILED -5
 
-    uint64_t time1, time2, time3;
-    int nb_application_packet;
+/* field specification, followed by its length field with -length_field=1 and its nearest signatures with -db */
+#define OUTPUT_BUFFER_SIZE(nb_bytes)    (TOKEN_BUFFER_SIZE(nb_bytes) + LENGTH_FIELD_STRING_SIZE + SIGNATURE_MATCH_STRING_SIZE + 2)
 
-    filter.enable_latency_filter = 1;
-    filter.enable_length_filter = 1;
-    filter.enable_zero_filter = 1;
-    filter.nb_filter_needed = 2;
-    filter.latency_percentage = 40;
-    filter.zero_consecutive = 16;
+/* state of one capture, reused from one capture to the next (one per batch worker) */
+struct capture_state {
+    struct packet_window window;
+    struct classification_result result_list;
+    struct signature_cache cache;
+    char *token_buffer;
+};
 
-    parse_arguments(argc, argv);
-    
-    for (int i = 0; i < num_options; i++) {
-        if (strlen(options[i].value) > 0) {
-            if (options[i].handler(options[i].value, &filter)) {
-                return -1;
-            }            
-        }
+int capture_state_init(struct capture_state *state) {
+    // result_list.field_type = (int **)malloc(sizeof(int *) * nb_bytes_needed);
+    state->result_list.field_type = (int *)malloc(sizeof(int) * nb_bytes_needed);
+    state->result_list.field_prob = (double **)calloc(nb_bytes_needed, sizeof(double *));
+    state->token_buffer = (char *)malloc(sizeof(char) * OUTPUT_BUFFER_SIZE(nb_bytes_needed));
+    if (!state->result_list.field_type || !state->result_list.field_prob || !state->token_buffer) {
+        error("Memory allocation failed\n");
+        return -1;
     }
 
-    debug("filename : %s\n", filename);
-    debug("skip_pair_flag : %d\n", skip_pair_flag);
-    debug("nb_packets_needed : %d\n", nb_packets_needed);
-    debug("nb_bytes_needed : %d\n", nb_bytes_needed);
+    for (int i = 0; i < nb_bytes_needed; i++) {
+        // result_list.field_type[i] = (int *)malloc(sizeof(int) * FIELD_TYPE_SIZE);
+        state->result_list.field_prob[i] = (double *)malloc(sizeof(double) * FIELD_TYPE_SIZE);
+        if (!state->result_list.field_prob[i]) {
+            error("Memory allocation failed\n");
+            return -1;
+        }
+    }
 
-    if (skip_pair_flag == 0 && check_ip_address(filename)) {
-        error("ERROR: a pcap file should have 1 unique ip pair\n");
+    if (packet_window_init(&state->window, nb_bytes_needed, ARENA_CHUNK_SLOTS, INITIAL_PACKET_CAPACITY)) {
+        error("failed to initialize packet window\n");
         return -1;
     }
 
-    if ((nb_application_packet = check_application_count(filename)) == -1) {
-        error("ERROR: failed to get application layer count\n");
+    state->cache.entry_list = NULL;
+    if (signature_db.nb_signature > 0 && signature_cache_init(&state->cache)) {
         return -1;
     }
 
-    debug("nb_application_count : %d\n", nb_application_packet);
-    if (nb_application_packet < nb_packets_needed) {
-        error("ERROR: not enough packets (needed : %d, actual : %d)\n", nb_packets_needed, nb_application_packet);
-        return -1;
+    return 0;
+}
+
+void capture_state_release(struct capture_state *state) {
+    packet_window_release(&state->window);
+
+    if (state->result_list.field_prob) {
+        for (int i = 0; i < nb_bytes_needed; i++) {
+            free(state->result_list.field_prob[i]);
+        }
     }
+    free(state->result_list.field_prob);
+    free(state->result_list.field_type);
+    free(state->token_buffer);
+    signature_cache_release(&state->cache);
+}
+
+// appends "L@<offset>/<width>/<be|le>/+<bias> " to the field specification in token_buffer
+void append_length_field(struct classification_result *result_list, char *token_buffer) {
+    int len;
 
-    info_list = (struct packet_info *)malloc(sizeof(struct packet_info) * nb_application_packet);
-    for (int i = 0; i < nb_application_packet; i++) {
-        info_list[i].payload = (uint8_t *)malloc(sizeof(uint8_t) * nb_application_packet);
+    if (!length_field_flag) {
+        return;
     }
 
-    // result_list.field_type = (int **)malloc(sizeof(int *) * nb_bytes_needed);
-    result_list.field_type = (int *)malloc(sizeof(int) * nb_bytes_needed);
-    result_list.field_prob = (double **)malloc(sizeof(double *) * nb_bytes_needed);
-    for (int i = 0; i < nb_bytes_needed; i++) {
-        // result_list.field_type[i] = (int *)malloc(sizeof(int) * FIELD_TYPE_SIZE);
-        result_list.field_prob[i] = (double *)malloc(sizeof(double) * FIELD_TYPE_SIZE);
+    len = strlen(token_buffer);
+    length_field_to_string(&result_list->length_field, &token_buffer[len], OUTPUT_BUFFER_SIZE(nb_bytes_needed) - len);
+}
+
+// appends ": <label> (<distance>), ..." to the field specification in token_buffer
+void match_signatures(struct classification_result *result_list, struct signature_cache *cache, char *token_buffer) {
+    struct signature_match match_list[SIGNATURE_TOP_MAX];
+    int nb_match;
+    int len;
+
+    if (signature_db.nb_signature == 0) {
+        return;
     }
 
-    get_time();
+    nb_match = signature_db_match(&signature_db, result_list->field_type, nb_bytes_needed, top_k, cache, match_list);
+    len = strlen(token_buffer);
+    len += snprintf(&token_buffer[len], OUTPUT_BUFFER_SIZE(nb_bytes_needed) - len, ": ");
+    signature_match_to_string(&signature_db, match_list, nb_match, &token_buffer[len], OUTPUT_BUFFER_SIZE(nb_bytes_needed) - len);
+}
 
-    if (parse_pcap_into_packet_info(filename, info_list, nb_application_packet, nb_bytes_needed)) {
-        error("failed to parse pcap file : %s\n", filename);
-        return -1;
+// parse -> filter -> classify, the field specification (and its matches) is left in state->token_buffer
+// buffer is the content of path when it was read ahead (freed here), NULL to read the file
+// time_list gets the time of each step when not NULL
+int fingerprint_capture(char *path, uint8_t *buffer, size_t size, struct parse_info *parse, struct filter_info *filter, struct capture_state *state, uint64_t *time_list) {
+    struct packet_info *info_list;
+    int nb_application_packet;
+    int ret;
+
+    if (time_list) {
+        get_time();
     }
 
-    get_time();
-    time1 = elapsed_time;
+    ret = parse_pcap_into_packet_info(path, buffer, size, parse, &state->window);
+    if (ret == PARSE_NOT_IP_PAIR) {
+        return CAPTURE_NOT_IP_PAIR;
+    } else if (ret) {
+        return CAPTURE_PARSE_FAILED;
+    }
 
-    if (nb_application_packet > 5000) {
-        nb_application_packet = 5000;
+    if (time_list) {
+        get_time();
+        time_list[0] = elapsed_time;
     }
 
-    if (filter_packets(info_list, &filter, nb_application_packet, nb_packets_needed, nb_bytes_needed)) {
-        error("failed to filter\n");
-        return -1;
+    info_list = state->window.info_list;
+    nb_application_packet = state->window.nb_stored;
+
+    debug("nb_application_count : %d\n", nb_application_packet);
+    if (nb_application_packet < nb_packets_needed) {
+        return CAPTURE_NOT_ENOUGH;
+    }
+
+    if (filter_packets(info_list, filter, nb_application_packet, nb_packets_needed, nb_bytes_needed)) {
+        return CAPTURE_FILTER_FAILED;
     }    
     debug("total_direction : %d\n", info_list[0].total_direction);
 
-    get_time();
-    time2 = elapsed_time;
+    if (time_list) {
+        get_time();
+        time_list[1] = elapsed_time;
+    }
 
     // if (count_filtered_packets(info_list, nb_packet)) {
     //     return -1;
@@ -319,52 +646,432 @@ int main(int argc, char *argv[]) {
     // count_filtered_openvpn("tmp.txt", info_list, nb_application_packet);
     // debug_log("tmp.txt", "\n", 3);
 
-    if (classify_payload(info_list, &result_list, nb_application_packet, nb_packets_needed, nb_bytes_needed)) {
-        debug("failed to classify payload : %s\n", filename);
+    if (classify_payload(info_list, &state->result_list, nb_application_packet, nb_packets_needed, nb_bytes_needed)) {
+        return CAPTURE_CLASSIFY_FAILED;
+    }
+
+    if (time_list) {
+        get_time();
+        time_list[2] = elapsed_time;
+    }
+
+    field_type_to_string(&state->result_list, nb_bytes_needed, state->token_buffer, TOKEN_BUFFER_SIZE(nb_bytes_needed));
+    append_length_field(&state->result_list, state->token_buffer);
+    match_signatures(&state->result_list, &state->cache, state->token_buffer);
+
+    return CAPTURE_OK;
+}
+
+void capture_error_string(int ret, struct capture_state *state, char *buffer, size_t size) {
+    switch (ret) {
+    case CAPTURE_NOT_IP_PAIR:
+        snprintf(buffer, size, "ERROR: a pcap file should have 1 unique ip pair");
+        break;
+    case CAPTURE_PARSE_FAILED:
+        snprintf(buffer, size, "failed to parse pcap file");
+        break;
+    case CAPTURE_NOT_ENOUGH:
+        snprintf(buffer, size, "ERROR: not enough packets (needed : %d, actual : %d)", nb_packets_needed, state->window.nb_stored);
+        break;
+    case CAPTURE_FILTER_FAILED:
+        snprintf(buffer, size, "failed to filter");
+        break;
+    default:
+        snprintf(buffer, size, "failed to classify payload");
+        break;
+    }
+}
+
+struct batch_context {
+    char **file_list;
+    struct parse_info *parse;
+    struct filter_info *filter;
+    struct capture_state *state_list;       /* one per worker */
+    struct prefetch *prefetch_list;         /* one per worker */
+    struct batch_output output;
+};
+
+// starts reading a capture the worker is about to fingerprint
+void prefetch_batch_file(size_t index, int worker, void *arg) {
+    struct batch_context *context = (struct batch_context *)arg;
+
+    prefetch_add(&context->prefetch_list[worker], index, context->file_list[index]);
+}
+
+// "<file> : <field specification>", or "<file> : <error>"
+int fingerprint_batch_file(size_t index, int worker, void *arg) {
+    struct batch_context *context = (struct batch_context *)arg;
+    struct capture_state *state = &context->state_list[worker];
+    char *path = context->file_list[index];
+    char message[MAX_ARG_LEN];
+    const char *result;
+    uint8_t *buffer = NULL;
+    size_t buffer_size = 0;
+    size_t size;
+    char *line;
+    int ret;
+
+    prefetch_take(&context->prefetch_list[worker], index, &buffer, &buffer_size);
+
+    ret = fingerprint_capture(path, buffer, buffer_size, context->parse, context->filter, state, NULL);
+    if (ret == CAPTURE_OK) {
+        result = state->token_buffer;
+    } else {
+        capture_error_string(ret, state, message, sizeof(message));
+        result = message;
+    }
+
+    size = strlen(path) + strlen(result) + 4;
+    line = (char *)malloc(size);
+    if (line != NULL) {
+        snprintf(line, size, "%s : %s", path, result);
+    }
+    batch_output_put(&context->output, index, line);
+
+    return ret;
+}
+
+// every capture of the corpus on a work stealing pool
+int run_batch(struct parse_info *parse, struct filter_info *filter) {
+    struct batch_context context;
+    size_t nb_file;
+    int nb_worker;
+    int ret = 0;
+
+    if (corpus_list_files(batch_source, &context.file_list, &nb_file)) {
         return -1;
     }
 
-    get_time();
-    time3 = elapsed_time;
+    nb_worker = (nb_thread > 0) ? nb_thread : batch_nb_worker(nb_file);
+    debug("batch : %ld captures, %d workers\n", nb_file, nb_worker);
 
-    char *token_buffer = (char *)malloc(sizeof(char) * (nb_bytes_needed*2 + 1));
-    memset(token_buffer, 0, (nb_bytes_needed*2 + 1));
-    int buf_index = 0;
+    context.parse = parse;
+    context.filter = filter;
+    context.state_list = (struct capture_state *)calloc(nb_worker, sizeof(struct capture_state));
+    context.prefetch_list = (struct prefetch *)calloc(nb_worker, sizeof(struct prefetch));
+    if (context.state_list == NULL || context.prefetch_list == NULL || batch_output_init(&context.output, ordered_flag ? BATCH_ORDERED : BATCH_TAGGED, nb_file)) {
+        error("Memory allocation failed\n");
+        free(context.state_list);
+        free(context.prefetch_list);
+        corpus_release(context.file_list, nb_file);
+        return -1;
+    }
 
-    for (int i = 0; i < nb_bytes_needed; i++) {
-        const char *token = "N";
+    for (int i = 0; i < nb_worker; i++) {
+        if (capture_state_init(&context.state_list[i])) {
+            ret = -1;
+        }
+        // captures read through libpcap are not read ahead
+        if (prefetch_init(&context.prefetch_list[i], (reader_type == CAPTURE_READER_MMAP) ? prefetch_depth : 0)) {
+            ret = -1;
+        }
+    }
 
-        switch(result_list.field_type[i]) {
-        case TYPE_LENGTH:
-            token = "L";    
-            break;
-        case TYPE_ZERO:
-            token = "Z";
-            break;
-        case TYPE_STABLE:
-            token = "S";
-            break;
-        case TYPE_INCREMENT:
-            token = "I";
-            break;
-        case TYPE_HIGH_ENTROPY:
-            token = "R";
-            break;
-        case TYPE_UNKNOWN:
-            token = "U";
+    // a capture that cannot be fingerprinted is reported in its line, not as a batch failure
+    // each worker reads its next captures ahead while it fingerprints the current one
+    if (ret == 0) {
+        batch_run(nb_file, nb_worker, fingerprint_batch_file, prefetch_batch_file, prefetch_depth + 1, &context);
+    }
+
+    for (int i = 0; i < nb_worker; i++) {
+        capture_state_release(&context.state_list[i]);
+        prefetch_release(&context.prefetch_list[i]);
+    }
+    free(context.state_list);
+    free(context.prefetch_list);
+    batch_output_release(&context.output);
+    corpus_release(context.file_list, nb_file);
+
+    return ret;
+}
+
+struct flow_output {
+    struct filter_info *filter;
+    struct classification_result *result_list;
+    struct signature_cache *cache;
+    char *token_buffer;
+    char flow_buffer[FLOW_STRING_SIZE];
+};
+
+// one line per flow : "<flow> : <field specification>"
+void fingerprint_flow(struct flow *flow, void *arg) {
+    struct flow_output *output = (struct flow_output *)arg;
+    struct packet_window *window = &flow->window;
+
+    flow_to_string(flow, flow_mode, output->flow_buffer, sizeof(output->flow_buffer));
+
+    if (window->nb_stored < nb_packets_needed) {
+        debug("%s : not enough packets (needed : %d, actual : %d)\n", output->flow_buffer, nb_packets_needed, window->nb_stored);
+        return;
+    }
+
+    if (filter_packets(window->info_list, output->filter, window->nb_stored, nb_packets_needed, nb_bytes_needed)) {
+        debug("%s : failed to filter\n", output->flow_buffer);
+        return;
+    }
+
+    if (classify_payload(window->info_list, output->result_list, window->nb_stored, nb_packets_needed, nb_bytes_needed)) {
+        debug("%s : failed to classify payload\n", output->flow_buffer);
+        return;
+    }
+
+    field_type_to_string(output->result_list, nb_bytes_needed, output->token_buffer, TOKEN_BUFFER_SIZE(nb_bytes_needed));
+    append_length_field(output->result_list, output->token_buffer);
+    match_signatures(output->result_list, output->cache, output->token_buffer);
+    print("%s : %s\n", output->flow_buffer, output->token_buffer);
+}
+
+// flow mode on nb_thread workers, behind a reader thread or on their own live socket
+// each worker reports its own flows, in its own buffers
+int run_flow_pipeline(struct parse_info *parse, struct filter_info *filter, struct flow_stats *stats, struct live_stats *live_stats_list) {
+    struct capture_state *state_list;
+    struct flow_output *output_list;
+    void **arg_list;
+    int ret = 0;
+
+    state_list = (struct capture_state *)calloc(nb_thread, sizeof(struct capture_state));
+    output_list = (struct flow_output *)calloc(nb_thread, sizeof(struct flow_output));
+    arg_list = (void **)calloc(nb_thread, sizeof(void *));
+    if (!state_list || !output_list || !arg_list) {
+        error("Memory allocation failed\n");
+        ret = -1;
+    }
+
+    for (int i = 0; ret == 0 && i < nb_thread; i++) {
+        if (capture_state_init(&state_list[i])) {
+            ret = -1;
             break;
         }
+        output_list[i].filter = filter;
+        output_list[i].result_list = &state_list[i].result_list;
+        output_list[i].cache = &state_list[i].cache;
+        output_list[i].token_buffer = state_list[i].token_buffer;
+        arg_list[i] = &output_list[i];
+    }
+
+    if (ret == 0 && live_interface[0] != '\0') {
+        if (parse_live_into_flows_parallel(live_interface, parse, nb_thread, fingerprint_flow, arg_list, stats, live_stats_list)) {
+            error("failed to capture on %s\n", live_interface);
+            ret = -1;
+        }
+    } else if (ret == 0 && parse_pcap_into_flows_parallel(filename, parse, nb_thread, fingerprint_flow, arg_list, stats)) {
+        error("failed to parse pcap file : %s\n", filename);
+        ret = -1;
+    }
+
+    for (int i = 0; state_list && i < nb_thread; i++) {
+        capture_state_release(&state_list[i]);
+    }
+    free(state_list);
+    free(output_list);
+    free(arg_list);
+
+    return ret;
+}
+
+void stop_live_capture(int signum) {
+    int saved_errno = errno;
+
+    live_stop();
+    errno = saved_errno;
+}
+
+void print_live_stats(const char *name, struct live_stats *stats) {
+    double elapsed = (stats->elapsed > 0) ? stats->elapsed : 1;
+
+    error("%s : %lu packets (%lu bytes) received, %.0f packets/s, %.1f Mbit/s, %lu dropped by the kernel\n",
+          name, stats->nb_packet, stats->nb_byte, stats->nb_packet / elapsed, stats->nb_byte * 8 / elapsed / 1e6, stats->nb_drop);
+}
+
+// flow mode on the traffic of an interface, until SIGINT or SIGTERM
+// with -threads, one socket per worker in a fanout group, counters are reported per socket
+int run_live(struct parse_info *parse, struct filter_info *filter, struct flow_output *output) {
+    struct sigaction action;
+    struct flow_stats stats;
+    struct live_stats live_stats;
+    struct live_stats *live_stats_list;
+    char name[MAX_ARG_LEN + 16];
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_live_capture;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    // flows are reported while the capture runs
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    if (nb_thread <= 1) {
+        if (parse_live_into_flows(live_interface, parse, fingerprint_flow, output, &stats, &live_stats)) {
+            error("failed to capture on %s\n", live_interface);
+            return -1;
+        }
+        print_live_stats(live_interface, &live_stats);
+        debug("flows : %lu (expired : %lu, evicted : %lu)\n", stats.nb_flow, stats.nb_expired, stats.nb_evicted);
+        return 0;
+    }
 
-        int written = snprintf(&token_buffer[buf_index], (nb_bytes_needed*2 + 1) - buf_index, "%s ", token);
-        buf_index += written;
+    live_stats_list = (struct live_stats *)calloc(nb_thread, sizeof(struct live_stats));
+    if (live_stats_list == NULL) {
+        error("Memory allocation failed\n");
+        return -1;
     }
 
-    print("%s", token_buffer);
+    if (run_flow_pipeline(parse, filter, &stats, live_stats_list)) {
+        free(live_stats_list);
+        return -1;
+    }
+
+    memset(&live_stats, 0, sizeof(live_stats));
+    for (int i = 0; i < nb_thread; i++) {
+        snprintf(name, sizeof(name), "%s #%d", live_interface, i);
+        print_live_stats(name, &live_stats_list[i]);
+
+        live_stats.nb_packet += live_stats_list[i].nb_packet;
+        live_stats.nb_byte += live_stats_list[i].nb_byte;
+        live_stats.nb_drop += live_stats_list[i].nb_drop;
+        if (live_stats_list[i].elapsed > live_stats.elapsed) {
+            live_stats.elapsed = live_stats_list[i].elapsed;
+        }
+    }
+    print_live_stats(live_interface, &live_stats);
+    free(live_stats_list);
+
+    debug("flows : %lu (expired : %lu, evicted : %lu)\n", stats.nb_flow, stats.nb_expired, stats.nb_evicted);
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    struct capture_state state;
+    struct filter_info filter;
+    struct parse_info parse;
+    struct capture_filter prefilter;
+
+    char message[MAX_ARG_LEN];
+    uint64_t time_list[3];
+    int ret;
+
+    filter.enable_latency_filter = 1;
+    filter.enable_length_filter = 1;
+    filter.enable_zero_filter = 1;
+    filter.nb_filter_needed = 2;
+    filter.latency_percentage = 40;
+    filter.zero_consecutive = 16;
+
+    parse_arguments(argc, argv);
+    
+    for (int i = 0; i < num_options; i++) {
+        if (strlen(options[i].value) > 0) {
+            if (options[i].handler(options[i].value, &filter)) {
+                return -1;
+            }            
+        }
+    }
+
+    // a single capture or a corpus
+    if (filename[0] == '\0' && batch_source[0] == '\0' && live_interface[0] == '\0') {
+        error("-input, -batch or -live argument is mandatory.\n");
+        usage(argv[0]);
+    }
+
+    if (live_interface[0] != '\0' && (filename[0] != '\0' || batch_source[0] != '\0')) {
+        error("-live cannot be used with -input or -batch\n");
+        usage(argv[0]);
+    }
+
+    debug("filename : %s\n", filename);
+    debug("skip_pair_flag : %d\n", skip_pair_flag);
+    debug("nb_packets_needed : %d\n", nb_packets_needed);
+    debug("nb_bytes_needed : %d\n", nb_bytes_needed);
+    debug("stream_flag : %d\n", stream_flag);
+    debug("reassemble_flag : %d\n", reassemble_flag);
+    debug("tunnel_depth : %d\n", tunnel_depth);
+    debug("window_size : %d\n", window_size);
+    debug("db_path : %s\n", db_path);
+    debug("top_k : %d\n", top_k);
+
+    parse.check_ip_pair = (skip_pair_flag == 0);
+    parse.stream = stream_flag;
+    parse.flow_mode = flow_mode;
+    parse.reassemble = reassemble_flag;
+    parse.tunnel_depth = tunnel_depth;
+    parse.window_size = window_size;
+    parse.nb_packets_needed = nb_packets_needed;
+    parse.nb_bytes_needed = nb_bytes_needed;
+    parse.reader = reader_type;
+    parse.idle_timeout = idle_timeout;
+    parse.flow_memory = flow_memory;
+
+    // compiled once, before any reader or worker starts
+    if (capture_filter_init(&prefilter, host_list, port_list, tunnel_depth > 0)) {
+        return -1;
+    }
+    parse.prefilter = &prefilter;
+    parse.filter = &filter;
+
+    // shared by every worker, each keeps its own cache of matches
+    if (db_path[0] != '\0' && signature_db_load(&signature_db, db_path)) {
+        return -1;
+    }
+
+    if (batch_source[0] != '\0') {
+        if (flow_mode != FLOW_SINGLE) {
+            error("-batch fingerprints single session captures, it cannot be used with -flow\n");
+            return -1;
+        }
+        return run_batch(&parse, &filter);
+    }
+
+    // live traffic mixes sessions : one flow per 5-tuple unless -flow says otherwise
+    if (live_interface[0] != '\0' && flow_mode == FLOW_SINGLE) {
+        flow_mode = FLOW_BY_PORT;
+        parse.flow_mode = flow_mode;
+    }
+
+    if (capture_state_init(&state)) {
+        return -1;
+    }
+
+    // multi session capture : no ip pair check, one line per flow
+    if (flow_mode != FLOW_SINGLE) {
+        struct flow_output output = { &filter, &state.result_list, &state.cache, state.token_buffer };
+        struct flow_stats stats;
+
+        parse.check_ip_pair = 0;
+        if (live_interface[0] != '\0') {
+            return run_live(&parse, &filter, &output);
+        }
+        if (nb_thread > 1) {
+            if (run_flow_pipeline(&parse, &filter, &stats, NULL)) {
+                return -1;
+            }
+        } else if (parse_pcap_into_flows(filename, &parse, fingerprint_flow, &output, &stats)) {
+            error("failed to parse pcap file : %s\n", filename);
+            return -1;
+        }
+        debug("flows : %lu (expired : %lu, evicted : %lu)\n", stats.nb_flow, stats.nb_expired, stats.nb_evicted);
+        return 0;
+    }
+
+    ret = fingerprint_capture(filename, NULL, 0, &parse, &filter, &state, time_list);
+    if (ret != CAPTURE_OK) {
+        capture_error_string(ret, &state, message, sizeof(message));
+        if (ret == CAPTURE_PARSE_FAILED) {
+            error("%s : %s\n", message, filename);
+        } else if (ret == CAPTURE_CLASSIFY_FAILED) {
+            debug("%s : %s\n", message, filename);
+        } else {
+            error("%s\n", message);
+        }
+        return -1;
+    }
+
+    print("%s", state.token_buffer);
 
     print_time("; ");
-    print_time("%ld ", time1);
-    print_time("%ld ", time2);
-    print_time("%ld", time3);
+    print_time("%ld ", time_list[0]);
+    print_time("%ld ", time_list[1]);
+    print_time("%ld", time_list[2]);
 
     print("\n");
 
@@ -424,5 +1131,8 @@ int main(int argc, char *argv[]) {
     // //     debug("\n");  
     // // }
     
+    capture_state_release(&state);
+    capture_filter_release(&prefilter);
+
     return 0;
 }
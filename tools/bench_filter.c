@@ -0,0 +1,138 @@
+// per-packet cost of the zero-bit and length filters, before and after the word scan and the simd kernels
+// packet_filter.c is built into this file for its static functions, it is left out of the api sources it is linked with
+
+#include "../api/packet_filter.c"
+
+#define BENCH_SLOTS         65536
+#define BENCH_SLOT_SIZE     64
+#define BENCH_ROUNDS        200
+#define BENCH_ZERO_RUN      16
+#define BENCH_LENGTH_MIN    40
+#define BENCH_LENGTH_MAX    1439
+
+// the filters as they were before the word scan and the has_length kernels
+static int zero_bits_before(unsigned char *data, int length, int zero_consecutive) {
+    int consecutive = 0;
+
+    for (int i = 0; i < length; i++) {
+        for (int bit = 0; bit < 8; bit++) {
+            if (((data[i] >> bit) & 0x01) == 0) {
+                consecutive++;
+                if (consecutive >= zero_consecutive) {
+                    return PACKET_USED;
+                }
+            } else {
+                consecutive = 0;
+            }
+        }
+    }
+
+    return PACKET_NOT_USED;
+}
+
+static int length_before(const uint8_t *payload, int size, uint32_t length) {
+    int width = (length <= 0xFF) ? 1 : (length <= 0xFFFF) ? 2 : (length <= 0xFFFFFF) ? 3 : 4;
+
+    for (int offset = 0; offset <= size - width; offset++) {
+        uint32_t value_be = 0;
+        uint32_t value_le = 0;
+
+        for (int i = 0; i < width; i++) {
+            value_be = (value_be << 8) | payload[offset + i];
+            value_le = (value_le << 8) | payload[offset + width - 1 - i];
+        }
+        if (((value_be > length) ? value_be - length : length - value_be) <= LENGTH_MATCH_DIFF ||
+            ((value_le > length) ? value_le - length : length - value_le) <= LENGTH_MATCH_DIFF) {
+            return PACKET_USED;
+        }
+    }
+
+    return PACKET_NOT_USED;
+}
+
+static uint8_t *slot_list;
+static uint32_t length_list[BENCH_SLOTS];
+
+// ns per packet over BENCH_ROUNDS passes, nb_used gets the packets kept by one pass
+static double bench_zero(int (*filter)(unsigned char *, int, int), int size, int *nb_used) {
+    int used = 0;
+
+    get_time();
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        used = 0;
+        for (int i = 0; i < BENCH_SLOTS; i++) {
+            used += filter(slot_list + i * BENCH_SLOT_SIZE, size, BENCH_ZERO_RUN);
+        }
+    }
+    get_time();
+    *nb_used = used;
+
+    return (double)elapsed_time / ((double)BENCH_ROUNDS * BENCH_SLOTS);
+}
+
+static double bench_length(int (*filter)(const uint8_t *, int, uint32_t), int size, int *nb_used) {
+    int used = 0;
+
+    get_time();
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        used = 0;
+        for (int i = 0; i < BENCH_SLOTS; i++) {
+            used += filter(slot_list + i * BENCH_SLOT_SIZE, size, length_list[i]) != 0;
+        }
+    }
+    get_time();
+    *nb_used = used;
+
+    return (double)elapsed_time / ((double)BENCH_ROUNDS * BENCH_SLOTS);
+}
+
+int main(void) {
+    static const int size_list[] = {24, BENCH_SLOT_SIZE};
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    int used_before;
+    int used_after;
+    int ret = 0;
+
+    slot_list = (uint8_t *)malloc((size_t)BENCH_SLOTS * BENCH_SLOT_SIZE);
+    if (slot_list == NULL) {
+        return 1;
+    }
+    for (int i = 0; i < BENCH_SLOTS * BENCH_SLOT_SIZE; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        slot_list[i] = state >> 56;
+    }
+    for (int i = 0; i < BENCH_SLOTS; i++) {
+        length_list[i] = BENCH_LENGTH_MIN + (slot_list[i * BENCH_SLOT_SIZE] | (slot_list[i * BENCH_SLOT_SIZE + 1] << 8)) % (BENCH_LENGTH_MAX - BENCH_LENGTH_MIN + 1);
+    }
+
+    print("%d random slots, %d rounds, zero run of %d bits, lengths %d-%d, %s kernel\n",
+          BENCH_SLOTS, BENCH_ROUNDS, BENCH_ZERO_RUN, BENCH_LENGTH_MIN, BENCH_LENGTH_MAX, simd_kernel->name);
+    print("ns/packet          before    after\n");
+
+    for (int i = 0; i < 2; i++) {
+        double before = bench_zero(zero_bits_before, size_list[i], &used_before);
+        double after = bench_zero(has_consecutive_zero_bits, size_list[i], &used_after);
+
+        print("zero,   %2d B     %8.1f %8.1f\n", size_list[i], before, after);
+        if (used_before != used_after) {
+            error("zero filter mismatch at %d B : %d before, %d after\n", size_list[i], used_before, used_after);
+            ret = 1;
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        double before = bench_length(length_before, size_list[i], &used_before);
+        double after = bench_length(simd_kernel->has_length, size_list[i], &used_after);
+
+        print("length, %2d B     %8.1f %8.1f\n", size_list[i], before, after);
+        if (used_before != used_after) {
+            error("length filter mismatch at %d B : %d before, %d after\n", size_list[i], used_before, used_after);
+            ret = 1;
+        }
+    }
+
+    free(slot_list);
+
+    return ret;
+}
@@ -0,0 +1,42 @@
+#!/bin/sh
+# reads a multi gigabyte capture with the libpcap and the mmap readers, best of several warm runs
+# usage : tools/bench_reader.sh [megabytes] [nb_run]
+# vpnspotter must be built with make time : the parse time (first number after ';') covers reading and decoding
+
+BIN=${BIN:-./vpnspotter}
+CAPTURE=pcap_tmp_bench.pcap
+SIZE_MB=${1:-2048}
+NB_RUN=${2:-3}
+
+# one flow : the whole capture is read to check the ip pair
+if [ ! -f "$CAPTURE" ] || [ "$(($(stat -c %s "$CAPTURE") >> 20))" -lt "$SIZE_MB" ]; then
+    ./gen_capture "$CAPTURE" "$SIZE_MB" 1 || exit 1
+fi
+SIZE_MB=$(($(stat -c %s "$CAPTURE") >> 20))
+echo "capture : $SIZE_MB MB"
+
+for reader in pcap mmap; do
+    # first run only loads the page cache
+    if ! "$BIN" -input="$CAPTURE" -reader=$reader > /dev/null 2>&1; then
+        echo "-reader=$reader : failed"
+        continue
+    fi
+
+    best_wall=0
+    best_parse=0
+    run=0
+    while [ $run -lt "$NB_RUN" ]; do
+        start=$(date +%s%N)
+        parse=$("$BIN" -input="$CAPTURE" -reader=$reader 2>/dev/null | sed -n 's/.*; \([0-9]*\) .*/\1/p')
+        wall=$(($(date +%s%N) - start))
+        if [ $best_wall -eq 0 ] || [ $wall -lt $best_wall ]; then
+            best_wall=$wall
+        fi
+        if [ -n "$parse" ] && { [ $best_parse -eq 0 ] || [ "$parse" -lt $best_parse ]; }; then
+            best_parse=$parse
+        fi
+        run=$((run + 1))
+    done
+
+    echo "-reader=$reader : wall $((best_wall / 1000000)) ms, parse $((best_parse / 1000000)) ms, $((SIZE_MB * 1000000000 / (best_parse + 1))) MB/s"
+done
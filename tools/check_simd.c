@@ -0,0 +1,15 @@
+// differential check of the simd kernels the cpu supports against the scalar one and the original classifier loops, non-zero on a mismatch
+
+#include "../include/core.h"
+#include "../include/debug.h"
+#include "../include/simd_kernel.h"
+
+int main(void) {
+    if (simd_kernel_self_check()) {
+        error("simd kernel self check failed\n");
+        return 1;
+    }
+
+    print("simd kernels match the scalar one (selected : %s)\n", simd_kernel->name);
+    return 0;
+}
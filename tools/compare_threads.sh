@@ -0,0 +1,29 @@
+#!/bin/sh
+# classifies the flows of a tcp capture serially and with -threads, the sorted outputs must be identical
+# usage : tools/compare_threads.sh [capture] [nb_thread]
+# without a capture, tools/gen_capture writes 200 MB of 2000 interleaved openvpn over tcp flows
+
+BIN=${BIN:-./vpnspotter}
+CAPTURE=${1:-pcap_tmp_compare.pcap}
+NB_THREAD=${2:-3}
+
+if [ -z "$1" ]; then
+    ./gen_capture "$CAPTURE" 200 2000 || exit 1
+fi
+
+for flow in port ip; do
+    "$BIN" -input="$CAPTURE" -flow=$flow > pcap_tmp_serial.out 2> pcap_tmp_serial.err
+    "$BIN" -input="$CAPTURE" -flow=$flow -threads=$NB_THREAD > pcap_tmp_threads.out 2> pcap_tmp_threads.err
+    for stream in out err; do
+        sort -o pcap_tmp_serial.$stream pcap_tmp_serial.$stream
+        sort -o pcap_tmp_threads.$stream pcap_tmp_threads.$stream
+        if ! cmp -s pcap_tmp_serial.$stream pcap_tmp_threads.$stream; then
+            echo "-flow=$flow : -threads=$NB_THREAD differs from the serial run"
+            diff pcap_tmp_serial.$stream pcap_tmp_threads.$stream | head -20
+            exit 1
+        fi
+    done
+    echo "-flow=$flow : $(wc -l < pcap_tmp_serial.out) flows classified, $(wc -l < pcap_tmp_serial.err) rejected, serial and -threads=$NB_THREAD identical"
+done
+
+rm -f pcap_tmp_serial.out pcap_tmp_serial.err pcap_tmp_threads.out pcap_tmp_threads.err
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+// synthetic openvpn over tcp capture : records framed by a 2 byte length, cut in segments of at most MSS bytes,
+// sometimes two records per segment, a few segments swapped or repeated, flows interleaved
+// usage : gen_capture <output.pcap> <megabytes> [nb_flow] [seed]
+
+#define MSS             1400
+#define RECORD_MAX      3100
+#define FRAME_MAX       (14 + 20 + 20 + MSS)
+
+struct flow {
+    uint32_t seq[2];
+    uint32_t packet_id[2];
+};
+
+static uint64_t rng_state;
+static FILE *output;
+static uint64_t timestamp_us = 1000000000ULL;
+static uint64_t nb_written;
+
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+
+    return (uint32_t)(rng_state >> 32);
+}
+
+static uint32_t rng_range(uint32_t min, uint32_t max) {
+    return min + rng() % (max - min + 1);
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xFF;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    put16(p, v >> 16);
+    put16(p + 2, v & 0xFFFF);
+}
+
+static void write_packet(int flow_index, int direction, uint32_t seq, const uint8_t *payload, int size) {
+    uint8_t frame[FRAME_MAX];
+    uint8_t *ip = frame + 14;
+    uint8_t *tcp = ip + 20;
+    uint8_t client[4] = {10, (uint8_t)(1 + (flow_index >> 16)), (uint8_t)(flow_index >> 8), (uint8_t)flow_index};
+    uint8_t server[4] = {192, 168, 0, 1};
+    uint32_t header[4];
+    uint32_t sum = 0;
+    int i;
+
+    memset(frame, 0, 54);
+    memset(frame + 6, 0x11, 6);
+    put16(frame + 12, 0x0800);
+
+    ip[0] = 0x45;
+    put16(ip + 2, 40 + size);
+    ip[8] = 64;
+    ip[9] = 6;
+    memcpy(ip + 12, direction ? server : client, 4);
+    memcpy(ip + 16, direction ? client : server, 4);
+    for (i = 0; i < 20; i += 2) {
+        sum += (ip[i] << 8) | ip[i + 1];
+    }
+    sum = (sum >> 16) + (sum & 0xFFFF);
+    sum += sum >> 16;
+    put16(ip + 10, ~sum & 0xFFFF);
+
+    put16(tcp, direction ? 1194 : 40000 + (flow_index & 0x3FFF));
+    put16(tcp + 2, direction ? 40000 + (flow_index & 0x3FFF) : 1194);
+    put32(tcp + 4, seq);
+    tcp[12] = 5 << 4;
+    tcp[13] = 0x18;
+    put16(tcp + 14, 65535);
+    memcpy(tcp + 20, payload, size);
+
+    timestamp_us += rng_range(100, 10000);
+    header[0] = (uint32_t)(timestamp_us / 1000000);
+    header[1] = (uint32_t)(timestamp_us % 1000000);
+    header[2] = 54 + size;
+    header[3] = 54 + size;
+    fwrite(header, sizeof(header), 1, output);
+    fwrite(frame, 54 + size, 1, output);
+    nb_written += sizeof(header) + 54 + size;
+}
+
+static int build_record(struct flow *flow, int direction, uint8_t *buffer) {
+    static const uint8_t session_id[8] = {0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF, 0x11, 0x22};
+    int size;
+    int i;
+
+    switch (rng() % 3) {
+        case 0: size = rng_range(40, 120); break;
+        case 1: size = rng_range(200, 1300); break;
+        default: size = rng_range(1400, 3000); break;
+    }
+
+    flow->packet_id[direction]++;
+    put16(buffer, 1 + 8 + 4 + size);
+    buffer[2] = 0x30;
+    memcpy(buffer + 3, session_id, 8);
+    put32(buffer + 11, flow->packet_id[direction]);
+    for (i = 0; i < size; i++) {
+        buffer[15 + i] = rng() & 0xFF;
+    }
+
+    return 2 + 1 + 8 + 4 + size;
+}
+
+int main(int argc, char *argv[]) {
+    static uint8_t data[2 * RECORD_MAX];
+    struct flow *flow_list;
+    uint64_t target;
+    int nb_flow;
+    int flow_index;
+    int direction;
+    int size;
+    int offset;
+    int nb_segment;
+    int segment_order[2];
+    int i;
+    uint32_t file_header[6] = {0xA1B2C3D4, 0x00040002, 0, 0, 65535, 1};
+
+    if (argc < 3) {
+        fprintf(stderr, "usage : %s <output.pcap> <megabytes> [nb_flow] [seed]\n", argv[0]);
+        return 1;
+    }
+
+    target = strtoull(argv[2], NULL, 10) << 20;
+    nb_flow = (argc > 3) ? atoi(argv[3]) : 64;
+    rng_state = (argc > 4) ? strtoull(argv[4], NULL, 10) * 0x9E3779B97F4A7C15ULL + 1 : 0x9E3779B97F4A7C15ULL;
+    if (nb_flow <= 0) {
+        fprintf(stderr, "nb_flow must be positive\n");
+        return 1;
+    }
+
+    output = fopen(argv[1], "wb");
+    if (output == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    flow_list = (struct flow *)calloc(nb_flow, sizeof(struct flow));
+    if (flow_list == NULL) {
+        fclose(output);
+        return 1;
+    }
+    for (i = 0; i < nb_flow; i++) {
+        flow_list[i].seq[0] = rng();
+        flow_list[i].seq[1] = rng();
+    }
+
+    fwrite(file_header, sizeof(file_header), 1, output);
+    nb_written = sizeof(file_header);
+
+    while (nb_written < target) {
+        flow_index = rng() % nb_flow;
+        direction = rng() & 1;
+
+        size = build_record(&flow_list[flow_index], direction, data);
+        if (rng() % 5 == 0) {
+            size += build_record(&flow_list[flow_index], direction, data + size);
+        }
+
+        // the first two segments are swapped one time in ten, a segment is repeated one time in twenty
+        nb_segment = (size + MSS - 1) / MSS;
+        segment_order[0] = (nb_segment > 1 && rng() % 10 == 0) ? 1 : 0;
+        segment_order[1] = 1 - segment_order[0];
+        for (i = 0; i < nb_segment; i++) {
+            int segment = (i < 2) ? segment_order[i] : i;
+            int length;
+
+            offset = segment * MSS;
+            length = (size - offset < MSS) ? size - offset : MSS;
+            write_packet(flow_index, direction, flow_list[flow_index].seq[direction] + offset, data + offset, length);
+            if (rng() % 20 == 0) {
+                write_packet(flow_index, direction, flow_list[flow_index].seq[direction] + offset, data + offset, length);
+            }
+        }
+        flow_list[flow_index].seq[direction] += size;
+    }
+
+    free(flow_list);
+    fclose(output);
+
+    return 0;
+}